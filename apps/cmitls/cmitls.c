@@ -272,6 +272,12 @@ int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain
   return r;
 }
 
+void certificate_release(void *cbs, const void *cert_ptr)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  mipki_free_chain(st, (mipki_chain)cert_ptr);
+}
+
 int Configure(mitls_state **pstate)
 {
     mitls_state *state = NULL;
@@ -302,6 +308,7 @@ int Configure(mitls_state **pstate)
 
     r = FFI_mitls_configure(&state, option_version, option_hostname);
     if(r) r = FFI_mitls_configure_cert_callbacks(state, pki, &cert_callbacks);
+    if(r) r = FFI_mitls_configure_cert_release(state, certificate_release);
 
     if (r == 0) {
         printf("FFI_mitls_configure(%s,%s) failed.\n", option_version, option_hostname);
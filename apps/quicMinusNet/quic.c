@@ -25,6 +25,21 @@
 // e.g. callbacks, printers, etc.
 #include "quic_common.c"
 
+// With -events, print the handshake milestones recorded on this thread since
+// the last call, attributed to whichever side just ran. See tests/bench/hsevents.py
+static int print_events = 0;
+
+void dump_events(int is_server)
+{
+  mitls_event ev[64];
+  size_t n;
+  if(!print_events) return;
+  while((n = FFI_mitls_drain_events(ev, 64)) > 0)
+    for(size_t i = 0; i < n; i++)
+      printf("[%c] EVENT %llu %u %u\n", is_server?'S':'C',
+             (unsigned long long)ev[i].timestamp, ev[i].event, ev[i].connection);
+}
+
 void half_round(quic_state *my_state, quic_process_ctx *my_ctx, quic_process_ctx *peer_ctx, int *my_r, int *my_w, unsigned char *plain, unsigned char *cipher, size_t *plen, int is_server, int *my_ctr, int *peer_ctr)
 {
   if(*plen && *my_r >= 0)
@@ -95,6 +110,7 @@ void half_round(quic_state *my_state, quic_process_ctx *my_ctx, quic_process_ctx
   if(my_ctx->flags & QFLAG_APPLICATION_KEY)
     printf("[%c] Application data can now be sent (%s)\n",
            is_server?'S':'C', *my_w == 0 ? "0-RTT" : "1-RTT");
+  dump_events(is_server);
 }
 
 void reset_ctx(quic_process_ctx *cctx, quic_process_ctx *sctx, unsigned char *cbuf, unsigned char *sbuf, size_t cmax, size_t smax)
@@ -116,13 +132,15 @@ int main(int argc, char **argv)
 {
   hs_type mode = handshake_simple;
   
-  if(argc > 1)
+  for(int i = 1; i < argc; i++)
   {
-    if(!strcasecmp(argv[1], "0rtt"))
+    if(!strcasecmp(argv[i], "-events"))
+      print_events = 1;
+    if(!strcasecmp(argv[i], "0rtt"))
       mode = handshake_0rtt;
-    if(!strcasecmp(argv[1], "0rtt-reject"))
+    if(!strcasecmp(argv[i], "0rtt-reject"))
       mode = handshake_0rtt_reject;
-    if(!strcasecmp(argv[1], "hrr"))
+    if(!strcasecmp(argv[i], "hrr"))
       mode = handshake_stateless_retry;
   }
 
@@ -198,6 +216,7 @@ int main(int argc, char **argv)
   connection_state client = {.quic_state=NULL, pki=pki };
 
   FFI_mitls_init();
+  FFI_mitls_enable_events(print_events);
 
   size_t slen = 0, clen = 0, smax = 8*1024, cmax = 8*1024, plen;
   unsigned char sbuf[smax], cbuf[cmax], plain[2048], cipher[2048];
@@ -217,6 +236,7 @@ int main(int argc, char **argv)
     printf("[S] create\n");
     config.callback_state = &server;
     assert(FFI_mitls_quic_create(&server.quic_state, &config));
+    assert(FFI_mitls_quic_configure_cert_release(server.quic_state, certificate_release));
 
     config.is_server = 0;
     printf("[C] create\n");
@@ -246,6 +266,7 @@ int main(int argc, char **argv)
     printf("[S] create\n");
     config.callback_state = &server;
     assert(FFI_mitls_quic_create(&server.quic_state, &config));
+    assert(FFI_mitls_quic_configure_cert_release(server.quic_state, certificate_release));
 
     config.is_server = 0;
     printf("[C] create\n");
@@ -290,6 +311,7 @@ int main(int argc, char **argv)
     config.is_server = 1;
     config.callback_state = &server;
     assert(FFI_mitls_quic_create(&server.quic_state, &config));
+    assert(FFI_mitls_quic_configure_cert_release(server.quic_state, certificate_release));
 
     config.is_server = 0;
     printf("[C] create with ticket<%d> = ", qt->ticket_len);
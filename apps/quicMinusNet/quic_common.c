@@ -164,3 +164,9 @@ int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain
   mipki_free_chain(state->pki, chain);
   return 1;
 }
+
+void certificate_release(void *cbs, const void *cert_ptr)
+{
+  connection_state *state = (connection_state*)cbs;
+  mipki_free_chain(state->pki, (mipki_chain)cert_ptr);
+}
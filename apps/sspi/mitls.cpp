@@ -205,6 +205,12 @@ int MITLS_certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t
     return r;
 }
 
+void MITLS_certificate_release(void *cbs, const void *cert_ptr)
+{
+    ConnectionState *state = (ConnectionState*)cbs;
+    mipki_free_chain(state->pki, (mipki_chain)cert_ptr);
+}
+
 
 void ProcessConnect(TLS_CONNECT_WORK_ITEM* item)
 {
@@ -247,6 +253,9 @@ void ProcessConnect(TLS_CONNECT_WORK_ITEM* item)
         MITLS_certificate_verify
     };
     ret = FFI_mitls_configure_cert_callbacks(state->state, state, &cert_callbacks);
+    if (ret) {
+        ret = FFI_mitls_configure_cert_release(state->state, MITLS_certificate_release);
+    }
 
     if (state->pApplicationProtocols) {
         SEC_APPLICATION_PROTOCOLS  *pProtocols = (SEC_APPLICATION_PROTOCOLS *)state->pApplicationProtocols->pvBuffer;
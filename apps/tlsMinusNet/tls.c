@@ -0,0 +1,765 @@
+#define _GNU_SOURCE
+#define __USE_MINGW_ANSI_STDIO 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if __linux__
+#include <sched.h>
+#endif
+#include <openssl/evp.h>
+
+// TLS library
+#include "mitlsffi.h"
+// PKI library
+#include "mipki.h"
+
+// Local counterpart of quicMinusNet for the TCP API: a client runs
+// FFI_mitls_connect and a server FFI_mitls_accept_connected on one host,
+// over Unix domain sockets instead of the network.
+//
+// Both APIs block in their transport callbacks while holding the library
+// lock, so the server runs in a child process, forked for each scenario
+// and payload.  With both processes pinned to one core (-cpu), each runs
+// until it blocks on an empty socket, so runs are repeatable enough to
+// compare builds without network noise.
+//
+// With -offload, the application data is protected as with kTLS: the
+// client exports its keys after the handshake and protects records
+// itself (with OpenSSL), handing back post-handshake messages; the server
+// updates its keys, then exports its writer halfway through the response.
+//
+// The keyupdate scenario limits each traffic key to a few records, so that
+// both sides update their keys several times during the response and the
+// request/reply rounds that follow it.
+//
+// The receive-into scenario receives the response with
+// FFI_mitls_receive_into() and read-ahead, into a buffer of the minimum
+// size followed by a guard.  The server sends a small record, a KeyUpdate,
+// then full-size records: the post-handshake message is handled like a
+// ticket, by reading on to the next record, which must not be copied past
+// the small one.  (The TCP server sends its ticket before any data, so a
+// KeyUpdate stands in for it.)
+
+typedef struct {
+  const char *name;
+  const char *version;
+  const char *cipher_suites;
+  const char *named_groups;
+  int resume;      // second connection resumes with the ticket of the first
+  int early_data;  // enable 0-RTT on both sides (implies resume); the TCP
+                   // API cannot send early data, so the ticket and
+                   // extension processing are measured, not 0-RTT itself
+  int key_update;  // records per traffic key on both sides (0: default),
+                   // followed by KEY_UPDATE_ROUNDS request/reply rounds
+  int receive_into; // the client receives with FFI_mitls_receive_into()
+} scenario;
+
+static const scenario scenarios[] = {
+  { "1.3-aes128-x25519",     "1.3", "TLS_AES_128_GCM_SHA256",       "X25519", 0, 0, 0, 0 },
+  { "1.3-aes256-p256",       "1.3", "TLS_AES_256_GCM_SHA384",       "P-256",  0, 0, 0, 0 },
+  { "1.3-chacha-x25519",     "1.3", "TLS_CHACHA20_POLY1305_SHA256", "X25519", 0, 0, 0, 0 },
+  { "1.3-aes128-resume",     "1.3", "TLS_AES_128_GCM_SHA256",       "X25519", 1, 0, 0, 0 },
+  { "1.3-aes128-resume-0rtt-enabled", "1.3", "TLS_AES_128_GCM_SHA256", "X25519", 1, 1, 0, 0 },
+  { "1.3-aes128-keyupdate",  "1.3", "TLS_AES_128_GCM_SHA256",       "X25519", 0, 0, 4, 0 },
+  { "1.3-aes128-receive-into", "1.3", "TLS_AES_128_GCM_SHA256",     "X25519", 0, 0, 0, 1 },
+  { "1.2-ecdsa-aes128-p256", "1.2", "ECDHE-ECDSA-AES128-GCM-SHA256", "P-256", 0, 0, 0, 0 },
+  { "1.2-ecdsa-chacha-x25519", "1.2", "ECDHE-ECDSA-CHACHA20-POLY1305-SHA256", "X25519", 0, 0, 0, 0 },
+  { "1.2-ecdsa-aes128-resume", "1.2", "ECDHE-ECDSA-AES128-GCM-SHA256", "P-256", 1, 0, 0, 0 },
+};
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static const size_t default_payloads[] = { 0, 1024, 16384, 1024 * 1024 };
+#define DEFAULT_PAYLOADS (sizeof(default_payloads) / sizeof(default_payloads[0]))
+
+#define REQUEST_LEN 64
+#define ACK_LEN 16
+#define KEY_UPDATE_ROUNDS 16
+#define RECEIVE_INTO_CAPACITY 16384 // the minimum FFI_mitls_receive_into() accepts
+#define GUARD_LEN 1024
+#define READ_AHEAD (64 * 1024)
+
+static int offload = 0;
+
+// --------------------------------------------------------------------
+// Transport
+
+typedef struct {
+  int fd;
+  int side;        // 0 client, 1 server
+  mipki_state *pki;
+  const scenario *sc;
+  size_t payload;
+  const mitls_ticket *ticket; // client: ticket to resume with, if any
+} endpoint;
+
+static int MITLS_CALLCONV fd_send(void *ctx, const unsigned char *buffer, size_t buffer_size)
+{
+  endpoint *e = ctx;
+  size_t sent = 0;
+  while (sent < buffer_size) {
+    ssize_t n = write(e->fd, buffer + sent, buffer_size - sent);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    sent += n;
+  }
+  return (int)buffer_size;
+}
+
+static int MITLS_CALLCONV fd_recv(void *ctx, unsigned char *buffer, size_t buffer_size)
+{
+  endpoint *e = ctx;
+  ssize_t n;
+  do {
+    n = read(e->fd, buffer, buffer_size);
+  } while (n < 0 && errno == EINTR);
+  return n > 0 ? (int)n : -1;
+}
+
+// --------------------------------------------------------------------
+// PKI callbacks, as in quicMinusNet but without tracing
+
+static void *MITLS_CALLCONV certificate_select(void *cbs, mitls_version ver, const unsigned char *sni, size_t sni_len, const unsigned char *alpn, size_t alpn_len, const mitls_signature_scheme *sigalgs, size_t sigalgs_len, mitls_signature_scheme *selected)
+{
+  mipki_state *pki = cbs;
+  return (void*)mipki_select_certificate(pki, (const char*)sni, sni_len, sigalgs, sigalgs_len, selected);
+}
+
+static size_t MITLS_CALLCONV certificate_format(void *cbs, const void *cert_ptr, unsigned char *buffer)
+{
+  mipki_state *pki = cbs;
+  return mipki_format_chain(pki, cert_ptr, (char*)buffer, MAX_CHAIN_LEN);
+}
+
+static size_t MITLS_CALLCONV certificate_sign(void *cbs, const void *cert_ptr, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, unsigned char *sig)
+{
+  mipki_state *pki = cbs;
+  size_t ret = MAX_SIGNATURE_LEN;
+  if (mipki_sign_verify(pki, cert_ptr, sigalg, (const char*)tbs, tbs_len, (char*)sig, &ret, MIPKI_SIGN))
+    return ret;
+  return 0;
+}
+
+static int MITLS_CALLCONV certificate_verify(void *cbs, const unsigned char *chain_bytes, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len)
+{
+  mipki_state *pki = cbs;
+  mipki_chain chain = mipki_parse_chain(pki, (const char*)chain_bytes, chain_len);
+  size_t slen = sig_len;
+  int r;
+
+  if (chain == NULL)
+    return 0;
+  // The test CA is trusted, but the chain is not validated: this is a benchmark
+  r = mipki_sign_verify(pki, chain, sigalg, (const char*)tbs, tbs_len, (char*)sig, &slen, MIPKI_VERIFY);
+  mipki_free_chain(pki, chain);
+  return r;
+}
+
+static void MITLS_CALLCONV certificate_release(void *cbs, const void *cert_ptr)
+{
+  mipki_state *pki = cbs;
+  mipki_free_chain(pki, cert_ptr);
+}
+
+static mitls_cert_cb cert_callbacks = {
+  .select = certificate_select,
+  .format = certificate_format,
+  .sign = certificate_sign,
+  .verify = certificate_verify
+};
+
+static mitls_ticket *saved_ticket = NULL;
+
+static void MITLS_CALLCONV ticket_cb(void *cb_state, const char *sni, const mitls_ticket *ticket)
+{
+  mitls_ticket *t = malloc(sizeof(mitls_ticket));
+  unsigned char *tb = malloc(ticket->ticket_len), *sb = malloc(ticket->session_len);
+  memcpy(tb, ticket->ticket, ticket->ticket_len);
+  memcpy(sb, ticket->session, ticket->session_len);
+  t->ticket = tb;
+  t->ticket_len = ticket->ticket_len;
+  t->session = sb;
+  t->session_len = ticket->session_len;
+  if (saved_ticket != NULL) {
+    free((void*)saved_ticket->ticket);
+    free((void*)saved_ticket->session);
+    free(saved_ticket);
+  }
+  saved_ticket = t;
+}
+
+// Receives exactly len application bytes, all equal to c
+static int receive_all(mitls_state *state, size_t len, unsigned char c)
+{
+  while (len > 0) {
+    size_t n;
+    int ok = 1;
+    unsigned char *b = FFI_mitls_receive(state, &n);
+    if (b == NULL || n > len)
+      return 0;
+    for (size_t i = 0; i < n; i++)
+      ok &= b[i] == c;
+    FFI_mitls_free(state, b);
+    if (!ok)
+      return 0;
+    len -= n;
+  }
+  return 1;
+}
+
+// Waits until the socket of e holds at least len bytes, so that read-ahead
+// then buffers all the records they contain at once
+static void wait_buffered(endpoint *e, size_t len)
+{
+  int n;
+  while (ioctl(e->fd, FIONREAD, &n) == 0 && (size_t)n < len)
+    usleep(1000);
+}
+
+// As receive_all, with FFI_mitls_receive_into(); fails if it writes past
+// RECEIVE_INTO_CAPACITY bytes
+static int receive_into_all(mitls_state *state, size_t len, unsigned char c)
+{
+  static unsigned char b[RECEIVE_INTO_CAPACITY + GUARD_LEN];
+  memset(b + RECEIVE_INTO_CAPACITY, 'g', GUARD_LEN);
+  while (len > 0) {
+    size_t n;
+    int more, ok = 1;
+    if (FFI_mitls_receive_into(state, b, RECEIVE_INTO_CAPACITY, &n, &more) != TLS_receive_data
+        || n > len)
+      return 0;
+    for (size_t i = 0; i < n; i++)
+      ok &= b[i] == c;
+    for (size_t i = 0; i < GUARD_LEN; i++)
+      ok &= b[RECEIVE_INTO_CAPACITY + i] == 'g';
+    if (!ok)
+      return 0;
+    len -= n;
+  }
+  return 1;
+}
+
+// --------------------------------------------------------------------
+// Record protection offload: what a kTLS socket does with exported keys
+
+#define MAX_PLAIN 16384
+
+typedef struct {
+  mitls_traffic_key k;
+  EVP_CIPHER_CTX *ctx;
+} host_key;
+
+static int host_key_export(mitls_state *state, int reader, host_key *h)
+{
+  const EVP_CIPHER *cipher;
+  if (!FFI_mitls_export_traffic_key(state, reader, &h->k))
+    return 0;
+  switch (h->k.alg) {
+    case TLS_aead_AES_128_GCM: cipher = EVP_aes_128_gcm(); break;
+    case TLS_aead_AES_256_GCM: cipher = EVP_aes_256_gcm(); break;
+    case TLS_aead_CHACHA20_POLY1305: cipher = EVP_chacha20_poly1305(); break;
+    default: return 0;
+  }
+  if (h->ctx == NULL)
+    h->ctx = EVP_CIPHER_CTX_new();
+  return h->ctx != NULL
+    && (size_t)EVP_CIPHER_key_length(cipher) == h->k.key_len
+    && EVP_CipherInit_ex(h->ctx, cipher, NULL, NULL, NULL, !reader);
+}
+
+// TLS 1.3 and TLS 1.2 ChaCha20: iv XOR seqn; TLS 1.2 AES-GCM: salt || seqn
+static void host_key_nonce(const host_key *h, unsigned char nonce[12])
+{
+  memset(nonce, 0, 12);
+  memcpy(nonce + 12 - h->k.iv_len, h->k.iv, h->k.iv_len);
+  for (int i = 0; i < 8; i++) {
+    unsigned char b = (unsigned char)(h->k.seqn >> (8 * (7 - i)));
+    if (h->k.iv_len == 12)
+      nonce[4 + i] ^= b;
+    else
+      nonce[4 + i] = b;
+  }
+}
+
+static size_t explicit_nonce(const host_key *h)
+{
+  return h->k.version == TLS_1p2 && h->k.iv_len == 4 ? 8 : 0;
+}
+
+static void put16(unsigned char *p, size_t v)
+{
+  p[0] = (unsigned char)(v >> 8);
+  p[1] = (unsigned char)v;
+}
+
+// TLS 1.2 additional data: seqn || type || version || plaintext length
+static void aad12(const host_key *h, unsigned char ct, size_t len, unsigned char aad[13])
+{
+  for (int i = 0; i < 8; i++)
+    aad[i] = (unsigned char)(h->k.seqn >> (8 * (7 - i)));
+  aad[8] = ct; aad[9] = 3; aad[10] = 3;
+  put16(aad + 11, len);
+}
+
+// Seals and sends one record of type ct
+static int host_send(endpoint *e, host_key *h, unsigned char ct, const unsigned char *b, size_t len)
+{
+  unsigned char record[5 + 8 + MAX_PLAIN + 1 + 16], nonce[12], aad[13];
+  unsigned char *body = record + 5 + explicit_nonce(h);
+  size_t plain = len, aad_len = 5;
+  int n;
+
+  memcpy(body, b, len);
+  record[0] = ct;
+  if (h->k.version == TLS_1p3) {
+    body[plain++] = ct;
+    record[0] = 23;
+  }
+  record[1] = 3; record[2] = 3;
+  put16(record + 3, explicit_nonce(h) + plain + 16);
+  host_key_nonce(h, nonce);
+  if (h->k.version == TLS_1p3) {
+    memcpy(aad, record, 5);
+  } else {
+    aad12(h, ct, len, aad);
+    aad_len = 13;
+    memcpy(record + 5, aad, explicit_nonce(h));
+  }
+  if (!EVP_CipherInit_ex(h->ctx, NULL, NULL, h->k.key, nonce, 1)
+      || !EVP_CipherUpdate(h->ctx, NULL, &n, aad, (int)aad_len)
+      || !EVP_CipherUpdate(h->ctx, body, &n, body, (int)plain)
+      || !EVP_CipherFinal_ex(h->ctx, body + n, &n)
+      || !EVP_CIPHER_CTX_ctrl(h->ctx, EVP_CTRL_AEAD_GET_TAG, 16, body + plain))
+    return 0;
+  h->k.seqn++;
+  fd_send(e, record, 5 + explicit_nonce(h) + plain + 16);
+  return 1;
+}
+
+static int recv_exactly(endpoint *e, unsigned char *b, size_t len)
+{
+  while (len > 0) {
+    int n = fd_recv(e, b, len);
+    if (n <= 0)
+      return 0;
+    b += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// Receives and opens one record; returns its plaintext length, or -1
+static int host_recv(endpoint *e, host_key *h, unsigned char *ct, unsigned char *b)
+{
+  unsigned char record[5 + 8 + MAX_PLAIN + 256 + 16], nonce[12], aad[13], *body;
+  size_t len, plain, aad_len = 5;
+  int n;
+
+  if (!recv_exactly(e, record, 5))
+    return -1;
+  len = (size_t)record[3] << 8 | record[4];
+  if (len < explicit_nonce(h) + 16 || len > sizeof(record) - 5 || !recv_exactly(e, record + 5, len))
+    return -1;
+  body = record + 5 + explicit_nonce(h);
+  plain = len - explicit_nonce(h) - 16;
+  host_key_nonce(h, nonce);
+  if (h->k.version == TLS_1p3) {
+    memcpy(aad, record, 5);
+  } else {
+    aad12(h, record[0], plain, aad);
+    aad_len = 13;
+    if (explicit_nonce(h))
+      memcpy(nonce + 4, record + 5, 8);
+  }
+  if (!EVP_CipherInit_ex(h->ctx, NULL, NULL, h->k.key, nonce, 0)
+      || !EVP_CIPHER_CTX_ctrl(h->ctx, EVP_CTRL_AEAD_SET_TAG, 16, body + plain)
+      || !EVP_CipherUpdate(h->ctx, NULL, &n, aad, (int)aad_len)
+      || !EVP_CipherUpdate(h->ctx, b, &n, body, (int)plain)
+      || !EVP_CipherFinal_ex(h->ctx, b + n, &n))
+    return -1;
+  h->k.seqn++;
+  *ct = record[0];
+  if (h->k.version == TLS_1p3) {
+    // strip the padding, then the inner content type
+    while (plain > 0 && b[plain - 1] == 0)
+      plain--;
+    if (plain == 0)
+      return -1;
+    *ct = b[--plain];
+  }
+  return (int)plain;
+}
+
+// Hands a post-handshake message back to miTLS and sends its reply, if any
+static int host_handback(endpoint *e, mitls_state *state, host_key *r, host_key *w, const unsigned char *b, size_t len, int *rekeyed)
+{
+  unsigned char reply[MAX_PLAIN];
+  for (;;) {
+    size_t consumed, reply_len = sizeof(reply);
+    int flags;
+    if (!FFI_mitls_handback_handshake(state, b, len, &consumed, reply, &reply_len, &flags))
+      return 0;
+    if (reply_len > 0 && !host_send(e, w, 22, reply, reply_len))
+      return 0;
+    if ((flags & MITLS_HANDBACK_READER_REKEYED) && !host_key_export(state, 1, r))
+      return 0;
+    if ((flags & MITLS_HANDBACK_WRITER_REKEYED) && !host_key_export(state, 0, w))
+      return 0;
+    *rekeyed |= flags & (MITLS_HANDBACK_READER_REKEYED | MITLS_HANDBACK_WRITER_REKEYED);
+    b += consumed;
+    len -= consumed;
+    if (len == 0 && !(flags & MITLS_HANDBACK_OUTPUT_PENDING))
+      return 1;
+  }
+}
+
+// With TLS 1.3, the server updates its keys and asks for ours before the
+// response, unless it is too short to be split
+static int offload_updates(const endpoint *e)
+{
+  return !strcmp(e->sc->version, "1.3") && e->payload / 2 > 0;
+}
+
+#define BOTH_REKEYED (MITLS_HANDBACK_READER_REKEYED | MITLS_HANDBACK_WRITER_REKEYED)
+
+// The client side of -offload: both directions are exported after the
+// handshake; post-handshake messages (TLS 1.3 tickets and KeyUpdate) are
+// handed back, and the keys exported again when they change
+static int offload_client(endpoint *e, mitls_state *state, const unsigned char *request)
+{
+  host_key r = { .ctx = NULL }, w = { .ctx = NULL };
+  unsigned char b[MAX_PLAIN + 256], ct, ack[ACK_LEN];
+  size_t received = 0;
+  int ok, rekeyed = 0;
+
+  memset(ack, 'a', sizeof(ack));
+  ok = host_key_export(state, 1, &r)
+    && host_key_export(state, 0, &w)
+    && host_send(e, &w, 23, request, REQUEST_LEN);
+  while (ok && (received < e->payload || (offload_updates(e) && rekeyed != BOTH_REKEYED))) {
+    int n = host_recv(e, &r, &ct, b);
+    if (n < 0 || (ct != 22 && ct != 23)) {
+      ok = 0;
+    } else if (ct == 22) {
+      ok = host_handback(e, state, &r, &w, b, n, &rekeyed);
+    } else {
+      for (int i = 0; i < n; i++)
+        ok &= b[i] == 'r';
+      received += n;
+    }
+  }
+  ok = ok && received == e->payload
+    && (!offload_updates(e) || rekeyed == BOTH_REKEYED)
+    && host_send(e, &w, 23, ack, ACK_LEN);
+  EVP_CIPHER_CTX_free(r.ctx);
+  EVP_CIPHER_CTX_free(w.ctx);
+  return ok;
+}
+
+// The server side of -offload: miTLS sends the first half of the response,
+// preceded by a KeyUpdate with TLS 1.3, then the host sends the rest; the
+// client's KeyUpdate and acknowledgment are received by miTLS
+static int offload_server(endpoint *e, mitls_state *state, const unsigned char *response)
+{
+  host_key w = { .ctx = NULL };
+  size_t half = e->payload / 2;
+  int ok = (!offload_updates(e) || FFI_mitls_key_update(state, 1))
+    && (half == 0 || FFI_mitls_send(state, response, half))
+    && host_key_export(state, 0, &w);
+  for (size_t sent = half; ok && sent < e->payload; ) {
+    size_t n = e->payload - sent < MAX_PLAIN ? e->payload - sent : MAX_PLAIN;
+    ok = host_send(e, &w, 23, response + sent, n);
+    sent += n;
+  }
+  ok = ok && receive_all(state, ACK_LEN, 'a');
+  EVP_CIPHER_CTX_free(w.ctx);
+  return ok;
+}
+
+// --------------------------------------------------------------------
+// The two sides
+
+static mitls_state *configure(endpoint *e)
+{
+  mitls_state *state = NULL;
+  if (!FFI_mitls_configure(&state, e->sc->version, e->side ? "" : "localhost")
+      || !FFI_mitls_configure_cert_callbacks(state, e->pki, &cert_callbacks)
+      || !FFI_mitls_configure_cert_release(state, certificate_release)
+      || !FFI_mitls_configure_cipher_suites(state, e->sc->cipher_suites)
+      || !FFI_mitls_configure_named_groups(state, e->sc->named_groups)
+      || !FFI_mitls_configure_signature_algorithms(state, "ECDSA+SHA256")
+      || (e->sc->early_data && !FFI_mitls_configure_early_data(state, 16 * 1024))
+      || (e->sc->key_update && !FFI_mitls_configure_key_update(state, e->sc->key_update, 0))
+      || (e->sc->receive_into && !offload && !e->side && !FFI_mitls_configure_read_ahead(state, READ_AHEAD))
+      || (e->sc->receive_into && !offload && e->side && !FFI_mitls_configure_record_size(state, 0, 0, 0))
+      || (!e->side && !FFI_mitls_configure_ticket_callback(state, NULL, ticket_cb))
+      || (e->ticket != NULL && !FFI_mitls_configure_ticket(state, e->ticket))) {
+    if (state != NULL)
+      FFI_mitls_close(state);
+    return NULL;
+  }
+  return state;
+}
+
+// The client sends a REQUEST_LEN request and reads a payload-sized response
+static int run_client(endpoint *e)
+{
+  unsigned char request[REQUEST_LEN];
+  int ok;
+  mitls_state *state = configure(e);
+  if (state == NULL)
+    return 0;
+  memset(request, 'q', sizeof(request));
+  ok = FFI_mitls_connect(e, fd_send, fd_recv, state);
+  if (offload) {
+    ok = ok && offload_client(e, state, request);
+  } else if (e->sc->receive_into) {
+    ok = ok && FFI_mitls_send(state, request, sizeof(request));
+    // the small record, the KeyUpdate and a full-size record, each with at
+    // least a header and a tag, must be buffered together
+    if (ok && e->payload >= REQUEST_LEN + RECEIVE_INTO_CAPACITY)
+      wait_buffered(e, REQUEST_LEN + RECEIVE_INTO_CAPACITY + 3 * (5 + 16));
+    ok = ok && receive_into_all(state, e->payload, 'r');
+  } else {
+    ok = ok && FFI_mitls_send(state, request, sizeof(request))
+      && receive_all(state, e->payload, 'r');
+  }
+  // after the keys were updated by the response, each round is a record in
+  // either direction: both sides keep updating their keys as they go
+  for (int i = 0; ok && !offload && e->sc->key_update && i < KEY_UPDATE_ROUNDS; i++)
+    ok = FFI_mitls_send(state, request, sizeof(request))
+      && receive_all(state, REQUEST_LEN, 'r');
+  FFI_mitls_close(state);
+  return ok;
+}
+
+static int run_server(endpoint *e)
+{
+  int ok;
+  mitls_state *state = configure(e);
+  if (state == NULL)
+    return 0;
+  ok = FFI_mitls_accept_connected(e, fd_send, fd_recv, state)
+    && receive_all(state, REQUEST_LEN, 'q');
+  if (ok && (e->payload > 0 || offload)) {
+    unsigned char *response = malloc(e->payload + 1);
+    memset(response, 'r', e->payload);
+    if (offload)
+      ok = offload_server(e, state, response);
+    else if (e->sc->receive_into && e->payload > REQUEST_LEN)
+      ok = FFI_mitls_send(state, response, REQUEST_LEN)
+        && FFI_mitls_key_update(state, 0)
+        && FFI_mitls_send(state, response + REQUEST_LEN, e->payload - REQUEST_LEN);
+    else
+      ok = FFI_mitls_send(state, response, e->payload);
+    free(response);
+  }
+  if (ok && !offload && e->sc->key_update) {
+    unsigned char reply[REQUEST_LEN];
+    memset(reply, 'r', sizeof(reply));
+    for (int i = 0; ok && i < KEY_UPDATE_ROUNDS; i++)
+      ok = receive_all(state, REQUEST_LEN, 'q')
+        && FFI_mitls_send(state, reply, sizeof(reply));
+  }
+  FFI_mitls_close(state);
+  return ok;
+}
+
+// The server process: accepts connections until it is killed
+static void serve(int listener, mipki_state *pki, const scenario *sc, size_t payload)
+{
+  for (;;) {
+    endpoint e = { accept(listener, NULL, NULL), 1, pki, sc, payload, NULL };
+    if (e.fd < 0) {
+      if (errno == EINTR)
+        continue;
+      _exit(1);
+    }
+    if (!run_server(&e))
+      _exit(1);
+    close(e.fd);
+  }
+}
+
+// One connection; returns 1 if the client completed
+static int connection(const struct sockaddr_un *addr, mipki_state *pki, const scenario *sc, size_t payload, const mitls_ticket *ticket)
+{
+  endpoint e = { socket(AF_UNIX, SOCK_STREAM, 0), 0, pki, sc, payload, ticket };
+  int ok;
+  if (e.fd < 0)
+    return 0;
+  ok = connect(e.fd, (const struct sockaddr*)addr, sizeof(*addr)) == 0 && run_client(&e);
+  close(e.fd);
+  return ok;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs n connections of a scenario and prints one line of results
+static int run(mipki_state *pki, const scenario *sc, size_t payload, int n)
+{
+  const mitls_ticket *ticket = NULL;
+  struct sockaddr_un addr;
+  double t0 = 0, t1 = 0;
+  int listener, ok = 1, status;
+  const char *failure = NULL;
+  pid_t server;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/tlsMinusNet.%d", (int)getpid());
+  unlink(addr.sun_path);
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (const struct sockaddr*)&addr, sizeof(addr)) != 0
+      || listen(listener, 1) != 0) {
+    printf("%-30s %9zu  FAILED (socket)\n", sc->name, payload);
+    return 0;
+  }
+  fflush(stdout);
+  server = fork();
+  if (server == 0)
+    serve(listener, pki, sc, payload);
+  close(listener);
+
+  if (server < 0) {
+    failure = "fork";
+  } else if (sc->resume
+      // The ticket comes from a full handshake, which is not timed
+      && (!connection(&addr, pki, sc, 0, NULL) || saved_ticket == NULL)) {
+    failure = "no ticket";
+  } else {
+    ticket = sc->resume ? saved_ticket : NULL;
+    t0 = now();
+    for (int i = 0; i < n && ok; i++) {
+      ok = connection(&addr, pki, sc, payload, ticket);
+      if (sc->resume)
+        ticket = saved_ticket;
+    }
+    t1 = now();
+    if (!ok)
+      failure = "connection";
+  }
+
+  if (server > 0) {
+    kill(server, SIGTERM);
+    waitpid(server, &status, 0);
+  }
+  unlink(addr.sun_path);
+  if (failure != NULL) {
+    printf("%-30s %9zu  FAILED (%s)\n", sc->name, payload, failure);
+    return 0;
+  }
+  printf("%-30s %9zu %10.1f %12.3f %10.1f\n", sc->name, payload,
+         n / (t1 - t0), 1000 * (t1 - t0) / n,
+         (double)payload * n / (t1 - t0) / (1024 * 1024));
+  fflush(stdout);
+  return 1;
+}
+
+static void usage(const char *argv0)
+{
+  printf("usage: %s [-n connections] [-s scenario] [-p payload-bytes] [-cpu core] [-offload]\n", argv0);
+  printf("  -s and -p may be repeated; by default, every scenario runs with\n");
+  printf("  payloads of 0, 1K, 16K and 1M bytes. Scenarios:\n");
+  for (size_t i = 0; i < SCENARIOS; i++)
+    printf("    %s\n", scenarios[i].name);
+}
+
+int main(int argc, char **argv)
+{
+  const scenario *selected[SCENARIOS];
+  size_t payloads[16];
+  size_t nselected = 0, npayloads = 0;
+  int n = 100, cpu = 0, failures = 0, erridx;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      n = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-offload")) {
+      offload = 1;
+    } else if (!strcmp(argv[i], "-cpu") && i + 1 < argc) {
+      cpu = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-p") && i + 1 < argc && npayloads < 16) {
+      payloads[npayloads++] = (size_t)strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc && nselected < SCENARIOS) {
+      size_t j;
+      for (j = 0; j < SCENARIOS && strcmp(scenarios[j].name, argv[i + 1]); j++);
+      if (j == SCENARIOS) {
+        usage(argv[0]);
+        return 1;
+      }
+      selected[nselected++] = &scenarios[j];
+      i++;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (nselected == 0)
+    for (; nselected < SCENARIOS; nselected++)
+      selected[nselected] = &scenarios[nselected];
+  if (npayloads == 0)
+    for (; npayloads < DEFAULT_PAYLOADS; npayloads++)
+      payloads[npayloads] = default_payloads[npayloads];
+
+  // A server may still be writing when its client closes
+  signal(SIGPIPE, SIG_IGN);
+
+#if __linux__
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+      printf("WARNING: cannot pin to core %d\n", cpu);
+  }
+#endif
+
+  // Server PKI configuration: one ECDSA certificate
+  mipki_config_entry pki_config[1] = {
+    {
+      .cert_file = "../../data/server-ecdsa.crt",
+      .key_file = "../../data/server-ecdsa.key",
+      .is_universal = 1 // ignore SNI
+    }
+  };
+
+  mipki_state *pki = mipki_init(pki_config, 1, NULL, &erridx);
+  if (!pki) {
+    printf("Failed to initialize PKI library: errid=%d\n", erridx);
+    return 1;
+  }
+  if (!mipki_add_root_file_or_path(pki, "../../data/CAFile.pem")) {
+    printf("Failed to add CAFile\n");
+    return 1;
+  }
+  if (!FFI_mitls_init()) {
+    printf("Failed to initialize miTLS\n");
+    return 1;
+  }
+
+  printf("%-30s %9s %10s %12s %10s\n", "scenario", "payload", "conn/s", "ms/conn", "MiB/s");
+  for (size_t i = 0; i < nselected; i++)
+    for (size_t j = 0; j < npayloads; j++)
+      failures += !run(pki, selected[i], payloads[j], n);
+
+  FFI_mitls_cleanup();
+  mipki_free(pki);
+  return failures ? 2 : 0;
+}
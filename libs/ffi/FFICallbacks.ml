@@ -1,5 +1,8 @@
 type callbacks = int64
 
+external ocaml_send_tcp: callbacks -> callbacks -> string -> int = "ocaml_send_tcp"
+external ocaml_recv_tcp: callbacks -> callbacks -> int -> string option = "ocaml_recv_tcp"
+
 external ocaml_ticket_cb: callbacks -> callbacks -> string -> string -> string -> unit = "ocaml_ticket_cb"
 
 external ocaml_cert_select_cb: callbacks -> callbacks -> int -> string * string -> string -> (callbacks * int) option = "ocaml_cert_select_cb"
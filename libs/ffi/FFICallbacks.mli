@@ -1,5 +1,8 @@
 type callbacks = int64
 
+val ocaml_send_tcp: callbacks -> callbacks -> string -> int
+val ocaml_recv_tcp: callbacks -> callbacks -> int -> string option
+
 val ocaml_ticket_cb: callbacks -> callbacks -> string -> string -> string -> unit
 
 val ocaml_cert_select_cb: callbacks -> callbacks -> int -> (string * string) -> string -> (callbacks * int) option
@@ -9,12 +9,20 @@
 #include <errno.h> // MinGW only provides include/errno.h
 #include <malloc.h>
 #endif
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+#include <windows.h>
+#else
+#define IS_WINDOWS 0
+#include <pthread.h>
+#endif
 #include <caml/callback.h>
 #include <caml/alloc.h>
 #include <caml/memory.h>
 #include <caml/threads.h>
 #include <caml/printexc.h>
 #include <caml/fail.h>
+#include <caml/signals.h>
 #include "mitlsffi.h"
 
 #define MITLS_FFI_LIST \
@@ -75,6 +83,74 @@ typedef struct mitls_state {
 
 static int isRegistered;
 
+// Threads are registered with the OCaml runtime the first time they call
+// into miTLS and stay registered until they exit: registering and
+// unregistering around every call is expensive and serializes all callers
+// on the runtime lock.
+#if defined(_MSC_VER)
+static __declspec(thread) int thread_registered;
+#else
+static __thread int thread_registered;
+#endif
+
+// Runs on the exiting thread, which no longer holds the runtime lock
+static void
+#if IS_WINDOWS
+WINAPI
+#endif
+unregister_thread(void *unused)
+{
+    caml_c_thread_unregister();
+    thread_registered = 0;
+}
+
+#if IS_WINDOWS
+// A fiber-local slot with a callback is the Windows equivalent of a
+// pthread key with a destructor
+static DWORD thread_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE thread_key_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK create_thread_key(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    thread_key = FlsAlloc(unregister_thread);
+    return thread_key != FLS_OUT_OF_INDEXES;
+}
+
+static void set_thread_key(void)
+{
+    if (InitOnceExecuteOnce(&thread_key_once, create_thread_key, NULL, NULL)) {
+        FlsSetValue(thread_key, &thread_registered);
+    }
+}
+#else
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void create_thread_key(void)
+{
+    pthread_key_create(&thread_key, unregister_thread);
+}
+
+static void set_thread_key(void)
+{
+    pthread_once(&thread_key_once, create_thread_key);
+    pthread_setspecific(thread_key, &thread_registered);
+}
+#endif
+
+static void register_thread(void)
+{
+    if (!thread_registered) {
+        caml_c_thread_register();
+        // Any non-NULL value makes the destructor run at thread exit
+        set_thread_key();
+        thread_registered = 1;
+    }
+}
+
+#define ENTER_CAML() do { register_thread(); caml_acquire_runtime_system(); } while (0)
+#define LEAVE_CAML() caml_release_runtime_system()
+
 // A default print callback that logs to stdout
 void MITLS_CALLCONV default_trace(const char *msg)
 {
@@ -101,7 +177,7 @@ void MITLS_CALLCONV FFI_mitls_set_trace_callback(pfn_mitls_trace_callback cb)
 int MITLS_CALLCONV FFI_mitls_init(void)
 {
     if (isRegistered) {
-        caml_c_thread_register();
+        register_thread();
         return 1;
     }
 
@@ -129,6 +205,9 @@ int MITLS_CALLCONV FFI_mitls_init(void)
     // Release it, so other threads can call into OCaml.
     caml_release_runtime_system();
 
+    // The thread that started the runtime is known to OCaml already and
+    // must never be unregistered.
+    thread_registered = 1;
     isRegistered = 1;
 
     return 1; // success
@@ -194,11 +273,9 @@ int MITLS_CALLCONV FFI_mitls_configure(mitls_state **state, const char *tls_vers
 
     *state = NULL;
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = FFI_mitls_configure_caml(state, tls_version, host_name);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
 
     return ret;
 }
@@ -249,55 +326,45 @@ static int ocaml_set_global_key(int sealing, const char *alg, const unsigned cha
 int MITLS_CALLCONV FFI_mitls_set_ticket_key(const char *alg, const unsigned char *tk, size_t klen)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = ocaml_set_global_key(0, alg, tk, klen);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
 int MITLS_CALLCONV FFI_mitls_set_sealing_key(const char *alg, const unsigned char *tk, size_t klen)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = ocaml_set_global_key(1, alg, tk, klen);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
 int MITLS_CALLCONV FFI_mitls_configure_cipher_suites(/* in */ mitls_state *state, const char * cs)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = configure_common_caml(state, cs, g_mitls_FFI_SetCipherSuites);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
 int MITLS_CALLCONV FFI_mitls_configure_signature_algorithms(/* in */ mitls_state *state, const char * sa)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = configure_common_caml(state, sa, g_mitls_FFI_SetSignatureAlgorithms);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
 int MITLS_CALLCONV FFI_mitls_configure_named_groups(/* in */ mitls_state *state, const char * ng)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = configure_common_caml(state, ng, g_mitls_FFI_SetNamedGroups);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -341,11 +408,9 @@ static int ocaml_set_alpn(/* in */ mitls_state *state, const mitls_alpn *alpn, s
 int MITLS_CALLCONV FFI_mitls_configure_alpn(/* in */ mitls_state *state, const mitls_alpn *alpn, size_t alpn_count)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = ocaml_set_alpn(state, alpn, alpn_count);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -393,11 +458,9 @@ static int ocaml_set_ticket_callback(/* in */ mitls_state *state, void *cb_state
 int MITLS_CALLCONV FFI_mitls_configure_ticket_callback(/* in */ mitls_state *state, void *cb_state, pfn_FFI_ticket_cb ticket_cb)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = ocaml_set_ticket_callback(state, cb_state, ticket_cb);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -444,11 +507,9 @@ static int ocaml_set_cert_callbacks(/* in */ mitls_state *state, void *cb_state,
 int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *state, void *cb_state, mitls_cert_cb *cert_cb)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = ocaml_set_cert_callbacks(state, cb_state, cert_cb);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -475,11 +536,9 @@ int MITLS_CALLCONV FFI_mitls_configure_early_data(/* in */ mitls_state *state, u
 {
     int ret;
     value max_ed = Val_int(max_early_data);
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = configure_common_bool_caml(state, max_ed, g_mitls_FFI_SetEarlyData);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -487,11 +546,9 @@ int MITLS_CALLCONV FFI_mitls_configure_early_data(/* in */ mitls_state *state, u
 void MITLS_CALLCONV FFI_mitls_close(mitls_state *state)
 {
     if (state) {
-        caml_c_thread_register();
-        caml_acquire_runtime_system();
+        ENTER_CAML();
         caml_remove_generational_global_root(&state->fstar_state);
-        caml_release_runtime_system();
-        caml_c_thread_unregister();
+        LEAVE_CAML();
         state->fstar_state = 0;
         free(state);
     }
@@ -572,11 +629,9 @@ int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send psend, pf
     int ret;
     mitls_ticket ticket = {0};
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = FFI_mitls_connect_caml(send_recv_ctx, psend, precv, state, &ticket);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -584,11 +639,9 @@ int MITLS_CALLCONV FFI_mitls_resume(void *send_recv_ctx, pfn_FFI_send psend, pfn
 {
     int ret;
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = FFI_mitls_connect_caml(send_recv_ctx, psend, precv, state, ticket);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -628,11 +681,9 @@ int MITLS_CALLCONV FFI_mitls_accept_connected(void *send_recv_ctx, pfn_FFI_send
 {
     int ret;
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = FFI_mitls_accept_connected_caml(send_recv_ctx, psend, precv, state);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -663,11 +714,9 @@ int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned ch
 {
     int ret;
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = FFI_mitls_send_caml(state, buffer, buffer_size);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return ret;
 }
 
@@ -694,11 +743,9 @@ unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /*
 {
     void *p;
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     p = FFI_mitls_receive_caml(state, packet_size);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return p;
 }
 
@@ -742,11 +789,9 @@ int MITLS_CALLCONV FFI_mitls_get_exporter(/* in */ mitls_state *state, int early
 {
   int ret;
 
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
+  ENTER_CAML();
   ret = ocaml_get_exporter(state, early, secret);
-  caml_release_runtime_system();
-  caml_c_thread_unregister();
+  LEAVE_CAML();
   return ret;
 }
 
@@ -772,11 +817,9 @@ void *MITLS_CALLCONV FFI_mitls_get_cert(/* in */ mitls_state *state, /* out */ s
 {
     void *p;
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     p = FFI_mitls_get_cert_caml(state, cert_size);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
     return p;
 }
 
@@ -996,11 +1039,9 @@ static int FFI_mitls_quic_create_caml(quic_state **st, quic_config *cfg)
 int MITLS_CALLCONV FFI_mitls_quic_create(/* out */ quic_state **state, quic_config *cfg)
 {
     int ret;
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = FFI_mitls_quic_create_caml(state, cfg);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
 
     return ret;
 }
@@ -1053,11 +1094,9 @@ quic_result MITLS_CALLCONV FFI_mitls_quic_process(
 {
     quic_result ret;
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = FFI_mitls_quic_process_caml(state, inBuf, pInBufLen, outBuf, pOutBufLen);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
 
     return ret;
 }
@@ -1070,11 +1109,9 @@ int MITLS_CALLCONV FFI_mitls_quic_get_exporter(
     int ret;
     mitls_state tls_state = {.fstar_state = state->fstar_state};
 
-    caml_c_thread_register();
-    caml_acquire_runtime_system();
+    ENTER_CAML();
     ret = ocaml_get_exporter(&tls_state, early, secret);
-    caml_release_runtime_system();
-    caml_c_thread_unregister();
+    LEAVE_CAML();
 
     return ret;
 }
@@ -1082,11 +1119,9 @@ int MITLS_CALLCONV FFI_mitls_quic_get_exporter(
 void MITLS_CALLCONV FFI_mitls_quic_close(quic_state *state)
 {
     if (state != NULL) {
-        caml_c_thread_register();
-        caml_acquire_runtime_system();
+        ENTER_CAML();
         caml_remove_generational_global_root(&state->fstar_state);
-        caml_release_runtime_system();
-        caml_c_thread_unregister();
+        LEAVE_CAML();
         state->fstar_state = 0;
         free(state);
     }
@@ -1111,12 +1146,22 @@ CAMLprim value ocaml_cert_select_cb(value st, value fp, value pv, value sni_alpn
   sni = Field(sni_alpn, 0);
   alpn = Field(sni_alpn, 1);
 
+  // Copy out of the OCaml heap: the callback runs without the runtime lock
+  void *cbs = ValueToPtr(st);
+  mitls_version ver = (mitls_version)Int_val(pv);
+  size_t sni_len = caml_string_length(sni), alpn_len = caml_string_length(alpn);
+  unsigned char sni_buf[sni_len + 1], alpn_buf[alpn_len + 1];
+  memcpy(sni_buf, String_val(sni), sni_len);
+  memcpy(alpn_buf, String_val(alpn), alpn_len);
+  sni_buf[sni_len] = 0;
+
   // The callback returns a unspecified pointer to the selected certificate
   // and updates the selected signature algorithm (passed by reference)
-  void* cert = cb((void*)ValueToPtr(st), (mitls_version)Int_val(pv),
-    (unsigned char*)String_val(sni), caml_string_length(sni),
-    (unsigned char*)String_val(alpn), caml_string_length(alpn),
+  void* cert;
+  caml_enter_blocking_section();
+  cert = cb(cbs, ver, sni_buf, sni_len, alpn_buf, alpn_len,
     sigalgs, n, &selected);
+  caml_leave_blocking_section();
 
   if(cert == NULL) CAMLreturn(Val_none);
 
@@ -1138,7 +1183,11 @@ CAMLprim value ocaml_cert_format_cb(value st, value fp, value cert)
   unsigned char *buffer = malloc(MAX_CHAIN_LEN);
   if(buffer == NULL) caml_failwith("ocaml_cert_format_cb: failed to allocate certificate chain buffer");
 
-  size_t len = cb((void*)ValueToPtr(st), (void*)ValueToPtr(cert), buffer);
+  void *cbs = ValueToPtr(st), *cert_ptr = ValueToPtr(cert);
+  size_t len;
+  caml_enter_blocking_section();
+  len = cb(cbs, cert_ptr, buffer);
+  caml_leave_blocking_section();
   if(!len) caml_failwith("ocaml_cert_format_cb: certificate formatting callback returned an empty chain");
 
   ret = caml_alloc_string(len);
@@ -1155,12 +1204,21 @@ CAMLprim value ocaml_cert_sign_cb(value st, value fp, value cert, value sigalg,
   CAMLlocal1(ret);
   pfn_FFI_cert_sign_cb cb = (pfn_FFI_cert_sign_cb)ValueToPtr(fp);
 
-  unsigned char *buffer = malloc(MAX_SIGNATURE_LEN);
+  // The signature buffer also holds a copy of tbs, since signing runs
+  // without the runtime lock
+  size_t tbs_len = caml_string_length(tbs);
+  unsigned char *buffer = malloc(MAX_SIGNATURE_LEN + tbs_len);
   if(buffer == NULL) CAMLreturn(Val_none);
+  unsigned char *tbs_copy = buffer + MAX_SIGNATURE_LEN;
+  memcpy(tbs_copy, String_val(tbs), tbs_len);
 
-  size_t len = cb((void*)ValueToPtr(st), (void*)ValueToPtr(cert), (uint16_t)Int_val(sigalg),
-    (const unsigned char*)String_val(tbs), caml_string_length(tbs), buffer);
-  if(!len) CAMLreturn(Val_none);
+  void *cbs = ValueToPtr(st), *cert_ptr = ValueToPtr(cert);
+  uint16_t alg = (uint16_t)Int_val(sigalg);
+  size_t len;
+  caml_enter_blocking_section();
+  len = cb(cbs, cert_ptr, alg, tbs_copy, tbs_len, buffer);
+  caml_leave_blocking_section();
+  if(!len) { free(buffer); CAMLreturn(Val_none); }
 
   ret = caml_alloc_string(len);
   memcpy(String_val(ret), buffer, len);
@@ -1181,11 +1239,77 @@ CAMLprim value ocaml_cert_verify_cb(value st, value fp, value chain, value sigal
   value tbs = Field(tbs_sig, 0);
   value sig = Field(tbs_sig, 1);
 
-  int success = cb((void*)ValueToPtr(st),
-    (const unsigned char*)String_val(chain), caml_string_length(chain),
-    (uint16_t)Int_val(sigalg),
-    (const unsigned char*)String_val(tbs), caml_string_length(tbs),
-    (const unsigned char*)String_val(sig), caml_string_length(sig));
+  // Chain validation and signature verification run without the runtime
+  // lock, on a copy of their arguments
+  size_t chain_len = caml_string_length(chain);
+  size_t tbs_len = caml_string_length(tbs);
+  size_t sig_len = caml_string_length(sig);
+  unsigned char *buffer = malloc(chain_len + tbs_len + sig_len + 1);
+  if(buffer == NULL) CAMLreturn(Val_false);
+  memcpy(buffer, String_val(chain), chain_len);
+  memcpy(buffer + chain_len, String_val(tbs), tbs_len);
+  memcpy(buffer + chain_len + tbs_len, String_val(sig), sig_len);
+
+  void *cbs = ValueToPtr(st);
+  uint16_t alg = (uint16_t)Int_val(sigalg);
+  int success;
+  caml_enter_blocking_section();
+  success = cb(cbs, buffer, chain_len, alg,
+    buffer + chain_len, tbs_len, buffer + chain_len + tbs_len, sig_len);
+  caml_leave_blocking_section();
+  free(buffer);
 
   CAMLreturn(success ? Val_true : Val_false);
 }
+
+// Host transport callbacks, called by FFI.Transport for every record sent
+// or received.  These block on network I/O, so they run without the
+// runtime lock, on C copies of their buffers.
+CAMLprim value ocaml_send_tcp(value ctx, value fp, value buffer)
+{
+  CAMLparam3(ctx, fp, buffer);
+  pfn_FFI_send cb = (pfn_FFI_send)ValueToPtr(fp);
+  void *p = ValueToPtr(ctx);
+  size_t len = caml_string_length(buffer);
+  unsigned char *copy = malloc(len ? len : 1);
+  int ret;
+
+  if(copy == NULL) CAMLreturn(Val_int(-1));
+  memcpy(copy, String_val(buffer), len);
+
+  caml_enter_blocking_section();
+  ret = cb(p, copy, len);
+  caml_leave_blocking_section();
+  free(copy);
+
+  CAMLreturn(Val_int(ret));
+}
+
+// Returns None on error, or up to max bytes received from the host
+CAMLprim value ocaml_recv_tcp(value ctx, value fp, value max)
+{
+  CAMLparam3(ctx, fp, max);
+  CAMLlocal1(ret);
+  pfn_FFI_recv cb = (pfn_FFI_recv)ValueToPtr(fp);
+  void *p = ValueToPtr(ctx);
+  size_t len = Long_val(max);
+  unsigned char *buffer = malloc(len ? len : 1);
+  int received;
+
+  if(buffer == NULL) CAMLreturn(Val_none);
+
+  caml_enter_blocking_section();
+  received = cb(p, buffer, len);
+  caml_leave_blocking_section();
+
+  if(received < 0 || (size_t)received > len) {
+    free(buffer);
+    CAMLreturn(Val_none);
+  }
+
+  ret = caml_alloc_string(received);
+  memcpy(String_val(ret), buffer, received);
+  free(buffer);
+
+  CAMLreturn(Val_some(ret));
+}
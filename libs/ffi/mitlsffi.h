@@ -90,6 +90,12 @@ typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_sign_cb)(void *cb_state, const void
 // of tbs for sigalg using the public key stored in the leaf of the chain.
 // N.B. this function must validate the chain (including applcation checks such as hostname matching)
 typedef int (MITLS_CALLCONV *pfn_FFI_cert_verify_cb)(void *cb_state, const unsigned char* chain, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len);
+// Release a chain returned by select (e.g. with mipki_free_chain). It is called
+// once for each selected chain, when the connection is freed by FFI_mitls_close()
+// or FFI_mitls_quic_free(), and immediately for a chain whose signature scheme
+// miTLS does not support. Set with FFI_mitls_configure_cert_release() or
+// FFI_mitls_quic_configure_cert_release(); without it, chains are not released.
+typedef void (MITLS_CALLCONV *pfn_FFI_cert_release_cb)(void *cb_state, const void *cert_ptr);
 
 typedef struct {
   pfn_FFI_cert_select_cb select;
@@ -113,9 +119,32 @@ extern int MITLS_CALLCONV FFI_mitls_init(void);
 // and sealing key (used on the client side to seal session information for resumption)
 // alg is one of "AES128-GCM", "AES256-GCM", "CHACHA20-POLY1305", klen must account for
 // the key and IV (e.g. 32 + 12). If these keys are not set, fresh random keys will be used.
+// Setting a key keeps the previous ones (up to 3) for decryption: each ticket records the
+// id of the key that encrypted it, so tickets issued before a rotation remain valid. The id
+// is a byte derived from the key, so servers sharing keys agree on it; an older key with the
+// same id is dropped.
 extern int MITLS_CALLCONV FFI_mitls_set_ticket_key(const char *alg, const unsigned char *ticketkey, size_t klen);
 extern int MITLS_CALLCONV FFI_mitls_set_sealing_key(const char *alg, const unsigned char *sealingkey, size_t klen);
 
+// Replace the ticket key with a fresh random one, keeping the previous keys for decryption
+// (the fresh key gets an id that none of them uses)
+extern void MITLS_CALLCONV FFI_mitls_rotate_ticket_key(void);
+
+// Rotate the ticket key automatically every 'seconds' (0, the default, disables rotation).
+// Rotation is checked when a server connection is created.
+extern void MITLS_CALLCONV FFI_mitls_set_ticket_key_rotation(uint32_t seconds);
+
+typedef struct {
+  uint32_t rotations;        // keys installed, including the initial one
+  uint32_t decrypt_current;  // tickets and cookies decrypted with the current key
+  uint32_t decrypt_previous; // ... with an older key still in the ring
+  uint32_t decrypt_unknown;  // ... whose key has been rotated out
+  uint32_t decrypt_failed;   // ... that failed to decrypt
+} mitls_ticket_key_stats;
+
+// The counters are approximate: concurrent connections may lose updates.
+extern int MITLS_CALLCONV FFI_mitls_get_ticket_key_stats(/* out */ mitls_ticket_key_stats *stats);
+
 // Perform one-time termination
 extern void MITLS_CALLCONV FFI_mitls_cleanup(void);
 
@@ -135,6 +164,9 @@ extern int MITLS_CALLCONV FFI_mitls_configure_custom_extensions(/* in */ mitls_s
 extern int MITLS_CALLCONV FFI_mitls_configure_ticket_callback(mitls_state *state, void *cb_state, pfn_FFI_ticket_cb ticket_cb);
 extern int MITLS_CALLCONV FFI_mitls_configure_nego_callback(mitls_state *state, void *cb_state, pfn_FFI_nego_cb nego_cb);
 extern int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(mitls_state *state, void *cb_state, mitls_cert_cb *cert_cb);
+// Called with the cb_state of FFI_mitls_configure_cert_callbacks(), before or
+// after it, but before FFI_mitls_connect() or FFI_mitls_accept_connected()
+extern int MITLS_CALLCONV FFI_mitls_configure_cert_release(mitls_state *state, pfn_FFI_cert_release_cb release);
 
 // Close a miTLS session - either after configure or connect
 extern void MITLS_CALLCONV FFI_mitls_close(/* in */ mitls_state *state);
@@ -159,13 +191,116 @@ extern void *MITLS_CALLCONV FFI_mitls_get_cert(/* in */ mitls_state *state, /* o
 // Returns -1 for failure, or a TCP packet to be sent then freed with FFI_mitls_free()
 extern int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned char *buffer, size_t buffer_size);
 
+// Record sizing for FFI_mitls_send().  After the handshake, and again after
+// idle_ms milliseconds without sending, data is sent in records of at most
+// small_record bytes, each of which fits in one TCP segment and can be
+// decrypted as soon as it arrives.  Once ramp_bytes have been sent this way,
+// records grow to the maximum of 16384 bytes.  The defaults are 1400, 1 MB
+// and 1000 ms; small_record = 0 always sends full-size records.
+extern int MITLS_CALLCONV FFI_mitls_configure_record_size(/* in */ mitls_state *state, uint32_t small_record, uint32_t ramp_bytes, uint32_t idle_ms);
+
+// While corked, FFI_mitls_send() buffers its data instead of sending records.
+// FFI_mitls_flush() sends the buffered data; uncorking also flushes it.
+extern int MITLS_CALLCONV FFI_mitls_set_cork(/* in */ mitls_state *state, int cork);
+extern int MITLS_CALLCONV FFI_mitls_flush(/* in */ mitls_state *state);
+
 // Receive a message
 // Returns NULL for failure, a plaintext packet to be freed with FFI_mitls_free_packet()
 extern unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /* out */ size_t *packet_size);
 
+typedef enum {
+  TLS_receive_error = -1,      // the connection failed, or buffer is too small
+  TLS_receive_closed = 0,      // the peer closed the connection (close_notify)
+  TLS_receive_data = 1,        // *received bytes were stored
+  TLS_receive_would_block = 2  // the recv callback had no data yet; call again later
+} mitls_receive_result;
+
+// Receive as many records as fit into buffer, which must hold at least 16384
+// bytes.  The first record may wait on the recv callback, as with
+// FFI_mitls_receive(); further records are only taken from those already
+// buffered by read-ahead (see below), while at least 16384 bytes are left.  A
+// TLS 1.3 post-handshake message among them is processed in passing, after
+// which the call may wait for the next record.  Returns a
+// mitls_receive_result; with TLS_receive_data, sets *received to the number of
+// bytes stored and *more to 1 if another record is already buffered.  When
+// the stream ends or fails after some data, that data is returned first and
+// the next call reports the end.
+// This saves the packet FFI_mitls_receive() allocates and the lock and region
+// entry per record; decryption still allocates each plaintext in the
+// connection region, from which it is copied into buffer.
+extern int MITLS_CALLCONV FFI_mitls_receive_into(/* in */ mitls_state *state, /* out */ unsigned char *buffer, size_t capacity, /* out */ size_t *received, /* out */ int *more);
+
+// Read-ahead for FFI_mitls_receive().  By default, each record is read with
+// two calls to the recv callback, one for its header and one for its
+// payload.  With size > 0, the recv callback is instead asked for up to size
+// bytes (at least one record, at most 1 MB) and the records it returns are
+// buffered until they are received.  The recv callback must then return
+// whatever the transport has available rather than wait for all the bytes
+// asked for.  Call before FFI_mitls_connect() or FFI_mitls_accept_connected().
+extern int MITLS_CALLCONV FFI_mitls_configure_read_ahead(/* in */ mitls_state *state, uint32_t size);
+
+// Returns 1 if a complete record is buffered, so that FFI_mitls_receive()
+// will not call the recv callback.  With read-ahead, hosts that poll their
+// socket before receiving must check this first.
+extern int MITLS_CALLCONV FFI_mitls_pending(/* in */ mitls_state *state);
+
+typedef struct {
+  uint64_t recv_calls;  // calls to the recv callback
+  uint64_t records;     // records received, including handshake records
+  uint32_t buffered;    // bytes received but not yet processed
+} mitls_read_stats;
+
+extern int MITLS_CALLCONV FFI_mitls_get_read_stats(/* in */ mitls_state *state, /* out */ mitls_read_stats *stats);
+
+// TLS 1.3 KeyUpdate.  Replaces the traffic key used for sending, and with
+// request != 0 asks the peer to replace its own.  The KeyUpdate message is
+// sent with the next FFI_mitls_send() or FFI_mitls_receive(), after which
+// the expanded old key is freed.  The new secret, key and epoch (a few
+// hundred bytes) stay allocated until FFI_mitls_close(), and count towards
+// the connection's quota.  Returns 0 for TLS 1.2, before the handshake
+// completes, or while a previous KeyUpdate is still to be sent.
+extern int MITLS_CALLCONV FFI_mitls_key_update(/* in */ mitls_state *state, int request);
+
+// Limits on the application data protected with each TLS 1.3 traffic key,
+// in records and in bytes, 0 for no limit.  Keys are updated automatically
+// when our side reaches a limit, and the peer is asked to update its keys
+// when it does.  The default is 2^24 records and no byte limit.
+extern int MITLS_CALLCONV FFI_mitls_configure_key_update(/* in */ mitls_state *state, uint64_t records, uint64_t bytes);
+
 // Free a packet returned FFI_mitls_*() family of APIs
 extern void MITLS_CALLCONV FFI_mitls_free(/* in */ mitls_state *state, void* pv);
 
+// Record protection offload (e.g. Linux kTLS: TLS_TX/TLS_RX socket options).
+// After the handshake, export the keys of the current writer and/or reader
+// and install them on the socket.  The exported direction is then owned by the
+// host: FFI_mitls_send() or FFI_mitls_receive() fail for it.  With read-ahead,
+// exporting the reader fails while received bytes are still buffered
+// (mitls_read_stats.buffered): receive them with FFI_mitls_receive() first.
+typedef struct {
+  mitls_version version;
+  mitls_aead alg;
+  unsigned char key[32];
+  size_t key_len;
+  unsigned char iv[12];  // TLS 1.3: the 12-byte static IV; TLS 1.2: the 4-byte salt (AES-GCM) or the 12-byte IV (ChaCha20-Poly1305)
+  size_t iv_len;
+  uint64_t seqn;         // sequence number of the next record (also the TLS 1.2 explicit nonce)
+} mitls_traffic_key;
+
+extern int MITLS_CALLCONV FFI_mitls_export_traffic_key(/* in */ mitls_state *state, int reader, /* out */ mitls_traffic_key *key);
+
+// Hand back the plaintext of handshake records received by the host after
+// the reader was exported (NewSessionTicket, KeyUpdate).  *consumed is the
+// number of input bytes processed: either all of them, or 0 while a reply is
+// pending (MITLS_HANDBACK_OUTPUT_PENDING), in which case send the output and
+// call again with the same input.  Up to *output_len bytes of reply are
+// written to output and must be sent as a handshake record with the current
+// writer keys.  If the reader (resp. writer) keys changed, they must then be
+// exported and installed again; the writer change applies after the output.
+#define MITLS_HANDBACK_READER_REKEYED 1
+#define MITLS_HANDBACK_WRITER_REKEYED 2
+#define MITLS_HANDBACK_OUTPUT_PENDING 4
+extern int MITLS_CALLCONV FFI_mitls_handback_handshake(/* in */ mitls_state *state, const unsigned char *input, size_t input_len, /* out */ size_t *consumed, /* out */ unsigned char *output, /* inout */ size_t *output_len, /* out */ int *flags);
+
 /*************************************************************************
 * QUIC API
 **************************************************************************/
@@ -251,6 +386,9 @@ typedef enum {
 
 // Creates a new connection state
 extern int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *cfg);
+// Called after FFI_mitls_quic_create() with cert_callbacks, before the first
+// FFI_mitls_quic_process(); release gets the callback_state of the config
+extern int MITLS_CALLCONV FFI_mitls_quic_configure_cert_release(quic_state *state, pfn_FFI_cert_release_cb release);
 extern int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *state, quic_process_ctx *ctx);
 
 // get_record_secrets can be called after the complete flag is set
@@ -271,4 +409,296 @@ extern void MITLS_CALLCONV FFI_mitls_global_free(void* pv);
 // Free QUIC state
 extern void MITLS_CALLCONV FFI_mitls_quic_free(quic_state *state);
 
+/*************************************************************************
+* Memory statistics
+**************************************************************************/
+
+// Allocation sizes are binned by powers of two: bucket 0 counts allocations
+// of up to 16 bytes, bucket i counts sizes in (2^(i+3), 2^(i+4)], and the
+// last bucket counts everything larger.
+#define MITLS_MEMORY_HISTOGRAM_BUCKETS 16
+
+typedef struct {
+  size_t current_bytes; // bytes currently allocated
+  size_t peak_bytes; // high-water mark of current_bytes
+  size_t total_bytes; // sum of all allocations ever made
+  size_t allocation_count;
+  size_t free_count;
+  size_t allocation_failures; // allocations that failed for lack of memory
+  size_t size_histogram[MITLS_MEMORY_HISTOGRAM_BUCKETS];
+} mitls_memory_stats;
+
+typedef enum {
+  TLS_memory_hello = 0, // snapshot once the first flight was sent or received
+  TLS_memory_handshake = 1, // snapshot once the handshake completed
+  TLS_memory_current = 2 // live counters, as of the call
+} mitls_memory_phase;
+
+// Returns 0 if the requested snapshot has not been taken yet, or if the
+// library was built without region statistics
+extern int MITLS_CALLCONV FFI_mitls_get_memory_stats(/* in */ mitls_state *state, mitls_memory_phase phase, /* out */ mitls_memory_stats *stats);
+extern int MITLS_CALLCONV FFI_mitls_quic_get_memory_stats(/* in */ quic_state *state, mitls_memory_phase phase, /* out */ mitls_memory_stats *stats);
+// Statistics of the global region, which holds allocations made outside of any connection
+extern int MITLS_CALLCONV FFI_mitls_get_global_memory_stats(/* out */ mitls_memory_stats *stats);
+
+/*************************************************************************
+* Memory limits
+**************************************************************************/
+
+// Limits enforced by the region allocator; builds without heap regions (and
+// kernel mode) accept everything.  Each connection may hold at most
+// 'region_quota' bytes (0, the default, for no limit): an allocation beyond it
+// fails the call as if memory were exhausted, and the connection should be
+// closed.  At most 'max_handshakes' handshakes may be in flight (0, the default,
+// for no limit): beyond it FFI_mitls_connect(), FFI_mitls_accept_connected() and
+// FFI_mitls_quic_create() fail before allocating connection state.  A QUIC
+// handshake is in flight until it completes or its state is freed.
+extern int MITLS_CALLCONV FFI_mitls_configure_memory_limits(size_t region_quota, uint32_t max_handshakes);
+
+// Override the quota of one connection, e.g. for a trusted peer
+extern int MITLS_CALLCONV FFI_mitls_configure_memory_quota(/* in */ mitls_state *state, size_t quota);
+
+typedef enum {
+  TLS_resource_ok = 0,
+  TLS_resource_out_of_memory = 1, // an allocation failed
+  TLS_resource_quota = 2,         // the connection reached its quota
+  TLS_resource_busy = 3           // too many handshakes in flight
+} mitls_resource_error;
+
+// Why the last failed call on this thread ran out of resources, or
+// TLS_resource_ok if it failed for another reason
+extern mitls_resource_error MITLS_CALLCONV FFI_mitls_get_resource_error(void);
+
+typedef struct {
+  size_t region_quota;
+  uint32_t max_handshakes;
+  uint32_t handshakes;     // in flight
+  uint64_t quota_failures; // allocations refused by a quota
+  uint64_t busy_failures;  // handshakes refused by the budget
+} mitls_memory_limit_stats;
+
+extern int MITLS_CALLCONV FFI_mitls_get_memory_limit_stats(/* out */ mitls_memory_limit_stats *stats);
+
+/*************************************************************************
+* Handshake events
+**************************************************************************/
+
+// Handshake milestones, see HandshakeEvents.fsti
+typedef enum {
+  TLS_event_client_hello_sent = 1,
+  TLS_event_client_hello_parsed = 2,
+  TLS_event_server_hello_parsed = 3,
+  TLS_event_key_share_done = 4,
+  TLS_event_cert_selected = 5,
+  TLS_event_signature_done = 6,
+  TLS_event_signature_verified = 7,
+  TLS_event_finished_verified = 8,
+  TLS_event_ks_early_keys = 9,
+  TLS_event_ks_handshake_keys = 10,
+  TLS_event_ks_application_keys = 11,
+  TLS_event_ks_resumption_secret = 12,
+  TLS_event_handshake_complete = 13
+} mitls_event_type;
+
+typedef struct {
+  uint64_t timestamp; // monotonic clock, in nanoseconds
+  uint32_t event; // mitls_event_type
+  uint32_t connection; // as returned by FFI_mitls_connection_id() or FFI_mitls_quic_connection_id()
+} mitls_event;
+
+// Start or stop recording handshake events (off by default).  This is process-wide.
+extern void MITLS_CALLCONV FFI_mitls_enable_events(int enable);
+
+// Copy up to max_events of the calling thread's events, oldest first, and
+// remove them from its ring buffer.  Each thread keeps its 256 most recent
+// events.  Returns the number of events written.
+extern size_t MITLS_CALLCONV FFI_mitls_drain_events(/* out */ mitls_event *events, size_t max_events);
+
+// The identifier of a connection in its events: nonzero, and unique among the
+// connections of the process until 2^32 connections have been created
+extern uint32_t MITLS_CALLCONV FFI_mitls_connection_id(/* in */ mitls_state *state);
+extern uint32_t MITLS_CALLCONV FFI_mitls_quic_connection_id(/* in */ quic_state *state);
+
+/*************************************************************************
+* 0-RTT anti-replay
+**************************************************************************/
+
+// A server only accepts 0-RTT if the ClientHello is fresh: the client's view of
+// the ticket age must be within the replay window of the server's, and the
+// hello must not have been seen before in that window (RFC 8446, section 8).
+// Hellos are recorded in a process-wide, time-bucketed Bloom filter.
+
+// Set the replay window in seconds (default 10) and the expected number of 0-RTT
+// hellos per window (default 262144), which determines the memory used.  Call
+// after FFI_mitls_init(), ideally before accepting connections: calling it again
+// replaces the filter, forgetting the hellos recorded so far, and frees the old
+// one once the checks in progress are done with it.
+extern int MITLS_CALLCONV FFI_mitls_configure_anti_replay(uint32_t window, uint32_t capacity);
+
+// Optional hook to share hellos across processes or machines.  It is only called
+// for hellos that the local filter has not seen, and should return 1 if the key
+// has not been seen in the last 'window' seconds (recording it), 0 otherwise.
+// It runs inside the handshake, with the library's global lock held, so every
+// other connection waits for it: it must not block, e.g. it should give up after
+// a few milliseconds and return 0 (rejecting 0-RTT, not the connection), and it
+// must not call into miTLS other than FFI_mitls_anti_replay_check().
+typedef int (MITLS_CALLCONV *pfn_FFI_replay_cb)(void *cb_state, const unsigned char *key, size_t key_len, uint32_t window);
+extern void MITLS_CALLCONV FFI_mitls_set_replay_callback(void *cb_state, pfn_FFI_replay_cb cb);
+
+// Check and record a key in the local filter only, e.g. to implement the
+// shared service above.  Returns 1 if the key is fresh, 0 if it is a replay
+// or arrives while the filter of a new window is being cleared.
+extern int MITLS_CALLCONV FFI_mitls_anti_replay_check(const unsigned char *key, size_t key_len);
+
+typedef struct {
+  uint32_t window;   // seconds
+  uint64_t memory;   // bytes used by the filters
+  uint64_t checks;   // hellos checked
+  uint64_t replays;  // hellos reported as replays, including false positives
+                     // and those checked while a filter was being cleared
+} mitls_anti_replay_stats;
+
+extern int MITLS_CALLCONV FFI_mitls_get_anti_replay_stats(/* out */ mitls_anti_replay_stats *stats);
+
+/*************************************************************************
+* Stateless retry tokens
+**************************************************************************/
+
+// Address validation tokens (e.g. for QUIC Retry packets) that a server can mint
+// and check from the output of FFI_mitls_get_hello_summary() alone, before any
+// connection state is created.  A token is bound to the client address (opaque
+// bytes chosen by the application, e.g. IP and port), to the SNI and ALPN of the
+// hello, and carries up to 255 bytes of authenticated application data (e.g. the
+// original destination connection ID).  Tokens are valid for 'lifetime' seconds.
+#define MITLS_RETRY_TOKEN_OVERHEAD 21
+#define MITLS_RETRY_TOKEN_MAX_DATA 255
+
+// Set the master key (16 to 64 bytes) and the token lifetime in seconds (default
+// 30).  Keys rotate every lifetime and are derived from the master key, so servers
+// configured with the same key accept each other's tokens.  If key is NULL, or if
+// this is never called, a random master key is used.  Replacing the key
+// invalidates the tokens already issued.
+extern int MITLS_CALLCONV FFI_mitls_configure_retry_tokens(const unsigned char *key, size_t key_len, uint32_t lifetime);
+
+// *token_len is the size of the token buffer on input (at least
+// MITLS_RETRY_TOKEN_OVERHEAD + data_len), and the token size on output
+extern int MITLS_CALLCONV FFI_mitls_mint_retry_token(const mitls_hello_summary *ch, const unsigned char *addr, size_t addr_len, const unsigned char *data, size_t data_len, /* out */ unsigned char *token, /* inout */ size_t *token_len);
+
+// Returns 1 if the token was minted for this hello and address and has not
+// expired.  *data points into token - no freeing required.
+extern int MITLS_CALLCONV FFI_mitls_verify_retry_token(const mitls_hello_summary *ch, const unsigned char *addr, size_t addr_len, const unsigned char *token, size_t token_len, /* out */ const unsigned char **data, /* out */ size_t *data_len);
+
+typedef struct {
+  uint32_t lifetime; // seconds
+  uint64_t minted;
+  uint64_t accepted;
+  uint64_t rejected; // malformed, expired or forged tokens
+} mitls_retry_token_stats;
+
+extern int MITLS_CALLCONV FFI_mitls_get_retry_token_stats(/* out */ mitls_retry_token_stats *stats);
+
+/*************************************************************************
+* Client session cache
+**************************************************************************/
+
+// When enabled, clients keep the tickets they receive in a process-wide cache
+// keyed by the server name and the offered ALPN list, and offer the newest live
+// one on their next connection to the same service.  The cache is consulted when
+// FFI_mitls_connect() or FFI_mitls_quic_create() start a client handshake with a
+// server name and no ticket from FFI_mitls_configure_ticket() or server_ticket.
+// Ticket callbacks are still invoked.  Tickets that allow 0-RTT are used once.
+
+// Enable the cache with room for 'capacity' (server name, ALPN) entries, least
+// recently used first out, or disable it with capacity 0 (the default).  Tickets
+// expire after the lifetime announced by the server (in NewSessionTicket for TLS
+// 1.3, as the RFC 5077 lifetime hint for TLS 1.2), or 3600 seconds if it did not
+// announce one, and after at most 'max_lifetime' seconds (0 for the 7-day maximum).
+// The cache is off by default because its key does not cover the client
+// certificate, the ticket callbacks or other per-connection configuration: a
+// process that connects to one server under several identities would resume one
+// identity's session for another.  Enable it only when that cannot happen.
+extern int MITLS_CALLCONV FFI_mitls_configure_session_cache(uint32_t capacity, uint32_t max_lifetime);
+
+// Forget all cached tickets, e.g. after a change of network or identity
+extern void MITLS_CALLCONV FFI_mitls_flush_session_cache(void);
+
+typedef struct {
+  uint32_t capacity;
+  uint32_t entries;         // (server name, ALPN) entries currently cached
+  uint64_t lookups;         // client handshakes that consulted the cache
+  uint64_t hits;            // ... and found a ticket to offer
+  uint64_t expired;         // tickets dropped because their lifetime was over
+  uint64_t stores;          // tickets received and cached
+  uint64_t evictions;       // entries evicted to make room
+  uint64_t resumed;         // handshakes offering a cached ticket that resumed (TLS only)
+  uint64_t full_handshakes; // ... where the server declined the ticket
+} mitls_session_cache_stats;
+
+extern int MITLS_CALLCONV FFI_mitls_get_session_cache_stats(/* out */ mitls_session_cache_stats *stats);
+
+/*************************************************************************
+* Certificate compression
+**************************************************************************/
+
+// TLS 1.3 certificate compression (RFC 8879).  Clients offer the algorithms
+// in the compress_certificate extension; servers pick their most preferred one
+// that the client offered and send a CompressedCertificate message instead of
+// Certificate, unless compression does not make it smaller.  Servers compress
+// each certificate chain once: results are kept in a process-wide cache keyed
+// by the Certificate message they replace, which holds 256 of them.  Clients
+// refuse compressed certificates of more than 128 KiB once decompressed, and
+// decompress within the connection's memory quota.
+
+// Bits of mitls_cert_compression_stats.algorithms, by RFC 8879 code point
+#define MITLS_CERT_COMPRESSION_ZLIB   (1 << 1)
+#define MITLS_CERT_COMPRESSION_BROTLI (1 << 2)
+#define MITLS_CERT_COMPRESSION_ZSTD   (1 << 3)
+
+// A colon-separated list of algorithms in order of preference, among "BROTLI",
+// "ZSTD" and "ZLIB", or "" to disable compression.  Algorithms not built in
+// (see mitls_cert_compression_stats.algorithms) are ignored.  The default is
+// "BROTLI:ZSTD:ZLIB".
+extern int MITLS_CALLCONV FFI_mitls_configure_cert_compression(/* in */ mitls_state *state, const char *algs);
+
+typedef struct {
+  uint32_t algorithms;         // MITLS_CERT_COMPRESSION_ bits of the algorithms built in
+  uint64_t compressed;         // Certificate messages sent compressed
+  uint64_t cache_hits;         // ... whose compressed form was cached
+  uint64_t uncompressed_bytes; // total size of those messages
+  uint64_t compressed_bytes;   // ... and of what was sent instead
+  uint64_t decompressed;       // CompressedCertificate messages received
+  uint64_t failures;           // ... that did not decompress to their announced length
+} mitls_cert_compression_stats;
+
+extern int MITLS_CALLCONV FFI_mitls_get_cert_compression_stats(/* out */ mitls_cert_compression_stats *stats);
+
+/*************************************************************************
+* OCSP stapling
+**************************************************************************/
+
+// Stapled OCSP responses (RFC 6066 status_request).  Clients that set a
+// check callback ask for the status of the server certificate; servers
+// that set a staple callback send the response they hold for the selected
+// certificate, in its TLS 1.3 certificate entry or in a TLS 1.2
+// CertificateStatus message.  Responses should be fetched and refreshed
+// ahead of time (see mipki_refresh_ocsp), not from the callbacks.
+
+#define MAX_OCSP_RESPONSE_LEN 65531
+
+// Write the DER OCSP response for the selected certificate to buffer,
+// returning its size, or 0 to staple nothing
+typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_staple_cb)(void *cb_state, const void *cert_ptr, unsigned char buffer[MAX_OCSP_RESPONSE_LEN]);
+
+// Check the OCSP response stapled to a chain (in the format of
+// pfn_FFI_cert_verify_cb) that verified, with ocsp_len 0 if the server
+// stapled none.  Returns 0 to fail the handshake
+typedef int (MITLS_CALLCONV *pfn_FFI_cert_check_status_cb)(void *cb_state, const unsigned char *chain, size_t chain_len, const unsigned char *ocsp, size_t ocsp_len);
+
+typedef struct {
+  pfn_FFI_cert_staple_cb staple;      // May be NULL
+  pfn_FFI_cert_check_status_cb check; // May be NULL; if set, clients request OCSP stapling
+} mitls_cert_status_cb;
+
+extern int MITLS_CALLCONV FFI_mitls_configure_cert_status_callbacks(/* in */ mitls_state *state, void *cb_state, mitls_cert_status_cb *status_cb);
+
 #endif // HEADER_MITLS_FFI_H
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
 #define DEBUG 0
@@ -13,6 +14,24 @@
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/x509v3.h>
+#include <openssl/ocsp.h>
+
+#if defined(_WIN32)
+  #define NOCRYPT // wincrypt.h clashes with OpenSSL
+  #include <windows.h>
+  typedef CRITICAL_SECTION mipki_lock;
+  #define LOCK_INIT(x) InitializeCriticalSection(x)
+  #define LOCK_FREE(x) DeleteCriticalSection(x)
+  #define LOCK(x) EnterCriticalSection(x)
+  #define UNLOCK(x) LeaveCriticalSection(x)
+#else
+  #include <pthread.h>
+  typedef pthread_mutex_t mipki_lock;
+  #define LOCK_INIT(x) pthread_mutex_init(x, NULL)
+  #define LOCK_FREE(x) pthread_mutex_destroy(x)
+  #define LOCK(x) pthread_mutex_lock(x)
+  #define UNLOCK(x) pthread_mutex_unlock(x)
+#endif
 
 #include "mipki.h"
 
@@ -34,8 +53,29 @@ Certificate selection first matches the SNI against the names in the certificate
 then looks at the supported signature algorithms and tries to pick one compatible
 with the private key.
 
+The configuration is loaded as a certificate set, which mipki_reload replaces
+RCU-style: the new set is loaded aside and swapped in under the state lock, so
+selections never wait for file I/O. A selected chain pins its set until
+mipki_free_chain; a replaced set is retired, and freed when its last chain is
+released, so handshakes in flight finish with the certificate and key they
+started with. Loaded chains are never modified, and may be used concurrently.
+
+Each configured chain also holds the OCSP response stapled to it, which
+mipki_refresh_ocsp fetches from the application's source and replaces under the
+state lock before it expires; a reload carries responses over to unchanged
+certificates. Both also hold the update lock, which serializes the writers of
+responses, so a reload matches and copies them before it takes the state lock. Clients check stapled responses with mipki_check_ocsp_response,
+which remembers the responses that checked out until their nextUpdate, so a
+server stapling the same response to every connection is verified once.
+
 */
 
+#define OCSP_CACHE_SLOTS 64
+#define OCSP_CLOCK_SKEW 300 // seconds
+#define OCSP_DEFAULT_LIFETIME 3600 // for responses without nextUpdate
+
+struct cert_set;
+
 // The parsed representation of chains and private keys
 typedef struct {
   X509* endpoint;
@@ -43,12 +83,37 @@ typedef struct {
   EVP_PKEY* key;
   int is_universal;
   int is_ephemeral;
+  struct cert_set *set; // NULL for ephemeral chains
+  unsigned char *ocsp; // stapled OCSP response (DER), replaced under both locks
+  size_t ocsp_len;
+  time_t ocsp_expiry; // its nextUpdate
 } config_entry;
 
-typedef struct mipki_state {
-  X509_STORE *store;
+// The server configuration, as loaded by mipki_init or mipki_reload
+typedef struct cert_set {
   config_entry *config; // Flat array
   size_t config_len;
+  uint64_t generation;
+  size_t pins; // selected chains not yet released, plus one while current
+  struct cert_set *next; // in the list of retired sets
+} cert_set;
+
+// A stapled OCSP response that checked out, by hash of the response and certificate
+typedef struct {
+  unsigned char key[32];
+  time_t expiry; // 0 for an empty slot
+} ocsp_cache_slot;
+
+typedef struct mipki_state {
+  X509_STORE *store;
+  mipki_lock lock; // for current, retired, pins, stapled responses and the OCSP cache
+  mipki_lock update_lock; // taken first, by mipki_reload and mipki_refresh_ocsp
+  cert_set *current;
+  cert_set *retired;
+  ocsp_callback ocsp_source;
+  void *ocsp_ctx;
+  ocsp_cache_slot ocsp_cache[OCSP_CACHE_SLOTS];
+  mipki_ocsp_stats ocsp_stats;
 } mipki_state;
 
 #if DEBUG
@@ -104,39 +169,35 @@ int password_cb(char *buf, int size, int rwflag, void *p)
   return s->cb(buf, size, s->info);
 }
 
-void MITLS_CALLCONV mipki_free(mipki_state *st)
+static void free_entry(config_entry *cfg)
 {
-  if(!st) return;
+  X509_free(cfg->endpoint);
+  EVP_PKEY_free(cfg->key);
+  sk_X509_pop_free(cfg->intermediates, X509_free);
+  free(cfg->ocsp);
+}
 
-  for(size_t i=0; i<st->config_len; i++)
-  {
-    config_entry *cfg = st->config + i;
-    X509_free(cfg->endpoint);
-    EVP_PKEY_free(cfg->key);
-    sk_X509_pop_free(cfg->intermediates, X509_free);
-  }
+static void free_set(cert_set *set)
+{
+  if(!set) return;
 
-  free(st->config);
-  X509_STORE_free(st->store);
-  free(st);
+  for(size_t i=0; i<set->config_len; i++)
+    free_entry(set->config + i);
+
+  free(set->config);
+  free(set);
 }
 
-mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx)
+// Loads the configured chains and keys; on error, *erridx is the failing entry
+static cert_set* load_set(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx)
 {
   *erridx = -1;
-  X509_STORE *store = X509_STORE_new();
-  if(!store) return 0;
-
-  if(!X509_STORE_set_default_paths(store)) return 0;
-  X509_STORE_set_verify_cb_func(store, cert_verify_cb);
+  cert_set *set = calloc(1, sizeof(cert_set));
+  config_entry *c = calloc(config_len ? config_len : 1, sizeof(config_entry));
+  if(!set || !c) goto fail;
 
-  mipki_state *st = malloc(sizeof(mipki_state));
-  config_entry *c = malloc(sizeof(config_entry) * config_len);
-  if(!st || !c) return NULL;
-
-  st->store = store;
-  st->config = c;
-  st->config_len = 0;
+  set->config = c;
+  set->pins = 1;
 
   for(size_t i = 0; i < config_len; i++)
   {
@@ -147,17 +208,19 @@ mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t
 
     STACK_OF(X509) *chain = sk_X509_new_null();
     X509 *x509 = NULL;
+    EVP_PKEY *sk = NULL;
 
-    if(!chain) return 0;
+    if(!chain) goto fail;
 
     BIO *bio = BIO_new_file(cur->key_file, "r");
-    if(!bio) return 0;
+    if(!bio) goto fail_entry;
 
-    EVP_PKEY* sk = PEM_read_bio_PrivateKey(bio, NULL, password_cb, (void*)&cbs);
-    if(!sk || !BIO_free(bio)) return 0;
+    sk = PEM_read_bio_PrivateKey(bio, NULL, password_cb, (void*)&cbs);
+    BIO_free(bio);
+    if(!sk) goto fail_entry;
 
     bio = BIO_new_file(cur->cert_file, "r");
-    if(!bio) return 0;
+    if(!bio) goto fail_entry;
 
     for(size_t j = 0; ; j++)
     {
@@ -167,32 +230,194 @@ mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t
         int n = ERR_peek_last_error();
 
         if(!j || !(ERR_GET_LIB(n) == ERR_LIB_PEM && ERR_GET_REASON(n) == PEM_R_NO_START_LINE))
-          return 0;
-        else
-          break; // Chain is complete, allegedly
+        {
+          BIO_free(bio);
+          goto fail_entry;
+        }
+        ERR_clear_error();
+        break; // Chain is complete, allegedly
       }
 
       // Check that the private key matches the first certificate in the file
       if(!j) {
-        if(!X509_check_private_key(x509, sk))
-          return 0;
-
         cfg->endpoint = x509;
+        if(!X509_check_private_key(x509, sk))
+        {
+          BIO_free(bio);
+          goto fail_entry;
+        }
       } else {
         sk_X509_push(chain, x509);
       }
     }
+    BIO_free(bio);
 
-    st->config_len++;
+    set->config_len++;
     cfg->intermediates = chain;
     cfg->key = sk;
     cfg->is_universal = cur->is_universal;
     cfg->is_ephemeral = 0;
+    cfg->set = set;
+    continue;
+
+   fail_entry:
+    X509_free(cfg->endpoint);
+    EVP_PKEY_free(sk);
+    sk_X509_pop_free(chain, X509_free);
+    goto fail;
+  }
+
+  return set;
+
+ fail:
+  if(set) free_set(set);
+  else free(c);
+  return NULL;
+}
+
+// Pins the current set for a selection
+static cert_set* pin_current(mipki_state *st)
+{
+  LOCK(&st->lock);
+  cert_set *set = st->current;
+  set->pins++;
+  UNLOCK(&st->lock);
+  return set;
+}
+
+static void unpin(mipki_state *st, cert_set *set)
+{
+  cert_set *dead = NULL;
+
+  LOCK(&st->lock);
+  if(--set->pins == 0)
+  {
+    // Only retired sets lose their last pin
+    cert_set **p = &st->retired;
+    while(*p != set) p = &(*p)->next;
+    *p = set->next;
+    dead = set;
+  }
+  UNLOCK(&st->lock);
+
+  free_set(dead);
+}
+
+void MITLS_CALLCONV mipki_free(mipki_state *st)
+{
+  if(!st) return;
+
+  // As before reloads, chains must not be used after mipki_free
+  free_set(st->current);
+  while(st->retired)
+  {
+    cert_set *set = st->retired;
+    st->retired = set->next;
+    free_set(set);
+  }
+
+  LOCK_FREE(&st->lock);
+  LOCK_FREE(&st->update_lock);
+  X509_STORE_free(st->store);
+  free(st);
+}
+
+mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx)
+{
+  *erridx = -1;
+  X509_STORE *store = X509_STORE_new();
+  if(!store) return 0;
+
+  if(!X509_STORE_set_default_paths(store)) { X509_STORE_free(store); return 0; }
+  X509_STORE_set_verify_cb_func(store, cert_verify_cb);
+
+  mipki_state *st = calloc(1, sizeof(mipki_state));
+  cert_set *set = load_set(config, config_len, pcb, erridx);
+  if(!st || !set)
+  {
+    free(st);
+    free_set(set);
+    X509_STORE_free(store);
+    return NULL;
   }
 
+  st->store = store;
+  st->current = set;
+  LOCK_INIT(&st->lock);
+  LOCK_INIT(&st->update_lock);
   return st;
 }
 
+// Copies the stapled OCSP responses of certificates that did not change.
+// Called with the update lock, which keeps the responses of from in place.
+static void carry_ocsp(const cert_set *from, cert_set *to)
+{
+  for(size_t i = 0; i < to->config_len; i++)
+  {
+    config_entry *cfg = to->config + i;
+    for(size_t j = 0; j < from->config_len; j++)
+    {
+      const config_entry *old = from->config + j;
+      if(old->ocsp == NULL || X509_cmp(old->endpoint, cfg->endpoint) != 0) continue;
+      if((cfg->ocsp = malloc(old->ocsp_len)) == NULL) break;
+      memcpy(cfg->ocsp, old->ocsp, old->ocsp_len);
+      cfg->ocsp_len = old->ocsp_len;
+      cfg->ocsp_expiry = old->ocsp_expiry;
+      break;
+    }
+  }
+}
+
+int MITLS_CALLCONV mipki_reload(mipki_state *st, const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx)
+{
+  assert(st != NULL);
+  cert_set *set = load_set(config, config_len, pcb, erridx), *dead = NULL;
+  if(!set) return 0;
+
+  // Only reloads replace current, so it can be read under the update lock;
+  // selections, which take the state lock, do not wait for the copies
+  LOCK(&st->update_lock);
+  cert_set *old = st->current;
+  carry_ocsp(old, set);
+  set->generation = old->generation + 1;
+
+  LOCK(&st->lock);
+  st->current = set;
+  if(--old->pins == 0)
+    dead = old;
+  else
+  {
+    old->next = st->retired;
+    st->retired = old;
+  }
+  UNLOCK(&st->lock);
+  UNLOCK(&st->update_lock);
+
+  #if DEBUG
+    printf("mipki_reload: generation %d, %d entries\n", (int)set->generation, (int)set->config_len);
+  #endif
+
+  free_set(dead);
+  return 1;
+}
+
+int MITLS_CALLCONV mipki_get_reload_stats(mipki_state *st, mipki_reload_stats *stats)
+{
+  assert(st != NULL);
+  memset(stats, 0, sizeof(*stats));
+
+  LOCK(&st->lock);
+  stats->generation = st->current->generation;
+  stats->pinned = st->current->pins - 1;
+  for(cert_set *set = st->retired; set != NULL; set = set->next)
+  {
+    stats->retired++;
+    stats->pinned += set->pins;
+  }
+  UNLOCK(&st->lock);
+  return 1;
+}
+
 int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_file)
 {
   assert(st != NULL);
@@ -232,9 +457,12 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
     free(sni_str);
   #endif
 
-  for(size_t i = 0; i < st->config_len; i++)
+  // The selected chain keeps the set pinned until mipki_free_chain
+  cert_set *set = pin_current(st);
+
+  for(size_t i = 0; i < set->config_len; i++)
   {
-    config_entry *cfg = st->config + i;
+    config_entry *cfg = set->config + i;
 
     #if DEBUG
       char buf[256];
@@ -262,6 +490,7 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
           case EVP_PKEY_RSA:     printf(" - RSA key\n"); break;
           case EVP_PKEY_EC:      printf(" - ECDSA key\n"); break;
           case EVP_PKEY_ED25519: printf(" - EdDSA-25519 key\n"); break;
+          case EVP_PKEY_ED448:   printf(" - EdDSA-448 key\n"); break;
         }
       #endif
 
@@ -289,6 +518,11 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
               *selected = alg;
             break;
 
+          case EVP_PKEY_ED448:
+            if(high == 8 && low == 8)
+              *selected = alg;
+            break;
+
           case EVP_PKEY_EC:
             curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(cfg->key)));
             if((curve == NID_X9_62_prime256v1 && high == 4 && low == 3) ||
@@ -313,6 +547,7 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
     }
   }
 
+  unpin(st, set);
   *selected = 0;
   return NULL;
 }
@@ -514,7 +749,8 @@ mipki_chain MITLS_CALLCONV mipki_parse_chain(mipki_state *st, const char *chain,
     .intermediates = sk_X509_new_null(),
     .key = NULL,
     .is_universal = 0,
-    .is_ephemeral = 1
+    .is_ephemeral = 1,
+    .set = NULL
   };
 
   do {
@@ -588,7 +824,8 @@ mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs,
     .intermediates = sk_X509_new_null(),
     .key = NULL,
     .is_universal = 0,
-    .is_ephemeral = 1
+    .is_ephemeral = 1,
+    .set = NULL
   };
 
   for(size_t i = 0; i < chain_len; i++)
@@ -626,22 +863,28 @@ mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs,
     return NULL;
 }
 
+// The endpoint certificate, then the intermediates, without modifying the
+// chain, which may be in use by other threads
+static X509* chain_element(const config_entry *cfg, int i)
+{
+  return i == 0 ? cfg->endpoint : sk_X509_value(cfg->intermediates, i - 1);
+}
+
 size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len)
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
   char *cur = buffer;
   char *end = buffer + buffer_len;
-  sk_X509_insert(cfg->intermediates, cfg->endpoint, 0);
 
   #if DEBUG
     printf("Formatting the selected certificate chain.\n");
   #endif
 
-  for(int i = 0; i < sk_X509_num(cfg->intermediates); i++)
+  for(int i = 0; i <= sk_X509_num(cfg->intermediates); i++)
   {
     unsigned char *buf = NULL;
-    X509 *x509 = sk_X509_value(cfg->intermediates, i);
+    X509 *x509 = chain_element(cfg, i);
 
     #if DEBUG
       char nb[256];
@@ -655,7 +898,7 @@ size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chai
       #if DEBUG
         printf("mipki_format_chain: i2d_X509 failed.\n");
       #endif
-      sk_X509_shift(cfg->intermediates);
+      OPENSSL_free(buf);
       return 0;
     }
 
@@ -671,7 +914,6 @@ size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chai
     printf("Written %d bytes to chain buffer:\n", cur-buffer);
     dump(buffer, cur - buffer);
   #endif
-  sk_X509_shift(cfg->intermediates);
   return (cur - buffer);
 }
 
@@ -679,17 +921,16 @@ void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void*
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
-  sk_X509_insert(cfg->intermediates, cfg->endpoint, 0);
   void* list = init;
 
   #if DEBUG
     printf("Formatting the selected certificate chain.\n");
   #endif
 
-  for(int i = 0; i < sk_X509_num(cfg->intermediates); i++)
+  for(int i = 0; i <= sk_X509_num(cfg->intermediates); i++)
   {
     unsigned char *buf = NULL;
-    X509 *x509 = sk_X509_value(cfg->intermediates, i);
+    X509 *x509 = chain_element(cfg, i);
 
     #if DEBUG
       char nb[256];
@@ -702,8 +943,6 @@ void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void*
     assert(buf != NULL);
     i2d_X509(x509, &buf);
   }
-
-  sk_X509_shift(cfg->intermediates);
 }
 
 #if DEBUG
@@ -756,8 +995,9 @@ int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain
 
   X509_VERIFY_PARAM_set_flags(param, flags);
   X509_VERIFY_PARAM_set1_host(param, host, 0);
-  X509_STORE_set1_param(st->store, param);
+  // The store is shared by concurrent validations and OCSP checks
   X509_STORE_CTX_init(ctx, st->store, cfg->endpoint, cfg->intermediates);
+  X509_VERIFY_PARAM_set1(X509_STORE_CTX_get0_param(ctx), param);
 
   int r = X509_verify_cert(ctx);
   #if DEBUG
@@ -770,16 +1010,292 @@ int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain
   return r;
 }
 
+// The issuer of x, from the chain or the trusted roots (a new reference)
+static X509* find_issuer(mipki_state *st, X509 *x, STACK_OF(X509) *chain)
+{
+  X509 *issuer = NULL;
+
+  for(int i = 0; i < sk_X509_num(chain); i++)
+  {
+    X509 *c = sk_X509_value(chain, i);
+    if(X509_check_issued(c, x) == X509_V_OK)
+    {
+      X509_up_ref(c);
+      return c;
+    }
+  }
+
+  X509_STORE_CTX *ctx = X509_STORE_CTX_new();
+  if(ctx && X509_STORE_CTX_init(ctx, st->store, x, chain))
+  {
+    if(X509_STORE_CTX_get1_issuer(&issuer, ctx, x) <= 0)
+      issuer = NULL;
+  }
+  X509_STORE_CTX_free(ctx);
+  return issuer;
+}
+
+// Checks that a DER OCSP response is signed by the issuer of x or a responder it
+// delegated to, is current, and reports x as good; *expiry is its nextUpdate
+static int check_ocsp(mipki_state *st, X509 *x, X509 *issuer, STACK_OF(X509) *certs, unsigned long flags,
+  const unsigned char *der, size_t der_len, time_t *expiry)
+{
+  const unsigned char *p = der;
+  OCSP_RESPONSE *resp = d2i_OCSP_RESPONSE(NULL, &p, (long)der_len);
+  OCSP_BASICRESP *br = NULL;
+  int r = 0;
+
+  if(!resp || p != der + der_len
+     || OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL
+     || (br = OCSP_response_get1_basic(resp)) == NULL)
+    goto end;
+
+  if(OCSP_basic_verify(br, certs, st->store, flags) <= 0)
+  {
+    #if DEBUG
+      printf("check_ocsp: the response signature does not verify\n");
+    #endif
+    goto end;
+  }
+
+  // The response may identify the certificate with any hash algorithm
+  for(int i = 0; i < OCSP_resp_count(br); i++)
+  {
+    OCSP_SINGLERESP *single = OCSP_resp_get0(br, i);
+    const OCSP_CERTID *cid = OCSP_SINGLERESP_get0_id(single);
+    ASN1_OBJECT *md = NULL;
+    ASN1_GENERALIZEDTIME *thisupd = NULL, *nextupd = NULL;
+    int reason, day, sec;
+
+    if(!OCSP_id_get0_info(NULL, &md, NULL, NULL, (OCSP_CERTID*)cid)) continue;
+    OCSP_CERTID *id = OCSP_cert_to_id(EVP_get_digestbyobj(md), x, issuer);
+    int same = id != NULL && OCSP_id_cmp(id, cid) == 0;
+    OCSP_CERTID_free(id);
+    if(!same) continue;
+
+    if(OCSP_single_get0_status(single, &reason, NULL, &thisupd, &nextupd) != V_OCSP_CERTSTATUS_GOOD
+       || !OCSP_check_validity(thisupd, nextupd, OCSP_CLOCK_SKEW, -1))
+      break;
+
+    *expiry = time(NULL) + OCSP_DEFAULT_LIFETIME;
+    if(nextupd != NULL && ASN1_TIME_diff(&day, &sec, NULL, nextupd))
+      *expiry = time(NULL) + (time_t)day * 86400 + sec;
+    r = 1;
+    break;
+  }
+
+ end:
+  #if DEBUG
+    printf("check_ocsp = %d\n", r);
+  #endif
+  OCSP_BASICRESP_free(br);
+  OCSP_RESPONSE_free(resp);
+  ERR_clear_error();
+  return r;
+}
+
+int MITLS_CALLCONV mipki_set_ocsp_source(mipki_state *st, ocsp_callback cb, void *ctx)
+{
+  assert(st != NULL);
+  LOCK(&st->lock);
+  st->ocsp_source = cb;
+  st->ocsp_ctx = ctx;
+  UNLOCK(&st->lock);
+  return 1;
+}
+
+// Asks the source for a response for entry i, and checks it
+static unsigned char* fetch_ocsp(mipki_state *st, ocsp_callback cb, void *ctx, size_t i,
+  config_entry *cfg, size_t *len, time_t *expiry)
+{
+  X509 *issuer = find_issuer(st, cfg->endpoint, cfg->intermediates);
+  OCSP_REQUEST *req = OCSP_REQUEST_new();
+  OCSP_CERTID *id = NULL;
+  STACK_OF(OPENSSL_STRING) *urls = NULL;
+  STACK_OF(X509) *certs = sk_X509_new_null();
+  unsigned char *der = NULL, *resp = NULL;
+  int der_len;
+
+  if(!issuer || !req || !certs) goto fail;
+  if((id = OCSP_cert_to_id(NULL, cfg->endpoint, issuer)) == NULL) goto fail;
+  if(!OCSP_request_add0_id(req, id)) { OCSP_CERTID_free(id); goto fail; }
+  if((der_len = i2d_OCSP_REQUEST(req, &der)) <= 0) goto fail;
+
+  // Without a nonce, so that the response can be stapled to many connections
+  urls = X509_get1_ocsp(cfg->endpoint);
+  if((resp = malloc(MIPKI_MAX_OCSP_LEN)) == NULL) goto fail;
+  *len = cb(ctx, i, urls ? sk_OPENSSL_STRING_value(urls, 0) : NULL,
+    (const char*)der, der_len, (char*)resp, MIPKI_MAX_OCSP_LEN);
+  if(*len == 0 || *len > MIPKI_MAX_OCSP_LEN) goto fail;
+
+  // We trust our own issuer to sign responses for our certificate
+  sk_X509_push(certs, issuer);
+  if(!check_ocsp(st, cfg->endpoint, issuer, certs, OCSP_TRUSTOTHER, resp, *len, expiry))
+    goto fail;
+
+  unsigned char *r = realloc(resp, *len);
+  if(r) resp = r;
+  goto done;
+
+ fail:
+  free(resp);
+  resp = NULL;
+ done:
+  X509_email_free(urls);
+  OPENSSL_free(der);
+  OCSP_REQUEST_free(req);
+  sk_X509_free(certs);
+  X509_free(issuer);
+  return resp;
+}
+
+int MITLS_CALLCONV mipki_refresh_ocsp(mipki_state *st, uint32_t margin)
+{
+  assert(st != NULL);
+  int valid = 0;
+
+  LOCK(&st->lock);
+  ocsp_callback cb = st->ocsp_source;
+  void *ctx = st->ocsp_ctx;
+  UNLOCK(&st->lock);
+  if(cb == NULL) return 0;
+
+  // The set stays pinned while the source is called, without the lock
+  cert_set *set = pin_current(st);
+
+  for(size_t i = 0; i < set->config_len; i++)
+  {
+    config_entry *cfg = set->config + i;
+    time_t now = time(NULL), expiry = 0;
+    size_t len = 0;
+
+    LOCK(&st->lock);
+    int fresh = cfg->ocsp != NULL && cfg->ocsp_expiry - (time_t)margin > now;
+    UNLOCK(&st->lock);
+    if(fresh) { valid++; continue; }
+
+    unsigned char *resp = fetch_ocsp(st, cb, ctx, i, cfg, &len, &expiry), *old = NULL;
+
+    LOCK(&st->update_lock);
+    LOCK(&st->lock);
+    if(resp != NULL)
+    {
+      old = cfg->ocsp;
+      cfg->ocsp = resp;
+      cfg->ocsp_len = len;
+      cfg->ocsp_expiry = expiry;
+      st->ocsp_stats.fetched++;
+    }
+    else st->ocsp_stats.failures++;
+    // A failed refresh keeps stapling the current response until it expires
+    if(cfg->ocsp != NULL && cfg->ocsp_expiry > now) valid++;
+    UNLOCK(&st->lock);
+    UNLOCK(&st->update_lock);
+    free(old);
+
+    #if DEBUG
+      printf("mipki_refresh_ocsp: entry %d %s\n", (int)i, resp ? "refreshed" : "failed");
+    #endif
+  }
+
+  unpin(st, set);
+  return valid;
+}
+
+size_t MITLS_CALLCONV mipki_get_ocsp_response(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len)
+{
+  assert(st != NULL);
+  config_entry *cfg = (config_entry*)chain;
+  size_t len = 0;
+
+  if(cfg == NULL || cfg->is_ephemeral) return 0;
+
+  LOCK(&st->lock);
+  if(cfg->ocsp != NULL && cfg->ocsp_expiry > time(NULL) && cfg->ocsp_len <= buffer_len)
+  {
+    memcpy(buffer, cfg->ocsp, cfg->ocsp_len);
+    len = cfg->ocsp_len;
+    st->ocsp_stats.stapled++;
+  }
+  UNLOCK(&st->lock);
+  return len;
+}
+
+int MITLS_CALLCONV mipki_check_ocsp_response(mipki_state *st, const mipki_chain chain, const char *resp, size_t resp_len)
+{
+  assert(st != NULL);
+  config_entry *cfg = (config_entry*)chain;
+  unsigned char key[32], md[EVP_MAX_MD_SIZE];
+  unsigned int md_len = 0;
+  time_t now = time(NULL), expiry = 0;
+  int r = 0;
+
+  if(cfg == NULL || resp == NULL || resp_len == 0 || resp_len > MIPKI_MAX_OCSP_LEN) return 0;
+
+  // The cache key binds the response to the certificate it was checked for
+  EVP_MD_CTX *h = EVP_MD_CTX_new();
+  if(!h || !X509_digest(cfg->endpoint, EVP_sha256(), md, &md_len)
+     || !EVP_DigestInit_ex(h, EVP_sha256(), NULL)
+     || !EVP_DigestUpdate(h, md, md_len)
+     || !EVP_DigestUpdate(h, resp, resp_len)
+     || !EVP_DigestFinal_ex(h, key, NULL))
+  {
+    EVP_MD_CTX_free(h);
+    return 0;
+  }
+  EVP_MD_CTX_free(h);
+
+  ocsp_cache_slot *slot = st->ocsp_cache + (key[0] | key[1] << 8) % OCSP_CACHE_SLOTS;
+
+  LOCK(&st->lock);
+  st->ocsp_stats.checked++;
+  if(slot->expiry > now && memcmp(slot->key, key, sizeof(key)) == 0)
+  {
+    st->ocsp_stats.cache_hits++;
+    r = 1;
+  }
+  UNLOCK(&st->lock);
+  if(r) return 1;
+
+  X509 *issuer = find_issuer(st, cfg->endpoint, cfg->intermediates);
+  r = issuer != NULL && check_ocsp(st, cfg->endpoint, issuer, cfg->intermediates, 0,
+    (const unsigned char*)resp, resp_len, &expiry);
+  X509_free(issuer);
+
+  LOCK(&st->lock);
+  if(r)
+  {
+    memcpy(slot->key, key, sizeof(key));
+    slot->expiry = expiry;
+  }
+  else st->ocsp_stats.rejected++;
+  UNLOCK(&st->lock);
+  return r;
+}
+
+int MITLS_CALLCONV mipki_get_ocsp_stats(mipki_state *st, mipki_ocsp_stats *stats)
+{
+  assert(st != NULL);
+  LOCK(&st->lock);
+  *stats = st->ocsp_stats;
+  UNLOCK(&st->lock);
+  return 1;
+}
+
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain)
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
-  if(cfg == NULL || !cfg->is_ephemeral) return;
+  if(cfg == NULL) return;
 
-  X509_free(cfg->endpoint);
-  EVP_PKEY_free(cfg->key);
-  sk_X509_pop_free(cfg->intermediates, X509_free);
+  // Selected chains release their certificate set
+  if(!cfg->is_ephemeral)
+  {
+    if(cfg->set != NULL) unpin(st, cfg->set);
+    return;
+  }
 
+  free_entry(cfg);
   free(cfg);
 }
 
@@ -805,5 +1321,12 @@ size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chai
 void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void* init, alloc_callback cb) { D(); }
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain, const char *host) { D(); return 0; }
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain) { D(); }
+int MITLS_CALLCONV mipki_reload(mipki_state *st, const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx) { D(); return 0; }
+int MITLS_CALLCONV mipki_get_reload_stats(mipki_state *st, mipki_reload_stats *stats) { D(); return 0; }
+int MITLS_CALLCONV mipki_set_ocsp_source(mipki_state *st, ocsp_callback cb, void *ctx) { D(); return 0; }
+int MITLS_CALLCONV mipki_refresh_ocsp(mipki_state *st, uint32_t margin) { D(); return 0; }
+size_t MITLS_CALLCONV mipki_get_ocsp_response(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len) { D(); return 0; }
+int MITLS_CALLCONV mipki_check_ocsp_response(mipki_state *st, const mipki_chain chain, const char *resp, size_t resp_len) { D(); return 0; }
+int MITLS_CALLCONV mipki_get_ocsp_stats(mipki_state *st, mipki_ocsp_stats *stats) { D(); return 0; }
 
 #endif
@@ -58,12 +58,27 @@ typedef void* (MITLS_CALLCONV *alloc_callback)(void* cur, size_t len, /*out*/ ch
 mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx);
 void MITLS_CALLCONV mipki_free(mipki_state *st);
 
+// Replace the server configuration, e.g. to rotate certificates, without disrupting
+// connections. Returns 0 and keeps the current configuration if an entry cannot be
+// loaded (*erridx is its index). Chains selected before the reload remain valid until
+// they are released with mipki_free_chain; the trusted roots are unchanged.
+int MITLS_CALLCONV mipki_reload(mipki_state *st, const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx);
+
+typedef struct {
+  uint64_t generation; // number of successful reloads
+  size_t retired;      // replaced configurations still in use
+  size_t pinned;       // selected chains not yet released
+} mipki_reload_stats;
+
+int MITLS_CALLCONV mipki_get_reload_stats(mipki_state *st, mipki_reload_stats *stats);
+
 // OpenSSL specific: configure a root certificate file or hash directory.
 // This is mandatory to perform certificate chain validation
 int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_file);
 
 // Find a certificate and signature algorithm compatible with the given SNI and list of offered signature algorithms
 // Returns a pointer to the selected entry or NULL if no certificate is suitable
+// The selected entry should be released with mipki_free_chain once the handshake is over
 mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char *sni, size_t sni_len, const mipki_signature *algs, size_t algs_len, mipki_signature *selected);
 
 // A combined signature-and-verify function (depending on m)
@@ -89,8 +104,49 @@ void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void*
 // Certificate chain validation. This checks revocation, expiration, and matches the hostname
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, mipki_chain chain, const char *host);
 
-// Free a chain after use.
+// Free a chain after use. Also releases a chain returned by mipki_select_certificate
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain);
 
+// OCSP stapling. Servers keep an OCSP response for each configured certificate,
+// fetched ahead of time from a source provided by the application, so that stapling
+// it in a handshake is a copy. Clients check stapled responses with a cache.
+#define MIPKI_MAX_OCSP_LEN 65531 // the largest response a TLS 1.3 certificate entry can carry
+
+// A callback to fetch the OCSP response to a DER request for the certificate of the
+// given configuration entry, e.g. from an HTTP client for url (the responder given in
+// the certificate, NULL if none), or from a local stand-in responder.
+// Should return the size of the DER response written to resp, or 0 on error
+typedef size_t (MITLS_CALLCONV *ocsp_callback)(void *ctx, size_t entry, const char *url, const char *req, size_t req_len, char *resp, size_t resp_max);
+
+int MITLS_CALLCONV mipki_set_ocsp_source(mipki_state *st, ocsp_callback cb, void *ctx);
+
+// Fetch a response for each configured certificate without one valid for margin more seconds,
+// and keep those signed by its issuer (or a delegated responder) that report it as good.
+// The issuer must be in the certificate file or the trusted roots.
+// Meant to be called periodically off the handshake path, and after mipki_reload;
+// a response that cannot be refreshed is stapled until it expires.
+// Returns the number of certificates with a valid response
+int MITLS_CALLCONV mipki_refresh_ocsp(mipki_state *st, uint32_t margin);
+
+// Copy the OCSP response to staple for a selected chain into buffer
+// Returns its size, or 0 if the chain has no valid response
+size_t MITLS_CALLCONV mipki_get_ocsp_response(mipki_state *st, mipki_chain chain, char *buffer, size_t buffer_len);
+
+// Check an OCSP response stapled to a parsed chain: it must be signed by the issuer of the
+// end-entity certificate or a delegated responder, chain to a trusted root, be current and
+// report the certificate as good. Responses that checked out are cached until their nextUpdate
+int MITLS_CALLCONV mipki_check_ocsp_response(mipki_state *st, mipki_chain chain, const char *resp, size_t resp_len);
+
+typedef struct {
+  uint64_t fetched;    // responses fetched and kept by mipki_refresh_ocsp
+  uint64_t failures;   // fetches that failed or returned an unusable response
+  uint64_t stapled;    // responses copied by mipki_get_ocsp_response
+  uint64_t checked;    // stapled responses checked by mipki_check_ocsp_response
+  uint64_t cache_hits; // ... that were found in the cache
+  uint64_t rejected;   // ... that did not check out
+} mipki_ocsp_stats;
+
+int MITLS_CALLCONV mipki_get_ocsp_stats(mipki_state *st, mipki_ocsp_stats *stats);
+
 
 #endif
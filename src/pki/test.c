@@ -5,6 +5,13 @@
 
 #include "mipki.h"
 
+// A source standing in for an unreachable OCSP responder
+static size_t MITLS_CALLCONV no_ocsp(void *ctx, size_t entry, const char *url, const char *req, size_t req_len, char *resp, size_t resp_max)
+{
+  (*(int*)ctx)++;
+  return 0;
+}
+
 static void dump(const unsigned char *buffer, size_t len)
 {
   int i;
@@ -92,6 +99,21 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  // The selected chain outlives a reload of the configuration
+  mipki_reload_stats stats;
+  if(!mipki_reload(st, config, 1, NULL, &erridx))
+  {
+    printf("FAILURE: reload errid=%d\n", erridx);
+    return 1;
+  }
+  mipki_get_reload_stats(st, &stats);
+  printf("Reloaded: generation=%d retired=%d pinned=%d\n", (int)stats.generation, (int)stats.retired, (int)stats.pinned);
+  if(stats.generation != 1 || stats.retired != 1 || stats.pinned != 1)
+  {
+    printf("ERROR: the selected chain should pin the old configuration\n");
+    return 1;
+  }
+
   size_t len = mipki_format_chain(st, s, sig, 8192);
   if(len > 0)
   {
@@ -103,7 +125,28 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  // Without a response nothing is stapled, and a bogus one does not check out
+  int fetches = 0;
+  mipki_ocsp_stats ocsp;
+  mipki_set_ocsp_source(st, no_ocsp, &fetches);
+  if(mipki_refresh_ocsp(st, 60) != 0 || fetches > 1
+     || mipki_get_ocsp_response(st, s, sig, 8192) != 0
+     || mipki_check_ocsp_response(st, s, "\x30\x03\x0a\x01\x00", 5))
+  {
+    printf("ERROR: unexpected OCSP response\n");
+    return 1;
+  }
+  mipki_get_ocsp_stats(st, &ocsp);
+  printf("OCSP: failures=%d rejected=%d\n", (int)ocsp.failures, (int)ocsp.rejected);
+
   mipki_free_chain(st, s);
+  mipki_get_reload_stats(st, &stats);
+  if(stats.retired != 0 || stats.pinned != 0)
+  {
+    printf("ERROR: the old configuration should be freed with its last chain\n");
+    return 1;
+  }
+
   free(sig);
   mipki_free(st);
 
@@ -57,6 +57,26 @@ void mipki_free(mipki_state *st)
     HeapFree(GetProcessHeap(), 0, st);
 }
 
+int mipki_reload(mipki_state *st, const mipki_config_entry config[], size_t config_len, password_callback pcb, int *erridx)
+{
+    UNREFERENCED_PARAMETER(st);
+    UNREFERENCED_PARAMETER(config);
+    UNREFERENCED_PARAMETER(config_len);
+    UNREFERENCED_PARAMETER(pcb);
+#if DEBUG
+    printf("mipki_reload - not supported on Windows.  Certificates are selected from the system store as installed.\n");
+#endif
+    *erridx = -1;
+    return 0;
+}
+
+int mipki_get_reload_stats(mipki_state *st, mipki_reload_stats *stats)
+{
+    UNREFERENCED_PARAMETER(st);
+    memset(stats, 0, sizeof(*stats));
+    return 1;
+}
+
 
 int mipki_add_root_file_or_path(mipki_state *st, const char *ca_file)
 {
@@ -586,4 +606,50 @@ void mipki_free_chain(mipki_state *st, mipki_chain chain)
     CertFreeCertificateContext(p);
 }
 
+int mipki_set_ocsp_source(mipki_state *st, ocsp_callback cb, void *ctx)
+{
+    UNREFERENCED_PARAMETER(st);
+    UNREFERENCED_PARAMETER(cb);
+    UNREFERENCED_PARAMETER(ctx);
+#if DEBUG
+    printf("mipki_set_ocsp_source - not supported on Windows.  Nothing is stapled.\n");
+#endif
+    return 0;
+}
+
+int mipki_refresh_ocsp(mipki_state *st, uint32_t margin)
+{
+    UNREFERENCED_PARAMETER(st);
+    UNREFERENCED_PARAMETER(margin);
+    return 0;
+}
+
+size_t mipki_get_ocsp_response(mipki_state *st, mipki_chain chain, char *buffer, size_t buffer_len)
+{
+    UNREFERENCED_PARAMETER(st);
+    UNREFERENCED_PARAMETER(chain);
+    UNREFERENCED_PARAMETER(buffer);
+    UNREFERENCED_PARAMETER(buffer_len);
+    return 0;
+}
+
+int mipki_check_ocsp_response(mipki_state *st, mipki_chain chain, const char *resp, size_t resp_len)
+{
+    UNREFERENCED_PARAMETER(st);
+    UNREFERENCED_PARAMETER(chain);
+    UNREFERENCED_PARAMETER(resp);
+    UNREFERENCED_PARAMETER(resp_len);
+#if DEBUG
+    printf("mipki_check_ocsp_response - not supported on Windows.\n");
+#endif
+    return 0;
+}
+
+int mipki_get_ocsp_stats(mipki_state *st, mipki_ocsp_stats *stats)
+{
+    UNREFERENCED_PARAMETER(st);
+    memset(stats, 0, sizeof(*stats));
+    return 1;
+}
+
 
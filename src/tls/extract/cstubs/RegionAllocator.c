@@ -28,15 +28,6 @@
 
 #if REGION_STATISTICS
 
-typedef struct _region_statistics {
-    size_t current_bytes;   // bytes currently allocated
-    size_t total_bytes;     // total of all allocations
-    size_t peak_bytes;      // max value of current_bytes
-    size_t allocation_count;// count of allocations made
-    size_t free_count;      // count of frees made
-    size_t allocation_failures; // count of allocation fails due to OOM
-} region_statistics;
-
 #ifndef KRML_HOST_PRINTF
 #define KRML_HOST_PRINTF printf
 #endif
@@ -52,6 +43,18 @@ void PrintRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
     KRML_HOST_PRINTF("========\n");
 }
 
+// Map an allocation size to its histogram bucket
+static size_t HistogramBucket(size_t cb)
+{
+    size_t bucket = 0;
+    size_t limit = 16;
+    while (cb > limit && bucket < REGION_HISTOGRAM_BUCKETS-1) {
+        limit <<= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
 void UpdateStatisticsAfterMalloc(region_statistics *stats, void *pv, size_t cb)
 {
     stats->allocation_count++;
@@ -61,6 +64,7 @@ void UpdateStatisticsAfterMalloc(region_statistics *stats, void *pv, size_t cb)
         if (stats->peak_bytes < stats->current_bytes) {
             stats->peak_bytes = stats->current_bytes;
         }
+        stats->histogram[HistogramBucket(cb)]++;
     } else {
         stats->allocation_failures++;
     }
@@ -71,21 +75,77 @@ void UpdateStatisticsAfterFree(region_statistics *stats, size_t cb)
     stats->current_bytes -= cb;
     stats->free_count++;
 }
+
+#define CopyRegionStatistics(dst, src) (memcpy((dst), (src), sizeof(region_statistics)), 1)
 #else
 #define UpdateStatisticsAfterMalloc(stats, pv, cb)
 #define UpdateStatisticsAfterFree(stats, cb)
 #define PrintRegionStatistics(rgn, stats)
+#define CopyRegionStatistics(dst, src) (memset((dst), 0, sizeof(region_statistics)), 0)
+
+#endif
 
+// Statistics are only printed on region destruction when explicitly requested
+#if REGION_STATISTICS && REGION_STATISTICS_TRACE
+#define TraceRegionStatistics(rgn, stats) PrintRegionStatistics(rgn, stats)
+#else
+#define TraceRegionStatistics(rgn, stats)
 #endif
 
 #if USE_HEAP_REGIONS
 
+#if defined(_MSC_VER)
+  #define THREAD_LOCAL __declspec(thread)
+  #define ATOMIC_ADD(p, v) InterlockedExchangeAddSizeT((p), (v))
+#else
+  #define THREAD_LOCAL __thread
+  #define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#endif
+
+region_limits g_limits;
+static THREAD_LOCAL int g_last_error;
+
+// Quotas may be lowered below what a region already holds
+static int OverQuota(size_t quota, size_t used, size_t cb)
+{
+    return quota != 0 && (used > quota || cb > quota - used);
+}
+
+static int AdmitHandshake(int *in_handshake)
+{
+    if (*in_handshake) {
+        return 1;
+    }
+    size_t max = g_limits.max_handshakes;
+    size_t n = ATOMIC_ADD(&g_limits.handshakes, 1);
+    if (max != 0 && n >= max) {
+        ATOMIC_ADD(&g_limits.handshakes, (size_t)-1);
+        ATOMIC_ADD(&g_limits.busy_failures, 1);
+        g_last_error = REGION_ERROR_BUSY;
+        return 0;
+    }
+    *in_handshake = 1;
+    return 1;
+}
+
+static void EndHandshake(int *in_handshake)
+{
+    if (*in_handshake) {
+        *in_handshake = 0;
+        ATOMIC_ADD(&g_limits.handshakes, (size_t)-1);
+    }
+}
+
 #if IS_WINDOWS
 typedef struct _region {
     HANDLE heap;
 #if !defined(_MSC_VER)
     jmp_buf *penv;
 #endif
+    SRWLOCK lock; // guards used and stats; zero is SRWLOCK_INIT
+    size_t quota;
+    size_t used; // live bytes, checked against quota
+    int in_handshake;
 #if REGION_STATISTICS
     region_statistics stats;
 #endif
@@ -115,7 +175,7 @@ int HeapRegionInitialize()
 // Global termination.  Frees all memory in the global region.
 void HeapRegionCleanup(void)
 {
-    PrintRegionStatistics(NULL, &g_global_region.stats);
+    TraceRegionStatistics(NULL, &g_global_region.stats);
     TlsFree(g_region_heap_slot);
     HeapDestroy(g_global_region.heap);
     g_region_heap_slot = 0;
@@ -136,6 +196,7 @@ HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn
     region *heap = HeapAlloc(h, 0, sizeof(region));
     memset(heap, 0, sizeof(*heap));
     heap->heap = h;
+    heap->quota = g_limits.region_quota;
     // Make it the heap for this callgraph
     HEAP_REGION oldrgn = HeapRegionEnter(heap
 #if !defined(_MSC_VER)
@@ -152,17 +213,31 @@ void HeapRegionDestroy(HEAP_REGION rgn)
 {
     region *heap = (region*)rgn;
     HANDLE h = heap->heap;
-    PrintRegionStatistics(heap, &heap->stats);
+    TraceRegionStatistics(heap, &heap->stats);
+    EndHandshake(&heap->in_handshake);
     HeapDestroy(h);
 }
 
+// Statistics may be read from a thread other than the one allocating
 void PrintHeapRegionStatistics(HEAP_REGION rgn)
 {
+    region_statistics stats;
+    if (GetHeapRegionStatistics(rgn, &stats)) {
+        PrintRegionStatistics(rgn ? rgn : &g_global_region, &stats);
+    }
+}
+
+int GetHeapRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
+{
+    int ret;
     region *heap = (region*)rgn;
     if (heap == NULL) {
         heap = &g_global_region;
     }
-    PrintRegionStatistics(heap, &heap->stats);
+    AcquireSRWLockExclusive(&heap->lock);
+    ret = CopyRegionStatistics(stats, &heap->stats);
+    ReleaseSRWLockExclusive(&heap->lock);
+    return ret;
 }
 
 HEAP_REGION HeapRegionEnter(HEAP_REGION rgn
@@ -173,6 +248,7 @@ HEAP_REGION HeapRegionEnter(HEAP_REGION rgn
 {
     HEAP_REGION oldrgn = TlsGetValue(g_region_heap_slot);
     TlsSetValue(g_region_heap_slot, rgn);
+    g_last_error = REGION_ERROR_NONE;
 #if !defined(_MSC_VER)
     region *heap = (region*)rgn;
     if (heap == NULL) {
@@ -196,8 +272,22 @@ void* HeapRegionMalloc(size_t cb)
     if (heap == NULL) {
         heap = &g_global_region;
     }
-    void *pv = HeapAlloc(heap->heap, 0, cb);
+    void *pv = NULL;
+    // The global region is shared by all threads
+    AcquireSRWLockExclusive(&heap->lock);
+    if (OverQuota(heap->quota, heap->used, cb)) {
+        ATOMIC_ADD(&g_limits.quota_failures, 1);
+        g_last_error = REGION_ERROR_QUOTA;
+    } else {
+        pv = HeapAlloc(heap->heap, 0, cb);
+        if (pv != NULL) {
+            heap->used += cb;
+        } else {
+            g_last_error = REGION_ERROR_OUT_OF_MEMORY;
+        }
+    }
     UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
+    ReleaseSRWLockExclusive(&heap->lock);
     if (pv == NULL) {
 #if defined(_MSC_VER)
         RaiseException((DWORD)MITLS_OUT_OF_MEMORY_EXCEPTION, EXCEPTION_NONCONTINUABLE, 0, NULL);
@@ -232,10 +322,11 @@ void HeapRegionFree(void* pv)
     if (heap == NULL) {
         heap = &g_global_region;
     }
-#if REGION_STATISTICS
     size_t cb = HeapSize(heap->heap, 0, pv);
+    AcquireSRWLockExclusive(&heap->lock);
+    heap->used -= cb;
     UpdateStatisticsAfterFree(&heap->stats, cb);
-#endif    
+    ReleaseSRWLockExclusive(&heap->lock);
     if (!HeapFree(heap->heap, 0, pv)) {
         // This can happen if allocating from one region and freeing from another
         KRML_HOST_PRINTF("HeapRegionFree of %p from heap %p failed.\n", pv, heap);
@@ -244,19 +335,20 @@ void HeapRegionFree(void* pv)
 
 #else // !IS_WINDOWS
 pthread_key_t g_region_heap_slot;
-pthread_mutex_t g_global_region_lock; 
 
 typedef struct region_allocation {
     LIST_ENTRY(region_allocation) entry;
-#if REGION_STATISTICS
     size_t cb;
     size_t pad; // pad so this size is a multiple of 16 on 64-bit machines
-#endif
 } region_allocation;
 
 typedef struct region {
     LIST_HEAD(region_allocation_list, region_allocation) entries;
     jmp_buf *penv;
+    pthread_mutex_t lock; // guards entries, used and stats
+    size_t quota;
+    size_t used; // live bytes, checked against quota
+    int in_handshake;
 #if REGION_STATISTICS
     region_statistics stats;
 #endif    
@@ -268,14 +360,14 @@ region g_global_region; // All allocations made at global scope go here
 // returns 0 for error, nonzero for success
 int HeapRegionInitialize()
 {
-    if (pthread_mutex_init(&g_global_region_lock, NULL) != 0) {
+    memset(&g_global_region, 0, sizeof(g_global_region));
+    if (pthread_mutex_init(&g_global_region.lock, NULL) != 0) {
         return 0;
     }
     if (pthread_key_create(&g_region_heap_slot, NULL) != 0) {
-        pthread_mutex_destroy(&g_global_region_lock);
+        pthread_mutex_destroy(&g_global_region.lock);
         return 0;
     }
-    memset(&g_global_region, 0, sizeof(g_global_region));
     LIST_INIT(&g_global_region.entries);
     return 1;
 }
@@ -285,7 +377,7 @@ void HeapRegionCleanup(void)
 {
     HeapRegionDestroy((HEAP_REGION)&g_global_region);
     pthread_key_delete(g_region_heap_slot);
-    pthread_mutex_destroy(&g_global_region_lock);
+    pthread_mutex_destroy(&g_global_region.lock);
 }
 
 // Create a new region and make it this thread's default
@@ -293,11 +385,21 @@ HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn, jmp_buf *penv)
 {
     HEAP_REGION oldrgn = (HEAP_REGION)pthread_getspecific(g_region_heap_slot);
     region *p = malloc(sizeof(region));
+    g_last_error = REGION_ERROR_NONE;
     if (p) {
         memset(p, 0, sizeof(region));
+        if (pthread_mutex_init(&p->lock, NULL) != 0) {
+            free(p);
+            p = NULL;
+        }
+    }
+    if (p) {
         LIST_INIT(&p->entries);
         p->penv = penv;
+        p->quota = g_limits.region_quota;
         pthread_setspecific(g_region_heap_slot, p);
+    } else {
+        g_last_error = REGION_ERROR_OUT_OF_MEMORY;
     }
     *prgn = (HEAP_REGION)p;
     return oldrgn;
@@ -310,7 +412,8 @@ void HeapRegionDestroy(HEAP_REGION rgn)
     
     // Free all of the entries in the linked-list
     region *p = (region *)rgn;   
-    PrintRegionStatistics(p, &p->stats);
+    TraceRegionStatistics(p, &p->stats);
+    EndHandshake(&p->in_handshake);
     while (p->entries.lh_first) {
         struct region_allocation *a = p->entries.lh_first;
         LIST_REMOVE(a, entry);
@@ -318,23 +421,38 @@ void HeapRegionDestroy(HEAP_REGION rgn)
     }
     if (p != &g_global_region) {
         // Then free the list head itself
+        pthread_mutex_destroy(&p->lock);
         free(p);
     }
 }
 
+// Statistics may be read from a thread other than the one allocating
 void PrintHeapRegionStatistics(HEAP_REGION rgn)
 {
+    region_statistics stats;
+    if (GetHeapRegionStatistics(rgn, &stats)) {
+        PrintRegionStatistics(rgn ? rgn : &g_global_region, &stats);
+    }
+}
+
+int GetHeapRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
+{
+    int ret;
     region *heap = (region*)rgn;
     if (heap == NULL) {
         heap = &g_global_region;
     }
-    PrintRegionStatistics(heap, &heap->stats);
+    pthread_mutex_lock(&heap->lock);
+    ret = CopyRegionStatistics(stats, &heap->stats);
+    pthread_mutex_unlock(&heap->lock);
+    return ret;
 }
 
 HEAP_REGION HeapRegionEnter(HEAP_REGION rgn, jmp_buf *penv)
 {
     HEAP_REGION oldrgn = (HEAP_REGION)pthread_getspecific(g_region_heap_slot);
     pthread_setspecific(g_region_heap_slot, rgn);
+    g_last_error = REGION_ERROR_NONE;
     region *heap = (region*)rgn;
     if (heap == NULL) {
         g_global_region.penv = penv;
@@ -356,26 +474,38 @@ void* HeapRegionMalloc(size_t cb)
     if (actual_cb < cb) {
         return NULL; // Integer overflow
     }
-    void *pv = malloc(actual_cb);
     region *heap = (region *)pthread_getspecific(g_region_heap_slot);
+    // The global region has no quota
+    int global = (heap == NULL);
+    if (global) {
+        heap = &g_global_region;
+    }
+    void *pv = NULL;
+    // Statistics may be read from another thread, so lock every region
+    pthread_mutex_lock(&heap->lock);
+    if (!global && OverQuota(heap->quota, heap->used, cb)) {
+        ATOMIC_ADD(&g_limits.quota_failures, 1);
+        g_last_error = REGION_ERROR_QUOTA;
+    } else {
+        pv = malloc(actual_cb);
+    }
     if (pv) {
         struct region_allocation *e = (struct region_allocation*)pv;
-#if REGION_STATISTICS
         e->cb = cb;
-#endif
-        if (heap == NULL) {
-            pthread_mutex_lock(&g_global_region_lock);
-            LIST_INSERT_HEAD(&g_global_region.entries, e, entry);
-            UpdateStatisticsAfterMalloc(&g_global_region.stats, pv, cb);
-            pthread_mutex_unlock(&g_global_region_lock);
-        } else {
-            UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
-            LIST_INSERT_HEAD(&heap->entries, e, entry);
+        LIST_INSERT_HEAD(&heap->entries, e, entry);
+        if (!global) {
+            heap->used += cb;
         }
+        UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
+        pthread_mutex_unlock(&heap->lock);
         return (void*)(e + 1); // Return the address of the byte following the LIST_ENTRY
     }
     else {
+        if (g_last_error != REGION_ERROR_QUOTA) {
+            g_last_error = REGION_ERROR_OUT_OF_MEMORY;
+        }
         UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
+        pthread_mutex_unlock(&heap->lock);
         longjmp(*heap->penv, 1);
         return NULL;
     }
@@ -403,19 +533,56 @@ void HeapRegionFree(void* pv)
     }
     region_allocation *e = ((region_allocation*)pv - 1);
     region *heap = (region*)pthread_getspecific(g_region_heap_slot);
-    if (heap == NULL) {
-        pthread_mutex_lock(&g_global_region_lock);
-        LIST_REMOVE(e, entry);
-        UpdateStatisticsAfterFree(&g_global_region.stats, e->cb);
-        pthread_mutex_unlock(&g_global_region_lock);
-    } else {
-        LIST_REMOVE(e, entry);
-        UpdateStatisticsAfterFree(&heap->stats, e->cb);
+    int global = (heap == NULL);
+    if (global) {
+        heap = &g_global_region;
+    }
+    pthread_mutex_lock(&heap->lock);
+    LIST_REMOVE(e, entry);
+    if (!global) {
+        heap->used -= e->cb;
     }
+    UpdateStatisticsAfterFree(&heap->stats, e->cb);
+    pthread_mutex_unlock(&heap->lock);
     free(e);
 }
 
 #endif // !defined(_MSC_VER)
+
+void HeapRegionSetLimits(size_t region_quota, size_t max_handshakes)
+{
+    g_limits.region_quota = region_quota;
+    g_limits.max_handshakes = max_handshakes;
+}
+
+void HeapRegionSetQuota(HEAP_REGION rgn, size_t quota)
+{
+    if (rgn != NULL) {
+        ((region*)rgn)->quota = quota;
+    }
+}
+
+int HeapRegionAdmitHandshake(HEAP_REGION rgn)
+{
+    return rgn == NULL || AdmitHandshake(&((region*)rgn)->in_handshake);
+}
+
+void HeapRegionEndHandshake(HEAP_REGION rgn)
+{
+    if (rgn != NULL) {
+        EndHandshake(&((region*)rgn)->in_handshake);
+    }
+}
+
+int HeapRegionLastError(void)
+{
+    return g_last_error;
+}
+
+void GetHeapRegionLimits(region_limits *limits)
+{
+    memcpy(limits, &g_limits, sizeof(region_limits));
+}
     
 
 // End of USE_PROCESS_HEAP
@@ -468,7 +635,7 @@ void HeapRegionCleanup(void)
 void HeapRegionDestroy(HEAP_REGION rgn)
 {
     region *heap = (region*)rgn;
-    PrintRegionStatistics(rgn, &g_global_region.stats);
+    TraceRegionStatistics(rgn, &g_global_region.stats);
     // Free all of the entries in the linked-list
     while (!IsListEmpty(&heap->entries)) {
         LIST_ENTRY *a = RemoveHeadList(&heap->entries);
@@ -536,6 +703,20 @@ void PrintHeapRegionStatistics(HEAP_REGION rgn)
     PrintRegionStatistics(heap, &heap->stats);
 }
 
+int GetHeapRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
+{
+    int ret;
+    region *heap = (region*)rgn;
+    if (heap == NULL) {
+        ExfAcquirePushLockExclusive(&global_region_lock);
+        ret = CopyRegionStatistics(stats, &g_global_region.stats);
+        ExfReleasePushLockExclusive(&global_region_lock);
+    } else {
+        ret = CopyRegionStatistics(stats, &heap->stats);
+    }
+    return ret;
+}
+
 // KRML_HOST_MALLOC
 void* HeapRegionMalloc(size_t cb)
 {
@@ -681,4 +862,44 @@ void HeapRegionFree(void* pv)
 {
     free(pv);
 }
+
+void PrintHeapRegionStatistics(HEAP_REGION rgn)
+{
+}
+
+int GetHeapRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
+{
+    memset(stats, 0, sizeof(region_statistics));
+    return 0;
+}
+#endif
+
+#if !USE_HEAP_REGIONS
+// Resource limits are not enforced by these allocators
+void HeapRegionSetLimits(size_t region_quota, size_t max_handshakes)
+{
+}
+
+void HeapRegionSetQuota(HEAP_REGION rgn, size_t quota)
+{
+}
+
+int HeapRegionAdmitHandshake(HEAP_REGION rgn)
+{
+    return 1;
+}
+
+void HeapRegionEndHandshake(HEAP_REGION rgn)
+{
+}
+
+int HeapRegionLastError(void)
+{
+    return REGION_ERROR_NONE;
+}
+
+void GetHeapRegionLimits(region_limits *limits)
+{
+    memset(limits, 0, sizeof(region_limits));
+}
 #endif
@@ -13,7 +13,14 @@ This file has multiple compilation options:
     
 2.  REGION_STATISTICS.  If set, for both USE_HEAP_REGIONS and USE_KERNEL_REGIONS,
     then the allocator maintains per-region statistics, for total bytes
-    allocated, peak bytes, count of allocations, etc.
+    allocated, peak bytes, count of allocations, etc.  They can be queried
+    at any time via GetHeapRegionStatistics().
+
+3.  REGION_STATISTICS_TRACE.  If set along with REGION_STATISTICS, the
+    statistics of each region are printed when the region is destroyed.
+
+Resource limits (per-region quotas and the handshake budget) are only
+enforced with USE_HEAP_REGIONS; the other allocators accept everything.
 
 ******/
 
@@ -21,6 +28,21 @@ This file has multiple compilation options:
 
 typedef void *HEAP_REGION;
 
+// Allocation sizes are binned by powers of two: bucket 0 counts allocations
+// of up to 16 bytes, bucket i counts sizes in (2^(i+3), 2^(i+4)], and the
+// last bucket counts everything larger.
+#define REGION_HISTOGRAM_BUCKETS 16
+
+typedef struct _region_statistics {
+    size_t current_bytes;   // bytes currently allocated
+    size_t total_bytes;     // total of all allocations
+    size_t peak_bytes;      // max value of current_bytes
+    size_t allocation_count;// count of allocations made
+    size_t free_count;      // count of frees made
+    size_t allocation_failures; // count of allocation fails due to OOM
+    size_t histogram[REGION_HISTOGRAM_BUCKETS]; // count of allocations by size
+} region_statistics;
+
 // Perform per-process initialization
 // returns 0 for error, nonzero for success
 int HeapRegionInitialize(void);
@@ -30,6 +52,39 @@ void HeapRegionCleanup(void);
 
 void PrintHeapRegionStatistics(HEAP_REGION rgn);
 
+// Copy the statistics of a region (NULL for the global region) into *stats.
+// Returns 0 if the allocator was built without REGION_STATISTICS.
+int GetHeapRegionStatistics(HEAP_REGION rgn, region_statistics *stats);
+
+// Why the last allocation or admission on this thread failed.  Reset when
+// the thread enters or creates a region.
+#define REGION_ERROR_NONE 0
+#define REGION_ERROR_OUT_OF_MEMORY 1
+#define REGION_ERROR_QUOTA 2 // the region would exceed its quota
+#define REGION_ERROR_BUSY 3  // the handshake budget is exhausted
+
+typedef struct _region_limits {
+    size_t region_quota;   // quota given to new regions, 0 for none
+    size_t max_handshakes; // handshakes allowed in flight, 0 for no limit
+    size_t handshakes;     // handshakes currently in flight
+    size_t quota_failures; // allocations refused by a quota
+    size_t busy_failures;  // handshakes refused by the budget
+} region_limits;
+
+// An allocation that would bring the live bytes of a region above its quota
+// fails like an out-of-memory error.  The global region has no quota.
+void HeapRegionSetLimits(size_t region_quota, size_t max_handshakes);
+void HeapRegionSetQuota(HEAP_REGION rgn, size_t quota);
+
+// Count the region's handshake against the process-wide budget, once.
+// Returns 0 if the budget is exhausted.  The handshake is released by
+// HeapRegionEndHandshake or when the region is destroyed.
+int HeapRegionAdmitHandshake(HEAP_REGION rgn);
+void HeapRegionEndHandshake(HEAP_REGION rgn);
+
+int HeapRegionLastError(void);
+void GetHeapRegionLimits(region_limits *limits);
+
 // KRML_HOST_MALLOC/CALLOC/FREE plug-ins
 void* HeapRegionMalloc(size_t cb);
 void* HeapRegionCalloc(size_t num, size_t size);
@@ -0,0 +1,349 @@
+#include <memory.h>
+#include <stdint.h>
+#include <stdlib.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+    #include <time.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <time.h>
+#endif
+
+#include "Mitls_Kremlib.h"
+#include "mitlsffi.h"
+
+// Strike register for 0-RTT ClientHellos, see AntiReplay.fsti.
+//
+// Time is cut into generations of 'window' seconds.  Each generation has
+// its own Bloom filter; a hello is checked against the current and the
+// previous generation and added to the current one, so it is remembered
+// for at least one full window.  A third filter is recycled when a new
+// generation starts, which bounds memory to three filters whatever the
+// load.  Inserts set bits with atomic OR and need no lock; two copies of
+// the same hello racing through the filter may both be reported fresh.
+// While a filter is being recycled, every hello is reported as seen, so
+// that no insert is lost.
+//
+// False positives only cause 0-RTT to be rejected, and the client then
+// retries its early data after the handshake.  The kernel-mode build has
+// no filter and never accepts 0-RTT.
+//
+// The current filter is reference-counted: g_filter holds one reference
+// and each check holds another while it runs, so a filter replaced by
+// FFI_mitls_configure_anti_replay is freed once its last check returns.
+// g_filter_lock only guards taking a reference, a few instructions.
+
+#define AR_GENERATIONS 3
+#define AR_HASHES 8
+#define AR_BITS_PER_HELLO 16 // with 8 hashes, about 0.06% false positives at capacity
+#define AR_DEFAULT_WINDOW 10 // seconds
+#define AR_DEFAULT_CAPACITY (1 << 18) // hellos per window
+
+#if defined(_MSC_VER)
+  #define ATOMIC_OR64(p, v) ((uint64_t)InterlockedOr64((volatile LONG64*)(p), (LONG64)(v)))
+  #define ATOMIC_ADD64(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+  #define ATOMIC_LOAD64(p) ((uint64_t)InterlockedOr64((volatile LONG64*)(p), 0))
+  #define ATOMIC_STORE64(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+  #define ATOMIC_TRY_LOCK(p) (InterlockedExchange((volatile LONG*)(p), 1) == 0)
+  #define ATOMIC_UNLOCK(p) InterlockedExchange((volatile LONG*)(p), 0)
+#else
+  #define ATOMIC_OR64(p, v) __atomic_fetch_or((p), (v), __ATOMIC_RELAXED)
+  #define ATOMIC_ADD64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+  #define ATOMIC_LOAD64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define ATOMIC_STORE64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+  #define ATOMIC_TRY_LOCK(p) (__sync_lock_test_and_set((p), 1) == 0)
+  #define ATOMIC_UNLOCK(p) __sync_lock_release(p)
+#endif
+
+typedef struct {
+  uint32_t window;
+  uint64_t nbits; // per generation, a power of two
+  uint64_t seed[2];
+  uint64_t *bits[AR_GENERATIONS];
+  uint64_t epoch[AR_GENERATIONS]; // time / window of the hellos in each filter
+  volatile long resetting;
+  uint64_t users;
+  uint64_t checks;
+  uint64_t replays;
+} replay_filter;
+
+static replay_filter *volatile g_filter;
+static volatile long g_filter_lock;
+static pfn_FFI_replay_cb g_replay_cb;
+static void *g_replay_cb_state;
+
+#ifndef _KERNEL_MODE
+static uint64_t now_seconds(void)
+{
+  return (uint64_t)time(NULL);
+}
+
+static uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Two independent 64-bit hashes, combined as h0 + i*h1 for the i-th probe.
+// The seeds only need to vary between processes: an attacker who can
+// saturate the filter merely disables 0-RTT.
+static void hash_hello(const replay_filter *f, const unsigned char *key, size_t len, uint64_t h[2])
+{
+  uint64_t h0 = f->seed[0] ^ len, h1 = f->seed[1];
+  while (len > 0) {
+    uint64_t w = 0;
+    size_t n = len < 8 ? len : 8;
+    memcpy(&w, key, n);
+    h0 = mix(h0 ^ w);
+    h1 = mix(h1 + w);
+    key += n;
+    len -= n;
+  }
+  h[0] = h0;
+  h[1] = h1 | 1;
+}
+
+static replay_filter *create_filter(uint32_t window, uint32_t capacity)
+{
+  uint64_t nbits = 64;
+  while (nbits < (uint64_t)capacity * AR_BITS_PER_HELLO) {
+    nbits <<= 1;
+  }
+  replay_filter *f = calloc(1, sizeof(replay_filter));
+  if (f == NULL) {
+    return NULL;
+  }
+  f->window = window ? window : AR_DEFAULT_WINDOW;
+  f->nbits = nbits;
+  f->users = 1;
+  f->seed[0] = mix((uint64_t)(size_t)f ^ now_seconds());
+  f->seed[1] = mix(f->seed[0] ^ (uint64_t)(size_t)&g_filter);
+  for (int g = 0; g < AR_GENERATIONS; g++) {
+    f->bits[g] = calloc(nbits / 64, sizeof(uint64_t));
+    if (f->bits[g] == NULL) {
+      while (g-- > 0) {
+        free(f->bits[g]);
+      }
+      free(f);
+      return NULL;
+    }
+  }
+  return f;
+}
+
+static void free_filter(replay_filter *f)
+{
+  for (int g = 0; g < AR_GENERATIONS; g++) {
+    free(f->bits[g]);
+  }
+  free(f);
+}
+
+static void release_filter(replay_filter *f)
+{
+  if (ATOMIC_ADD64(&f->users, (uint64_t)-1) == 1) {
+    free_filter(f);
+  }
+}
+
+// Takes a reference to the current filter, installing a default one if
+// none was configured; release it with release_filter.  With create == 0,
+// returns NULL rather than installing a filter.
+static replay_filter *acquire_filter(int create)
+{
+  replay_filter *f, *fresh = NULL;
+  for (;;) {
+    while (!ATOMIC_TRY_LOCK(&g_filter_lock)) {
+    }
+    f = g_filter;
+    if (f == NULL && fresh != NULL) {
+      g_filter = f = fresh;
+      fresh = NULL;
+    }
+    if (f != NULL) {
+      ATOMIC_ADD64(&f->users, 1);
+    }
+    ATOMIC_UNLOCK(&g_filter_lock);
+    if (f != NULL || !create) {
+      break;
+    }
+    fresh = create_filter(AR_DEFAULT_WINDOW, AR_DEFAULT_CAPACITY);
+    if (fresh == NULL) {
+      return NULL;
+    }
+  }
+  if (fresh != NULL) {
+    free_filter(fresh);
+  }
+  return f;
+}
+
+// Recycle the filter of generation 'epoch' if it still holds older hellos.
+// A single thread clears it.  Returns 0 to the others until it is done:
+// their inserts would be wiped, so they must not report a hello as fresh.
+static int start_generation(replay_filter *f, uint64_t epoch)
+{
+  int g = epoch % AR_GENERATIONS;
+  if (ATOMIC_LOAD64(&f->epoch[g]) == epoch) {
+    return 1;
+  }
+  if (!ATOMIC_TRY_LOCK(&f->resetting)) {
+    return 0;
+  }
+  if (ATOMIC_LOAD64(&f->epoch[g]) != epoch) {
+    memset(f->bits[g], 0, f->nbits / 8);
+    ATOMIC_STORE64(&f->epoch[g], epoch);
+  }
+  ATOMIC_UNLOCK(&f->resetting);
+  return 1;
+}
+
+static int probe(const replay_filter *f, int g, const uint64_t h[2])
+{
+  for (uint64_t i = 0; i < AR_HASHES; i++) {
+    uint64_t b = (h[0] + i * h[1]) & (f->nbits - 1);
+    if (!(f->bits[g][b >> 6] & (1ULL << (b & 63)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Returns 1 if all the bits were already set
+static int probe_and_set(replay_filter *f, int g, const uint64_t h[2])
+{
+  int seen = 1;
+  for (uint64_t i = 0; i < AR_HASHES; i++) {
+    uint64_t b = (h[0] + i * h[1]) & (f->nbits - 1);
+    uint64_t bit = 1ULL << (b & 63);
+    if (!(ATOMIC_OR64(&f->bits[g][b >> 6], bit) & bit)) {
+      seen = 0;
+    }
+  }
+  return seen;
+}
+
+static int check_local(replay_filter *f, const unsigned char *key, size_t len)
+{
+  uint64_t h[2], epoch = now_seconds() / f->window;
+  int cur = epoch % AR_GENERATIONS, prev = (epoch - 1) % AR_GENERATIONS;
+
+  hash_hello(f, key, len, h);
+  ATOMIC_ADD64(&f->checks, 1);
+
+  // Rejecting 0-RTT while the filter is recycled only costs a round trip
+  int seen = !start_generation(f, epoch)
+    || (ATOMIC_LOAD64(&f->epoch[prev]) == epoch - 1 && probe(f, prev, h))
+    || probe_and_set(f, cur, h);
+  if (seen) {
+    ATOMIC_ADD64(&f->replays, 1);
+  }
+  return !seen;
+}
+#endif
+
+bool AntiReplay_fresh(FStar_Bytes_bytes b)
+{
+#ifdef _KERNEL_MODE
+  return false;
+#else
+  replay_filter *f = acquire_filter(1);
+  if (f == NULL) {
+    return false;
+  }
+  bool fresh = check_local(f, (const unsigned char*)b.data, b.length);
+  // We are inside the handshake, under the global FFI lock: the callback
+  // must answer quickly (see FFI_mitls_set_replay_callback)
+  pfn_FFI_replay_cb cb = g_replay_cb;
+  if (fresh && cb != NULL) {
+    fresh = cb(g_replay_cb_state, (const unsigned char*)b.data, b.length, f->window) != 0;
+  }
+  release_filter(f);
+  return fresh;
+#endif
+}
+
+uint32_t AntiReplay_window(void)
+{
+#ifdef _KERNEL_MODE
+  return AR_DEFAULT_WINDOW;
+#else
+  replay_filter *f = acquire_filter(0);
+  if (f == NULL) {
+    return AR_DEFAULT_WINDOW;
+  }
+  uint32_t window = f->window;
+  release_filter(f);
+  return window;
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_anti_replay(uint32_t window, uint32_t capacity)
+{
+#ifdef _KERNEL_MODE
+  return 0;
+#else
+  replay_filter *f = create_filter(window, capacity);
+  if (f == NULL) {
+    return 0;
+  }
+  while (!ATOMIC_TRY_LOCK(&g_filter_lock)) {
+  }
+  replay_filter *old = g_filter;
+  g_filter = f;
+  ATOMIC_UNLOCK(&g_filter_lock);
+  // Freed here, or by the last check still using it
+  if (old != NULL) {
+    release_filter(old);
+  }
+  return 1;
+#endif
+}
+
+void MITLS_CALLCONV FFI_mitls_set_replay_callback(void *cb_state, pfn_FFI_replay_cb cb)
+{
+  g_replay_cb_state = cb_state;
+  g_replay_cb = cb;
+}
+
+int MITLS_CALLCONV FFI_mitls_anti_replay_check(const unsigned char *key, size_t key_len)
+{
+#ifdef _KERNEL_MODE
+  return 0;
+#else
+  replay_filter *f = acquire_filter(1);
+  if (f == NULL) {
+    return 0;
+  }
+  int fresh = check_local(f, key, key_len);
+  release_filter(f);
+  return fresh;
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_get_anti_replay_stats(/* out */ mitls_anti_replay_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+#ifndef _KERNEL_MODE
+  replay_filter *f = acquire_filter(0);
+  if (f == NULL) {
+    return 1;
+  }
+  stats->window = f->window;
+  stats->memory = (uint64_t)AR_GENERATIONS * (f->nbits / 8);
+  stats->checks = ATOMIC_LOAD64(&f->checks);
+  stats->replays = ATOMIC_LOAD64(&f->replays);
+  release_filter(f);
+#endif
+  return 1;
+}
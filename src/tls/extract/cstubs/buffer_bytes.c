@@ -1,4 +1,5 @@
 #include "Mitls_Kremlib.h"
+#include "BufferBytes.h"
 
 FStar_Bytes_bytes BufferBytes_to_bytes(Prims_nat l, uint8_t *buf) {
   if (buf == NULL || l == 0)
@@ -28,3 +29,24 @@ uint8_t *BufferBytes_from_bytes(FStar_Bytes_bytes b) {
   BufferBytes_store_bytes(b.length, buf, 0, b);
   return buf;
 }
+
+FStar_Bytes_bytes BufferBytes_concat(Prims_list__FStar_Bytes_bytes *l) {
+  Prims_list__FStar_Bytes_bytes *cur;
+  uint32_t len = 0;
+  for (cur = l; cur->tag == Prims_Cons; cur = cur->tl)
+    len += cur->hd.length;
+  if (len == 0)
+    return FStar_Bytes_empty_bytes;
+  char *data = KRML_HOST_MALLOC(len);
+  if (data == NULL)
+    KRML_HOST_EXIT(255);
+  char *p = data;
+  for (cur = l; cur->tag == Prims_Cons; cur = cur->tl) {
+    if (cur->hd.length > 0) {
+      memcpy(p, cur->hd.data, cur->hd.length);
+      p += cur->hd.length;
+    }
+  }
+  FStar_Bytes_bytes r = {.length = len, .data = data};
+  return r;
+}
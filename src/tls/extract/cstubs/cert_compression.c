@@ -0,0 +1,404 @@
+#include <memory.h>
+#include <stdint.h>
+#include <stdlib.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#endif
+
+#ifndef _KERNEL_MODE
+#ifdef MITLS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MITLS_BROTLI
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+#endif
+#ifdef MITLS_ZSTD
+#define ZSTD_STATIC_LINKING_ONLY // for ZSTD_createDCtx_advanced
+#include <zstd.h>
+#endif
+#endif
+
+#include "Mitls_Kremlib.h"
+#include "mitlsffi.h"
+
+// Certificate compression codecs (RFC 8879), see CertCompression.fsti.
+//
+// Each codec is built in when its library is: MITLS_ZLIB, MITLS_BROTLI and
+// MITLS_ZSTD are set by the makefiles.  Compression uses the highest level
+// of each codec, which is affordable because a server sends the same few
+// chains over and over: results are kept in a CC_WAYS-way set-associative
+// cache of CC_SETS sets, indexed by a hash of the algorithm and the
+// uncompressed message, which each slot keeps a copy of to rule out
+// collisions.  A miss replaces the least recently used slot of its set.
+// Chains that do not compress are cached too, as an empty result.
+//
+// A slot is only ever held with a try-lock, for the time of a lookup or a
+// replacement; a thread that finds it busy skips it.  Cache memory is
+// allocated outside the handshake region and is kept for the lifetime of
+// the process.
+//
+// Decompression runs for a peer, so its output is capped at CC_MAX_PEER_LEN
+// and all its memory, codec state included, is allocated in the handshake
+// region, where it counts against the region quota.  The kernel-mode build
+// has no codecs.
+
+#define CC_SETS 64
+#define CC_WAYS 4
+#define CC_MAX_LEN (1 << 24) // both lengths are 3-byte fields
+#define CC_MAX_PEER_LEN (1 << 17) // a certificate chain, with room to spare
+
+#if defined(_MSC_VER)
+  #define ATOMIC_ADD64(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+  #define ATOMIC_LOAD64(p) ((uint64_t)InterlockedOr64((volatile LONG64*)(p), 0))
+  #define ATOMIC_TRY_LOCK(p) (InterlockedExchange((volatile LONG*)(p), 1) == 0)
+  #define ATOMIC_UNLOCK(p) InterlockedExchange((volatile LONG*)(p), 0)
+#else
+  #define ATOMIC_ADD64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+  #define ATOMIC_LOAD64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define ATOMIC_TRY_LOCK(p) (__sync_lock_test_and_set((p), 1) == 0)
+  #define ATOMIC_UNLOCK(p) __sync_lock_release(p)
+#endif
+
+#define CCA_ZLIB 1
+#define CCA_BROTLI 2
+#define CCA_ZSTD 3
+
+static uint64_t g_compressed, g_cache_hits, g_uncompressed_bytes, g_compressed_bytes;
+static uint64_t g_decompressed, g_failures;
+
+static const FStar_Bytes_bytes empty = {.length = 0, .data = NULL};
+
+bool CertCompression_supported(uint16_t alg)
+{
+  switch (alg) {
+#if !defined(_KERNEL_MODE) && defined(MITLS_ZLIB)
+    case CCA_ZLIB: return true;
+#endif
+#if !defined(_KERNEL_MODE) && defined(MITLS_BROTLI)
+    case CCA_BROTLI: return true;
+#endif
+#if !defined(_KERNEL_MODE) && defined(MITLS_ZSTD)
+    case CCA_ZSTD: return true;
+#endif
+    default: return false;
+  }
+}
+
+#ifndef _KERNEL_MODE
+
+typedef struct {
+  volatile long busy;
+  uint64_t used; // g_clock at the last hit or fill, for replacement
+  uint16_t alg;
+  uint64_t hash;
+  unsigned char *in; // NULL for an empty slot
+  size_t in_len;
+  unsigned char *out; // NULL if compression saves nothing
+  size_t out_len;
+} cc_slot;
+
+static cc_slot g_slots[CC_SETS][CC_WAYS];
+static uint64_t g_clock;
+
+static uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t hash_input(uint16_t alg, const unsigned char *b, size_t len)
+{
+  uint64_t h = mix(((uint64_t)alg << 32) ^ len);
+  while (len > 0) {
+    uint64_t w = 0;
+    size_t n = len < 8 ? len : 8;
+    memcpy(&w, b, n);
+    h = mix(h ^ w);
+    b += n;
+    len -= n;
+  }
+  return h;
+}
+
+// Compresses into a malloc'd buffer; returns 0 if the algorithm is not
+// built in, or if the result is not smaller than the input
+static int encode(uint16_t alg, const unsigned char *in, size_t in_len,
+  unsigned char **out, size_t *out_len)
+{
+  unsigned char *buf = NULL;
+  size_t cap = 0, len = 0;
+
+  switch (alg) {
+#ifdef MITLS_ZLIB
+    case CCA_ZLIB: {
+      uLongf n = cap = compressBound((uLong)in_len);
+      if ((buf = malloc(cap)) == NULL
+          || compress2(buf, &n, in, (uLong)in_len, Z_BEST_COMPRESSION) != Z_OK) {
+        goto fail;
+      }
+      len = n;
+      break;
+    }
+#endif
+#ifdef MITLS_BROTLI
+    case CCA_BROTLI:
+      len = cap = BrotliEncoderMaxCompressedSize(in_len);
+      if (cap == 0 || (buf = malloc(cap)) == NULL
+          || !BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                BROTLI_MODE_GENERIC, in_len, in, &len, buf)) {
+        goto fail;
+      }
+      break;
+#endif
+#ifdef MITLS_ZSTD
+    case CCA_ZSTD:
+      cap = ZSTD_compressBound(in_len);
+      if ((buf = malloc(cap)) == NULL) {
+        goto fail;
+      }
+      len = ZSTD_compress(buf, cap, in, in_len, ZSTD_maxCLevel());
+      if (ZSTD_isError(len)) {
+        goto fail;
+      }
+      break;
+#endif
+    default:
+      return 0;
+  }
+  if (len == 0 || len >= in_len) {
+    goto fail;
+  }
+  *out = buf;
+  *out_len = len;
+  return 1;
+
+ fail:
+  free(buf);
+  return 0;
+}
+
+// Codec state for decompression, allocated in the handshake region
+static void *region_alloc(void *opaque, size_t len)
+{
+  (void)opaque;
+  return KRML_HOST_MALLOC(len);
+}
+
+static void region_free(void *opaque, void *p)
+{
+  (void)opaque;
+  if (p != NULL) {
+    KRML_HOST_FREE(p);
+  }
+}
+
+#ifdef MITLS_ZLIB
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+  return region_alloc(opaque, (size_t)items * size);
+}
+#endif
+
+static int decode(uint16_t alg, const unsigned char *in, size_t in_len,
+  unsigned char *out, size_t out_len)
+{
+  switch (alg) {
+#ifdef MITLS_ZLIB
+    case CCA_ZLIB: {
+      z_stream z;
+      int r;
+      memset(&z, 0, sizeof(z));
+      z.zalloc = zlib_alloc;
+      z.zfree = region_free;
+      if (inflateInit(&z) != Z_OK) {
+        return 0;
+      }
+      z.next_in = (Bytef *)in;
+      z.avail_in = (uInt)in_len;
+      z.next_out = out;
+      z.avail_out = (uInt)out_len;
+      r = inflate(&z, Z_FINISH);
+      inflateEnd(&z);
+      return r == Z_STREAM_END && z.avail_out == 0;
+    }
+#endif
+#ifdef MITLS_BROTLI
+    case CCA_BROTLI: {
+      BrotliDecoderState *d = BrotliDecoderCreateInstance(region_alloc, region_free, NULL);
+      size_t avail_in = in_len, avail_out = out_len;
+      const uint8_t *next_in = in;
+      uint8_t *next_out = out;
+      BrotliDecoderResult r;
+      if (d == NULL) {
+        return 0;
+      }
+      r = BrotliDecoderDecompressStream(d, &avail_in, &next_in, &avail_out, &next_out, NULL);
+      BrotliDecoderDestroyInstance(d);
+      return r == BROTLI_DECODER_RESULT_SUCCESS && avail_out == 0;
+    }
+#endif
+#ifdef MITLS_ZSTD
+    case CCA_ZSTD: {
+      ZSTD_customMem mem = {region_alloc, region_free, NULL};
+      ZSTD_DCtx *d = ZSTD_createDCtx_advanced(mem);
+      size_t n;
+      if (d == NULL) {
+        return 0;
+      }
+      n = ZSTD_decompressDCtx(d, out, out_len, in, in_len);
+      ZSTD_freeDCtx(d);
+      return !ZSTD_isError(n) && n == out_len;
+    }
+#endif
+    default:
+      return 0;
+  }
+}
+
+// Copies a result into the handshake region
+static FStar_Bytes_bytes result(const unsigned char *b, size_t len)
+{
+  unsigned char *data;
+  if (b == NULL || len == 0 || (data = KRML_HOST_MALLOC(len)) == NULL) {
+    return empty;
+  }
+  memcpy(data, b, len);
+  FStar_Bytes_bytes r = {.length = (uint32_t)len, .data = (const char *)data};
+  return r;
+}
+
+static void count(size_t in_len, size_t out_len)
+{
+  ATOMIC_ADD64(&g_compressed, 1);
+  ATOMIC_ADD64(&g_uncompressed_bytes, in_len);
+  ATOMIC_ADD64(&g_compressed_bytes, out_len);
+}
+
+FStar_Bytes_bytes CertCompression_compress(uint16_t alg, FStar_Bytes_bytes b)
+{
+  const unsigned char *in = (const unsigned char *)b.data;
+  size_t in_len = b.length, out_len = 0;
+  unsigned char *out = NULL, *copy = NULL;
+  uint64_t h;
+  cc_slot *set, *s = NULL;
+
+  if (!CertCompression_supported(alg) || in_len == 0 || in_len >= CC_MAX_LEN) {
+    return empty;
+  }
+  h = hash_input(alg, in, in_len);
+  set = g_slots[h % CC_SETS];
+
+  for (int w = 0; w < CC_WAYS; w++) {
+    if (!ATOMIC_TRY_LOCK(&set[w].busy)) {
+      continue;
+    }
+    if (set[w].in != NULL && set[w].hash == h && set[w].alg == alg
+        && set[w].in_len == in_len && memcmp(set[w].in, in, in_len) == 0) {
+      FStar_Bytes_bytes r = result(set[w].out, set[w].out_len);
+      set[w].used = ATOMIC_ADD64(&g_clock, 1);
+      ATOMIC_UNLOCK(&set[w].busy);
+      if (r.length > 0) {
+        ATOMIC_ADD64(&g_cache_hits, 1);
+        count(in_len, r.length);
+      }
+      return r;
+    }
+    // Empty slots first, then the least recently used
+    if (s == NULL || (s->in != NULL && (set[w].in == NULL || set[w].used < s->used))) {
+      s = &set[w];
+    }
+    ATOMIC_UNLOCK(&set[w].busy);
+  }
+
+  if (!encode(alg, in, in_len, &out, &out_len)) {
+    out = NULL;
+    out_len = 0;
+  }
+  FStar_Bytes_bytes r = result(out, out_len);
+  if (r.length > 0) {
+    count(in_len, r.length);
+  }
+
+  // Cache the result, replacing the slot chosen above
+  if (s != NULL && (copy = malloc(in_len)) != NULL && ATOMIC_TRY_LOCK(&s->busy)) {
+    memcpy(copy, in, in_len);
+    free(s->in);
+    free(s->out);
+    s->used = ATOMIC_ADD64(&g_clock, 1);
+    s->alg = alg;
+    s->hash = h;
+    s->in = copy;
+    s->in_len = in_len;
+    s->out = out;
+    s->out_len = out_len;
+    ATOMIC_UNLOCK(&s->busy);
+  } else {
+    free(copy);
+    free(out);
+  }
+  return r;
+}
+
+FStar_Bytes_bytes CertCompression_decompress(uint16_t alg, uint32_t len, FStar_Bytes_bytes b)
+{
+  unsigned char *out;
+
+  if (!CertCompression_supported(alg) || len == 0 || len > CC_MAX_PEER_LEN || b.length == 0) {
+    return empty;
+  }
+  ATOMIC_ADD64(&g_decompressed, 1);
+  if ((out = KRML_HOST_MALLOC(len)) == NULL) {
+    return empty;
+  }
+  if (!decode(alg, (const unsigned char *)b.data, b.length, out, len)) {
+    ATOMIC_ADD64(&g_failures, 1);
+    KRML_HOST_FREE(out);
+    return empty;
+  }
+  FStar_Bytes_bytes r = {.length = len, .data = (const char *)out};
+  return r;
+}
+
+#else // _KERNEL_MODE
+
+FStar_Bytes_bytes CertCompression_compress(uint16_t alg, FStar_Bytes_bytes b)
+{
+  return empty;
+}
+
+FStar_Bytes_bytes CertCompression_decompress(uint16_t alg, uint32_t len, FStar_Bytes_bytes b)
+{
+  return empty;
+}
+
+#endif
+
+int MITLS_CALLCONV FFI_mitls_get_cert_compression_stats(/* out */ mitls_cert_compression_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  for (uint16_t alg = CCA_ZLIB; alg <= CCA_ZSTD; alg++) {
+    if (CertCompression_supported(alg)) {
+      stats->algorithms |= 1u << alg;
+    }
+  }
+  stats->compressed = ATOMIC_LOAD64(&g_compressed);
+  stats->cache_hits = ATOMIC_LOAD64(&g_cache_hits);
+  stats->uncompressed_bytes = ATOMIC_LOAD64(&g_uncompressed_bytes);
+  stats->compressed_bytes = ATOMIC_LOAD64(&g_compressed_bytes);
+  stats->decompressed = ATOMIC_LOAD64(&g_decompressed);
+  stats->failures = ATOMIC_LOAD64(&g_failures);
+  return 1;
+}
@@ -0,0 +1,161 @@
+#include <memory.h>
+#include <stdint.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+    #include <time.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "Mitls_Kremlib.h"
+#include "EverCrypt.h"
+
+// Per-thread buffered generator behind Random.sample, see DRBG.fsti.
+//
+// Each thread holds a ChaCha20 key seeded from EverCrypt_random_sample and
+// serves requests of up to DRBG_MAX_BUFFERED bytes from a buffer of its
+// keystream: a sample is a memcpy, with no lock and no system call.  Every
+// refill takes the next key from the head of the new keystream (fast key
+// erasure), and served bytes are wiped, so the state of a thread never
+// reveals samples it already returned.
+//
+// A thread reseeds after DRBG_RESEED_BYTES of output, after
+// DRBG_RESEED_SECONDS, and when the global generation has moved on since
+// it last seeded: the generation is bumped in the child after a fork, so
+// parent and child never share a keystream, and by DRBG_cleanup.  The
+// kernel-mode build has no thread-local storage and always calls EverCrypt.
+
+#define DRBG_BUFFER 512 // keystream bytes per refill, a multiple of 64
+#define DRBG_MAX_BUFFERED 64 // larger requests go to EverCrypt directly
+#define DRBG_RESEED_BYTES (1 << 20)
+#define DRBG_RESEED_SECONDS 300
+
+#if defined(_MSC_VER)
+  #define THREAD_LOCAL __declspec(thread)
+#else
+  #define THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+  uint8_t key[32];
+  uint8_t buf[DRBG_BUFFER];
+  uint32_t pos; // first unused byte of buf
+  uint32_t generation; // g_generation when last seeded, 0 if never
+  uint64_t output; // bytes served since the last reseed
+  uint64_t seeded_at; // seconds
+} drbg_state;
+
+static volatile uint32_t g_generation = 1;
+
+#ifndef _KERNEL_MODE
+static THREAD_LOCAL drbg_state g_drbg;
+
+// Each key encrypts a single buffer, so the nonce can stay zero
+static const uint8_t zero_iv[12];
+static const uint8_t zero_buf[DRBG_BUFFER];
+
+static uint64_t now_seconds(void)
+{
+  return (uint64_t)time(NULL);
+}
+
+static void next_generation(void)
+{
+  uint32_t g = g_generation + 1;
+  g_generation = g ? g : 1;
+}
+
+static void refill(drbg_state *s)
+{
+  EverCrypt_Cipher_chacha20(DRBG_BUFFER, s->buf, (uint8_t*)zero_buf, s->key, (uint8_t*)zero_iv, 0);
+  memcpy(s->key, s->buf, sizeof(s->key));
+  memset(s->buf, 0, sizeof(s->key));
+  s->pos = sizeof(s->key);
+}
+
+static void reseed(drbg_state *s)
+{
+  uint8_t seed[sizeof(s->key)];
+  EverCrypt_random_sample(sizeof(seed), seed);
+  // Mixed into the old key: a forked child starts from its parent's key
+  for (size_t i = 0; i < sizeof(seed); i++) {
+    s->key[i] ^= seed[i];
+  }
+  memset(seed, 0, sizeof(seed));
+  refill(s);
+  s->generation = g_generation;
+  s->output = 0;
+  s->seeded_at = now_seconds();
+}
+
+#if !IS_WINDOWS
+static void on_fork_child(void)
+{
+  next_generation();
+}
+#endif
+#endif
+
+void DRBG_fill(uint8_t *out, uint32_t len)
+{
+#ifndef _KERNEL_MODE
+  if (len <= DRBG_MAX_BUFFERED) {
+    drbg_state *s = &g_drbg;
+    if (s->generation != g_generation || s->output >= DRBG_RESEED_BYTES) {
+      reseed(s);
+    } else if (DRBG_BUFFER - s->pos < len) {
+      if (now_seconds() - s->seeded_at >= DRBG_RESEED_SECONDS) {
+        reseed(s);
+      } else {
+        refill(s);
+      }
+    }
+    memcpy(out, s->buf + s->pos, len);
+    memset(s->buf + s->pos, 0, len);
+    s->pos += len;
+    s->output += len;
+    return;
+  }
+#endif
+  EverCrypt_random_sample(len, out);
+}
+
+void DRBG_init(void)
+{
+#if !IS_WINDOWS
+  static int registered;
+  if (!registered) {
+    pthread_atfork(NULL, NULL, on_fork_child);
+    registered = 1;
+  }
+#endif
+}
+
+void DRBG_cleanup(void)
+{
+#ifndef _KERNEL_MODE
+  // Other threads wipe their buffers when they reseed
+  next_generation();
+  memset(&g_drbg, 0, sizeof(g_drbg));
+#endif
+}
+
+FStar_Bytes_bytes DRBG_sample(uint32_t len)
+{
+  if (len == 0)
+    return FStar_Bytes_empty_bytes;
+  uint8_t *data = KRML_HOST_MALLOC(len);
+  if (data == NULL)
+    KRML_HOST_EXIT(255);
+  DRBG_fill(data, len);
+  FStar_Bytes_bytes r = {.length = len, .data = (const char *)data};
+  return r;
+}
@@ -0,0 +1,122 @@
+#include <memory.h>
+#include <stdint.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <time.h>
+#endif
+
+#include "mitlsffi.h"
+#include "handshake_events.h"
+
+// Per-thread ring buffer of handshake milestones, see HandshakeEvents.fsti.
+//
+// Recording is a flag test, a clock read and a store into thread-local
+// memory: no locks, no allocation.  When the ring is full, the oldest
+// events are overwritten.  The kernel-mode build has no thread-local
+// storage and does not record events.
+
+#define EVENT_RING_SIZE 256 // must be a power of two
+
+#if defined(_MSC_VER)
+  #define THREAD_LOCAL __declspec(thread)
+#else
+  #define THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+  uint32_t head; // index of the oldest event
+  uint32_t count; // number of valid events
+  mitls_event events[EVENT_RING_SIZE];
+} event_ring;
+
+static volatile int g_events_enabled;
+static volatile long g_last_connection;
+
+#ifndef _KERNEL_MODE
+static THREAD_LOCAL event_ring g_event_ring;
+static THREAD_LOCAL uint32_t g_current_connection;
+
+static uint64_t monotonic_ns(void)
+{
+#if IS_WINDOWS
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER now;
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000000ull
+    + (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000000ull / (uint64_t)frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+#endif
+
+void HandshakeEvents_record(uint8_t ev)
+{
+#ifndef _KERNEL_MODE
+  if (!g_events_enabled) {
+    return;
+  }
+  event_ring *r = &g_event_ring;
+  uint32_t tail = (r->head + r->count) & (EVENT_RING_SIZE - 1);
+  r->events[tail].timestamp = monotonic_ns();
+  r->events[tail].event = ev;
+  r->events[tail].connection = g_current_connection;
+  if (r->count < EVENT_RING_SIZE) {
+    r->count++;
+  } else {
+    r->head = (r->head + 1) & (EVENT_RING_SIZE - 1);
+  }
+#endif
+}
+
+uint32_t HandshakeEvents_new_connection(void)
+{
+  uint32_t id;
+  do {
+#if IS_WINDOWS
+    id = (uint32_t)InterlockedIncrement(&g_last_connection);
+#else
+    id = (uint32_t)__sync_add_and_fetch(&g_last_connection, 1);
+#endif
+  } while (id == 0); // on wrap-around
+  return id;
+}
+
+void HandshakeEvents_set_connection(uint32_t id)
+{
+#ifndef _KERNEL_MODE
+  g_current_connection = id;
+#endif
+}
+
+void MITLS_CALLCONV FFI_mitls_enable_events(int enable)
+{
+  g_events_enabled = enable;
+}
+
+size_t MITLS_CALLCONV FFI_mitls_drain_events(mitls_event *events, size_t max_events)
+{
+  size_t n = 0;
+#ifndef _KERNEL_MODE
+  event_ring *r = &g_event_ring;
+  while (n < max_events && r->count > 0) {
+    events[n++] = r->events[r->head];
+    r->head = (r->head + 1) & (EVENT_RING_SIZE - 1);
+    r->count--;
+  }
+#endif
+  return n;
+}
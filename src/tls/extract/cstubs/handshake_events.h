@@ -0,0 +1,16 @@
+#ifndef HEADER_HANDSHAKE_EVENTS_H
+#define HEADER_HANDSHAKE_EVENTS_H
+#include <stdint.h>
+
+// Native implementation of HandshakeEvents.fsti.  Event codes are the
+// mitls_event_type values from mitlsffi.h.
+void HandshakeEvents_record(uint8_t ev);
+
+// A fresh connection identifier, never 0
+uint32_t HandshakeEvents_new_connection(void);
+
+// Events recorded by the calling thread are attributed to this connection,
+// until the next call; the FFI sets it on entry to each handshake call
+void HandshakeEvents_set_connection(uint32_t id);
+
+#endif // HEADER_HANDSHAKE_EVENTS_H
@@ -53,10 +53,13 @@ static Parsers_SignatureScheme_signatureScheme_tags tls_of_pki(mitls_signature_s
     //  ecdsa_secp521r1_sha512(0x0603),
     case 0x0603: return Parsers_SignatureScheme_Ecdsa_secp521r1_sha512;
     //  ed25519(0x0807),
+    case 0x0807: return Parsers_SignatureScheme_Ed25519;
     //  ed448(0x0808),
+    case 0x0808: return Parsers_SignatureScheme_Ed448;
+    // The caller treats this as no selection
     default:
       KRML_HOST_PRINTF("tls_of_pki: unsupported (%04x)\n", sa);
-      KRML_HOST_EXIT(1);
+      return Parsers_SignatureScheme_Unknown_signatureScheme;
   }
 }
 
@@ -86,10 +89,14 @@ static mitls_signature_scheme pki_of_tls(Parsers_SignatureScheme_signatureScheme
     case Parsers_SignatureScheme_Ecdsa_secp384r1_sha384: return 0x0503;
     //  ecdsa_secp521r1_sha512(0x0603),
     case Parsers_SignatureScheme_Ecdsa_secp521r1_sha512: return 0x0603;
-    //  ed25519(0x0807), ed448(0x0808),
+    //  ed25519(0x0807),
+    case Parsers_SignatureScheme_Ed25519: return 0x0807;
+    //  ed448(0x0808),
+    case Parsers_SignatureScheme_Ed448: return 0x0808;
+    // 0 is never selected, and fails to sign or verify
     default:
       KRML_HOST_PRINTF("pki_of_tls: unsupported (%d)\n", sa);
-      KRML_HOST_EXIT(1);
+      return 0;
   }
 }
 
@@ -117,11 +124,18 @@ PKI_select_(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, Parsers_ProtocolVersion_protoco
 
   mipki_chain chain = mipki_select_certificate(pki, sni.data, sni.length, sigalgs, sigalgs_len, &sel);
 
+  // TLSConstants.cert_cb has no release hook, so we unpin at once: PKI.fsti
+  // never calls mipki_reload, and the chain stays valid until PKI_free
+  if(chain != NULL) mipki_free_chain(pki, chain);
+
   #if DEBUG
     KRML_HOST_PRINTF("PKI| Selected chain <%08x>, sigalg = %04x\n", chain, sel);
   #endif
 
-  if(chain == NULL)
+  Parsers_SignatureScheme_signatureScheme_tags tag =
+    chain != NULL ? tls_of_pki(sel) : Parsers_SignatureScheme_Unknown_signatureScheme;
+
+  if(tag == Parsers_SignatureScheme_Unknown_signatureScheme)
   {
     res->tag = FStar_Pervasives_Native_None;
   }
@@ -134,7 +148,7 @@ PKI_select_(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, Parsers_ProtocolVersion_protoco
 
     res->tag = FStar_Pervasives_Native_Some;
     sig.fst = (uint64_t)chain;
-    sig.snd.tag = tls_of_pki(sel);
+    sig.snd.tag = tag;
     res->v = sig;
   }
 }
@@ -18,6 +18,7 @@
 #else
 #define IS_WINDOWS 0
 #include <pthread.h>
+#include <time.h>
 #endif
 
 #include "EverCrypt.h"
@@ -26,6 +27,8 @@
 #include "QUIC.h"
 #include "mitlsffi.h"
 #include "RegionAllocator.h"
+#include "handshake_events.h"
+#include "session_cache.h"
 
 // Code was written against old auto-generated names
 #define FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_signatureScheme Negotiation_certNego
@@ -50,8 +53,38 @@ struct mitls_state {
   HEAP_REGION rgn;
   TLSConstants_config cfg;
   Connection_connection cxn;
+  region_statistics mem_snapshot[TLS_memory_current]; // per-phase snapshots of rgn
+  uint8_t mem_snapshot_taken; // bitmask of valid mem_snapshot entries
+  // record sizing, see FFI_mitls_configure_record_size()
+  uint32_t small_record; // 0 for full-size records only
+  uint32_t ramp_bytes;
+  uint32_t idle_ms;
+  uint64_t ramp_sent; // bytes sent in small records since the last reset
+  uint64_t last_send_ms;
+  // data buffered while corked, allocated in rgn
+  int corked;
+  unsigned char *cork_buf;
+  size_t cork_len;
+  size_t cork_size;
+  int offloaded; // bit 0: reader, bit 1: writer, see FFI_mitls_export_traffic_key()
+  int recv_ended; // set once FFI_mitls_receive_into() saw the stream end or fail
+  int recv_end; // what it then returns, TLS_receive_closed or TLS_receive_error
+  // client session cache, see session_cache.c
+  const char *host_name; // allocated in rgn
+  unsigned char *cache_key; // allocated in rgn
+  size_t cache_key_len;
+  int has_ticket; // set by FFI_mitls_configure_ticket(), which bypasses the cache
+  struct wrapped_ticket_cb *ticket_cb;
+  struct wrapped_cert_cb *cert_cb; // chains to release in FFI_mitls_close()
+  pfn_FFI_cert_release_cb cert_release; // see FFI_mitls_configure_cert_release()
+  uint32_t id; // connection identifier in handshake events
 };
 
+#define DEFAULT_SMALL_RECORD 1400 // leaves room for the record overhead in a 1460-byte segment
+#define DEFAULT_RAMP_BYTES (1024 * 1024)
+#define DEFAULT_IDLE_MS 1000
+#define MAX_RECORD 16384
+
 // BUGBUG: temporary global lock to protect global
 //         mutable variables in mitls.  Remove when
 //         the variables have their own protection.
@@ -86,6 +119,67 @@ static void MakeFStar_Bytes_bytes(FStar_Bytes_bytes *b, const unsigned char *dat
     b->length = length;
 }
 
+// Key of the client session cache: the server name, a zero byte, then each
+// offered ALPN protocol preceded by its length.  *key is NULL, and tickets
+// are not cached, if there is no server name.
+static size_t make_cache_key(const char *host_name, const mitls_alpn *alpn, size_t alpn_count, unsigned char **key)
+{
+    size_t host_len = strlen(host_name), len = host_len + 1;
+    *key = NULL;
+    if (host_len == 0) {
+        return 0;
+    }
+    alpn_count &= 255;
+    for (size_t i = 0; i < alpn_count; i++) {
+        len += 1 + (alpn[i].alpn_len & 255);
+    }
+    unsigned char *k = KRML_HOST_MALLOC(len);
+    memcpy(k, host_name, host_len + 1);
+    unsigned char *p = k + host_len + 1;
+    for (size_t i = 0; i < alpn_count; i++) {
+        *p = (unsigned char)(alpn[i].alpn_len & 255);
+        memcpy(p + 1, alpn[i].alpn, *p);
+        p += 1 + *p;
+    }
+    *key = k;
+    return len;
+}
+
+// Record the statistics of a region for the given phase, once
+static void take_memory_snapshot(HEAP_REGION rgn, region_statistics *snapshot, uint8_t *taken, mitls_memory_phase phase)
+{
+    if ((*taken & (1 << phase)) == 0 && GetHeapRegionStatistics(rgn, &snapshot[phase])) {
+        *taken |= (uint8_t)(1 << phase);
+    }
+}
+
+static int get_memory_stats(HEAP_REGION rgn, const region_statistics *snapshot, uint8_t taken, mitls_memory_phase phase, mitls_memory_stats *stats)
+{
+    region_statistics rs;
+
+    memset(stats, 0, sizeof(*stats));
+    if (phase == TLS_memory_current) {
+        if (!GetHeapRegionStatistics(rgn, &rs)) {
+            return 0;
+        }
+    } else if (phase < TLS_memory_current && (taken & (1 << phase))) {
+        rs = snapshot[phase];
+    } else {
+        return 0;
+    }
+
+    stats->current_bytes = rs.current_bytes;
+    stats->peak_bytes = rs.peak_bytes;
+    stats->total_bytes = rs.total_bytes;
+    stats->allocation_count = rs.allocation_count;
+    stats->free_count = rs.free_count;
+    stats->allocation_failures = rs.allocation_failures;
+    for (size_t i = 0; i < MITLS_MEMORY_HISTOGRAM_BUCKETS && i < REGION_HISTOGRAM_BUCKETS; i++) {
+        stats->size_histogram[i] = rs.histogram[i];
+    }
+    return 1;
+}
+
 void NoPrintf(const char *fmt, ...)
 {
 }
@@ -191,6 +285,7 @@ int MITLS_CALLCONV FFI_mitls_init(void)
 
 void MITLS_CALLCONV FFI_mitls_cleanup(void)
 {
+  SessionCache_cleanup();
   Random_cleanup();
     
 #if IS_WINDOWS
@@ -224,8 +319,15 @@ int MITLS_CALLCONV FFI_mitls_configure(mitls_state **state, const char *tls_vers
 
     // Allocate space on the heap, to store an OCaml value
     mitls_state *s = (mitls_state*)KRML_HOST_MALLOC(sizeof(mitls_state));
+    memset(s, 0, sizeof(*s));
     s->cfg = config;
     s->rgn = rgn;
+    s->small_record = DEFAULT_SMALL_RECORD;
+    s->ramp_bytes = DEFAULT_RAMP_BYTES;
+    s->idle_ms = DEFAULT_IDLE_MS;
+    s->host_name = host;
+    s->cache_key_len = make_cache_key(host_name, NULL, 0, &s->cache_key);
+    s->id = HandshakeEvents_new_connection();
     *state = s;
     ret = 1;
 
@@ -269,6 +371,45 @@ int MITLS_CALLCONV FFI_mitls_set_sealing_key(const char *alg, const unsigned cha
     return (b) ? 1 : 0;
 }
 
+void MITLS_CALLCONV FFI_mitls_rotate_ticket_key(void)
+{
+    LOCK_MUTEX(&lock);
+    ENTER_GLOBAL_HEAP_REGION();
+    FFI_ffiRotateTicketKey();
+    LEAVE_GLOBAL_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+}
+
+void MITLS_CALLCONV FFI_mitls_set_ticket_key_rotation(uint32_t seconds)
+{
+    LOCK_MUTEX(&lock);
+    FFI_ffiSetTicketKeyRotation(seconds);
+    UNLOCK_MUTEX(&lock);
+}
+
+// Install a fresh ticket key if the rotation period has elapsed. This also
+// takes care of creating the initial key in the global region.
+static void rotate_ticket_key_if_due(void)
+{
+    LOCK_MUTEX(&lock);
+    ENTER_GLOBAL_HEAP_REGION();
+    FFI_ffiRotateTicketKeyIfDue();
+    LEAVE_GLOBAL_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+}
+
+int MITLS_CALLCONV FFI_mitls_get_ticket_key_stats(/* out */ mitls_ticket_key_stats *stats)
+{
+    // Read without the lock: the counters are only indicative
+    Ticket_ticket_key_stats s = FFI_ffiTicketKeyStats();
+    stats->rotations = s.rotations;
+    stats->decrypt_current = s.decrypt_current;
+    stats->decrypt_previous = s.decrypt_previous;
+    stats->decrypt_unknown = s.decrypt_unknown;
+    stats->decrypt_failed = s.decrypt_failed;
+    return 1;
+}
+
 int MITLS_CALLCONV FFI_mitls_configure_ticket(mitls_state *state, const mitls_ticket *ticket)
 {
     int b = 0;
@@ -277,6 +418,7 @@ int MITLS_CALLCONV FFI_mitls_configure_ticket(mitls_state *state, const mitls_ti
     MakeFStar_Bytes_bytes(&tid, ticket->ticket, ticket->ticket_len);
     MakeFStar_Bytes_bytes(&si, ticket->session, ticket->session_len);
     state->cfg = FFI_ffiSetTicket(state->cfg, tid, si);
+    state->has_ticket = 1;
     LEAVE_HEAP_REGION();
     if (HAD_OUT_OF_MEMORY) {
         return 0;
@@ -317,6 +459,17 @@ int MITLS_CALLCONV FFI_mitls_configure_named_groups(/* in */ mitls_state *state,
     return 1;
 }
 
+int MITLS_CALLCONV FFI_mitls_configure_cert_compression(/* in */ mitls_state *state, const char *algs)
+{
+    ENTER_HEAP_REGION(state->rgn);
+    state->cfg = FFI_ffiSetCertCompression(state->cfg, algs);
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return 1;
+}
+
 static TLSConstants_alpn alpn_list_of_array(const mitls_alpn *alpn, size_t alpn_count)
 {
   TLSConstants_alpn apl = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
@@ -341,6 +494,7 @@ int MITLS_CALLCONV FFI_mitls_configure_alpn(/* in */ mitls_state *state, const m
     ENTER_HEAP_REGION(state->rgn);
     TLSConstants_alpn apl = alpn_list_of_array(alpn, alpn_count);
     state->cfg = FFI_ffiSetALPN(state->cfg, apl);
+    state->cache_key_len = make_cache_key(state->host_name, alpn, alpn_count, &state->cache_key);
     LEAVE_HEAP_REGION();
     if (HAD_OUT_OF_MEMORY) {
         return 0;
@@ -366,9 +520,11 @@ int MITLS_CALLCONV FFI_mitls_configure_custom_extensions(/* in */ mitls_state *s
 }
 
 
-typedef struct {
+typedef struct wrapped_ticket_cb {
   void* cb_state;
-  pfn_FFI_ticket_cb cb;
+  pfn_FFI_ticket_cb cb; // may be NULL
+  const unsigned char *cache_key; // NULL unless tickets go to the session cache
+  size_t cache_key_len;
 } wrapped_ticket_cb;
 
 static void ticket_cb_proxy(FStar_Dyn_dyn cbs, Prims_string sni, FStar_Bytes_bytes ticket, TLSConstants_ticketInfo info, FStar_Bytes_bytes rawkey)
@@ -382,15 +538,63 @@ static void ticket_cb_proxy(FStar_Dyn_dyn cbs, Prims_string sni, FStar_Bytes_byt
     .session = (unsigned char*)session.data
   };
 
-  cb->cb(cb->cb_state, sni, &t);
+  if (cb->cache_key != NULL) {
+    SessionCache_store(cb->cache_key, cb->cache_key_len, &t,
+      FFI_ffiTicketInfoLifetime(info), FFI_ffiTicketInfoEarlyData(info));
+  }
+  if (cb->cb != NULL) {
+    cb->cb(cb->cb_state, sni, &t);
+  }
+}
+
+// Offer the newest cached ticket for key, if any
+static TLSConstants_config offer_cached_ticket(TLSConstants_config c, const unsigned char *key, size_t key_len, int *offered)
+{
+  mitls_ticket t;
+  *offered = 0;
+  if (SessionCache_lookup(key, key_len, &t)) {
+    FStar_Bytes_bytes tid, si;
+    MakeFStar_Bytes_bytes(&tid, t.ticket, t.ticket_len);
+    MakeFStar_Bytes_bytes(&si, t.session, t.session_len);
+    SessionCache_release(&t);
+    c = FFI_ffiSetTicket(c, tid, si);
+    *offered = 1;
+  }
+  return c;
+}
+
+// Called from FFI_mitls_connect(): cache the tickets of this connection and
+// offer a cached one unless the host configured its own.  Returns 1 if a
+// cached ticket was offered.
+static int use_session_cache(mitls_state *state)
+{
+  int offered = 0;
+  if (!SessionCache_enabled() || state->cache_key == NULL) {
+    return 0;
+  }
+  wrapped_ticket_cb *cbs = state->ticket_cb;
+  if (cbs == NULL) {
+    cbs = KRML_HOST_MALLOC(sizeof(wrapped_ticket_cb));
+    memset(cbs, 0, sizeof(*cbs));
+    state->ticket_cb = cbs;
+    state->cfg = FFI_ffiSetTicketCallback(state->cfg, (void*)cbs, ticket_cb_proxy);
+  }
+  cbs->cache_key = state->cache_key;
+  cbs->cache_key_len = state->cache_key_len;
+  if (!state->has_ticket) {
+    state->cfg = offer_cached_ticket(state->cfg, state->cache_key, state->cache_key_len, &offered);
+  }
+  return offered;
 }
 
 int MITLS_CALLCONV FFI_mitls_configure_ticket_callback(/* in */ mitls_state *state, void *cb_state, pfn_FFI_ticket_cb ticket_cb)
 {
     ENTER_HEAP_REGION(state->rgn);
     wrapped_ticket_cb *cbs = KRML_HOST_MALLOC(sizeof(wrapped_ticket_cb));
+    memset(cbs, 0, sizeof(*cbs));
     cbs->cb_state = cb_state;
     cbs->cb = ticket_cb;
+    state->ticket_cb = cbs;
     state->cfg = FFI_ffiSetTicketCallback(state->cfg, (void*)cbs, ticket_cb_proxy);
     LEAVE_HEAP_REGION();
     if (HAD_OUT_OF_MEMORY) {
@@ -491,12 +695,19 @@ int MITLS_CALLCONV FFI_mitls_configure_nego_callback(mitls_state *state, void *c
   return 1;
 }
 
-typedef struct {
+// A handshake selects at most twice (after a HelloRetryRequest)
+#define MAX_SELECTED_CHAINS 4
+
+typedef struct wrapped_cert_cb {
   void* cb_state;
   pfn_FFI_cert_select_cb select;
   pfn_FFI_cert_format_cb format;
   pfn_FFI_cert_sign_cb sign;
   pfn_FFI_cert_verify_cb verify;
+  pfn_FFI_cert_release_cb release;
+  // chains returned by select, released when the connection is freed
+  void *selected[MAX_SELECTED_CHAINS];
+  size_t selected_count;
 } wrapped_cert_cb;
 
 static Parsers_SignatureScheme_signatureScheme_tags tls_of_pki(mitls_signature_scheme sa)
@@ -526,10 +737,13 @@ static Parsers_SignatureScheme_signatureScheme_tags tls_of_pki(mitls_signature_s
     //  ecdsa_secp521r1_sha512(0x0603),
     case 0x0603: return Parsers_SignatureScheme_Ecdsa_secp521r1_sha512;
     //  ed25519(0x0807),
+    case 0x0807: return Parsers_SignatureScheme_Ed25519;
     //  ed448(0x0808),
+    case 0x0808: return Parsers_SignatureScheme_Ed448;
+    // The caller treats this as no selection
     default:
       KRML_HOST_PRINTF("tls_of_pki: unsupported (%04x)\n", sa);
-      KRML_HOST_EXIT(1);
+      return Parsers_SignatureScheme_Unknown_signatureScheme;
   }
 }
 
@@ -559,10 +773,14 @@ static mitls_signature_scheme pki_of_tls(Parsers_SignatureScheme_signatureScheme
     case Parsers_SignatureScheme_Ecdsa_secp384r1_sha384: return 0x0503;
     //  ecdsa_secp521r1_sha512(0x0603),
     case Parsers_SignatureScheme_Ecdsa_secp521r1_sha512: return 0x0603;
-    //  ed25519(0x0807), ed448(0x0808),
+    //  ed25519(0x0807),
+    case Parsers_SignatureScheme_Ed25519: return 0x0807;
+    //  ed448(0x0808),
+    case Parsers_SignatureScheme_Ed448: return 0x0808;
+    // 0 is never selected, and fails to sign or verify
     default:
       KRML_HOST_PRINTF("pki_of_tls: unsupported (%d)\n", sa);
-      KRML_HOST_EXIT(1);
+      return 0;
   }
 }
 
@@ -598,15 +816,31 @@ static FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_sign
     (const unsigned char*)alpn.data, alpn.length,
     sigalgs, sigalgs_len, &selected);
 
-  if(chain == NULL) {
+  Parsers_SignatureScheme_signatureScheme_tags tag =
+    chain != NULL ? tls_of_pki(selected) : Parsers_SignatureScheme_Unknown_signatureScheme;
+
+  if(tag == Parsers_SignatureScheme_Unknown_signatureScheme) {
+    if (chain != NULL && s->release != NULL) {
+      s->release(s->cb_state, chain);
+    }
     res.tag = FStar_Pervasives_Native_None;
   } else {
+    if (s->release != NULL) {
+      if (s->selected_count == MAX_SELECTED_CHAINS) {
+        // Not reached by the handshake; keep the most recent selections
+        s->release(s->cb_state, s->selected[0]);
+        memmove(s->selected, s->selected + 1, (MAX_SELECTED_CHAINS - 1) * sizeof(void*));
+        s->selected_count--;
+      }
+      s->selected[s->selected_count++] = chain;
+    }
+    HandshakeEvents_record(TLS_event_cert_selected);
     K___uint64_t_Parsers_SignatureScheme_signatureScheme sig;
     // silence a GCC warning about sig.snd._0.length possibly uninitialized
     memset(&sig, 0, sizeof(sig));
     res.tag = FStar_Pervasives_Native_Some;
     sig.fst = (uint64_t)chain;
-    sig.snd.tag = tls_of_pki(selected);
+    sig.snd.tag = tag;
     res.v = sig;
   }
   return res;
@@ -635,6 +869,7 @@ static FStar_Pervasives_Native_option__FStar_Bytes_bytes wrapped_sign(
     (const unsigned char*)tbs.data, tbs.length, sig);
 
   if(slen > 0) {
+    HandshakeEvents_record(TLS_event_signature_done);
     res.tag = FStar_Pervasives_Native_Some;
     res.v = (FStar_Bytes_bytes){.length = slen, .data = (const char*)sig};
   }
@@ -655,9 +890,22 @@ static bool wrapped_verify(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st,
     (const unsigned char*)tbs.data, tbs.length,
     (const unsigned char*)sig.data, sig.length) != 0);
 
+  if(r) {
+    HandshakeEvents_record(TLS_event_signature_verified);
+  }
   return r;
 }
 
+static void release_selected_chains(wrapped_cert_cb *cbs)
+{
+  if (cbs != NULL) {
+    for (size_t i = 0; i < cbs->selected_count; i++) {
+      cbs->release(cbs->cb_state, cbs->selected[i]);
+    }
+    cbs->selected_count = 0;
+  }
+}
+
 int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *state, void *cb_state, mitls_cert_cb *cert_cb)
 {
   ENTER_HEAP_REGION(state->rgn);
@@ -668,6 +916,10 @@ int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *stat
   cbs->format = cert_cb->format;
   cbs->sign = cert_cb->sign;
   cbs->verify = cert_cb->verify;
+  cbs->release = state->cert_release;
+  cbs->selected_count = 0;
+  release_selected_chains(state->cert_cb);
+  state->cert_cb = cbs;
 
   TLSConstants_cert_cb cb = {
     .app_context = (void*)cbs,
@@ -689,6 +941,91 @@ int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *stat
   return 1;
 }
 
+// Separate from mitls_cert_cb, whose layout existing hosts depend on
+int MITLS_CALLCONV FFI_mitls_configure_cert_release(/* in */ mitls_state *state, pfn_FFI_cert_release_cb release)
+{
+  state->cert_release = release;
+  if (state->cert_cb != NULL) {
+    state->cert_cb->release = release;
+  }
+  return 1;
+}
+
+typedef struct {
+  void* cb_state;
+  pfn_FFI_cert_staple_cb staple;
+  pfn_FFI_cert_check_status_cb check;
+} wrapped_status_cb;
+
+static FStar_Pervasives_Native_option__FStar_Bytes_bytes wrapped_staple(FStar_Dyn_dyn cbs, uint64_t cert)
+{
+  wrapped_status_cb* s = (wrapped_status_cb*)cbs;
+  FStar_Pervasives_Native_option__FStar_Bytes_bytes res = {.tag = FStar_Pervasives_Native_None};
+
+  if(s->staple == NULL) {
+    return res;
+  }
+
+  unsigned char *ocsp = KRML_HOST_MALLOC(MAX_OCSP_RESPONSE_LEN);
+  size_t len = s->staple(s->cb_state, (const void *)(size_t)cert, ocsp);
+
+  if(len > 0 && len <= MAX_OCSP_RESPONSE_LEN) {
+    res.tag = FStar_Pervasives_Native_Some;
+    res.v = (FStar_Bytes_bytes){.length = len, .data = (const char*)ocsp};
+  }
+  return res;
+}
+
+static bool wrapped_check_status(FStar_Dyn_dyn cbs, Prims_list__FStar_Bytes_bytes *certs, FStar_Bytes_bytes ocsp)
+{
+  wrapped_status_cb* s = (wrapped_status_cb*)cbs;
+  FStar_Bytes_bytes chain = Cert_certificateListBytes(certs);
+
+  return s->check != NULL && s->check(s->cb_state,
+    (const unsigned char*)chain.data, chain.length,
+    (const unsigned char*)ocsp.data, ocsp.length) != 0;
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_cert_status_callbacks(/* in */ mitls_state *state, void *cb_state, mitls_cert_status_cb *status_cb)
+{
+  ENTER_HEAP_REGION(state->rgn);
+  wrapped_status_cb* cbs = KRML_HOST_MALLOC(sizeof(wrapped_status_cb));
+
+  cbs->cb_state = cb_state;
+  cbs->staple = status_cb->staple;
+  cbs->check = status_cb->check;
+
+  state->cfg = FFI_ffiSetStatusCallbacks(state->cfg, (void*)cbs,
+    wrapped_staple, wrapped_check_status, status_cb->check != NULL);
+  LEAVE_HEAP_REGION();
+  if (HAD_OUT_OF_MEMORY) {
+    return 0;
+  }
+  return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_read_ahead(/* in */ mitls_state *state, uint32_t size)
+{
+    ENTER_HEAP_REGION(state->rgn);
+    state->cfg = FFI_ffiSetReadAhead(state->cfg, size);
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_key_update(/* in */ mitls_state *state, uint64_t records, uint64_t bytes)
+{
+    ENTER_HEAP_REGION(state->rgn);
+    state->cfg = FFI_ffiSetKeyUpdateLimits(state->cfg, records, bytes);
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return 1;
+}
+
 int MITLS_CALLCONV FFI_mitls_configure_early_data(/* in */ mitls_state *state, uint32_t max_early_data)
 {
     ENTER_HEAP_REGION(state->rgn);
@@ -705,6 +1042,12 @@ void MITLS_CALLCONV FFI_mitls_close(mitls_state *state)
 {
     if (state) {
         HEAP_REGION rgn = state->rgn;
+        release_selected_chains(state->cert_cb);
+        if (state->cork_buf) {
+            ENTER_HEAP_REGION(rgn);
+            KRML_HOST_FREE(state->cork_buf);
+            LEAVE_HEAP_REGION();
+        }
         KRML_HOST_FREE(state);
         DESTROY_HEAP_REGION(rgn);
     }
@@ -721,11 +1064,14 @@ typedef struct {
   void* send_recv_ctx;
   pfn_FFI_send send;
   pfn_FFI_recv recv;
+  mitls_state *state;
 } wrapped_transport_cb;
 
 static int32_t wrapped_send(void* ctx, uint8_t* buffer, uint32_t buffer_size)
 {
   wrapped_transport_cb* tcb = (wrapped_transport_cb*) ctx;
+  // The first flight is either our ClientHello or our reply to the peer's
+  take_memory_snapshot(tcb->state->rgn, tcb->state->mem_snapshot, &tcb->state->mem_snapshot_taken, TLS_memory_hello);
   return (int32_t)tcb->send(tcb->send_recv_ctx, (const void*)buffer, (size_t)buffer_size);
 }
 
@@ -739,20 +1085,34 @@ static int32_t wrapped_recv(void* ctx, uint8_t* buffer, uint32_t len)
 int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
 {
     int ret = 0;
+    if (!HeapRegionAdmitHandshake(state->rgn)) {
+        return 0; // too many handshakes in flight
+    }
     LOCK_MUTEX(&lock);
     ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
 
     wrapped_transport_cb* tcb = KRML_HOST_MALLOC(sizeof(wrapped_transport_cb));
     tcb->send_recv_ctx = send_recv_ctx;
     tcb->send = psend;
     tcb->recv = precv;
+    tcb->state = state;
+
+    int cached = use_session_cache(state);
 
     K___Connection_connection_Prims_int result = FFI_connect((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
     state->cxn = result.fst;
     ret = (result.snd == 0);
+    if (ret) {
+        take_memory_snapshot(state->rgn, state->mem_snapshot, &state->mem_snapshot_taken, TLS_memory_handshake);
+        if (cached) {
+            SessionCache_record(FFI_ffiResumed(state->cxn));
+        }
+    }
 
     LEAVE_HEAP_REGION();
     UNLOCK_MUTEX(&lock);
+    HeapRegionEndHandshake(state->rgn);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
@@ -763,52 +1123,184 @@ int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send psend, pf
 int MITLS_CALLCONV FFI_mitls_accept_connected(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
 {
     int ret = 0;
+    if (!HeapRegionAdmitHandshake(state->rgn)) {
+        return 0; // too many handshakes in flight
+    }
+    rotate_ticket_key_if_due();
     LOCK_MUTEX(&lock);
     ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
 
     wrapped_transport_cb* tcb = KRML_HOST_MALLOC(sizeof(wrapped_transport_cb));
     tcb->send_recv_ctx = send_recv_ctx;
     tcb->send = psend;
     tcb->recv = precv;
+    tcb->state = state;
 
     K___Connection_connection_Prims_int result = FFI_ffiAcceptConnected((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
     state->cxn = result.fst;
     ret = (result.snd == 0) ? 1 : 0; // return success (1) if result.snd is 0.
+    if (ret) {
+        take_memory_snapshot(state->rgn, state->mem_snapshot, &state->mem_snapshot_taken, TLS_memory_handshake);
+    }
 
     LEAVE_HEAP_REGION();
     UNLOCK_MUTEX(&lock);
+    HeapRegionEndHandshake(state->rgn);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
     return ret;
 }
 
+static uint64_t now_ms(void)
+{
+#if IS_WINDOWS
+  #ifdef _KERNEL_MODE
+    return KeQueryInterruptTime() / 10000;
+  #else
+    return GetTickCount64();
+  #endif
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+// Sends buffer as records sized by the policy of state.  Called with the
+// lock held, inside the heap region of state.  Returns 1 on success.
+static int send_records(mitls_state *state, const unsigned char *buffer, size_t buffer_size)
+{
+    uint64_t now = now_ms();
+    if (state->idle_ms != 0 && now - state->last_send_ms > state->idle_ms) {
+        state->ramp_sent = 0;
+    }
+    state->last_send_ms = now;
+
+    if (state->small_record != 0 && state->ramp_sent < state->ramp_bytes) {
+        size_t small = state->ramp_bytes - state->ramp_sent;
+        if (small > buffer_size) {
+            small = buffer_size;
+        }
+        if (FFI_ffiSendRecords(state->cxn, (FStar_Bytes_bytes){.data = (const char*)buffer, .length = small}, state->small_record) != 0) {
+            return 0;
+        }
+        state->ramp_sent += small;
+        buffer += small;
+        buffer_size -= small;
+    }
+    if (buffer_size > 0 &&
+        FFI_ffiSendRecords(state->cxn, (FStar_Bytes_bytes){.data = (const char*)buffer, .length = buffer_size}, MAX_RECORD) != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+// Appends to the cork buffer of state.  Called with the lock held, inside
+// its heap region: a failed allocation does not return, it leaves the region
+// as out of memory.
+static int cork_append(mitls_state *state, const unsigned char *buffer, size_t buffer_size)
+{
+    if (buffer_size > (size_t)-1 - state->cork_len) {
+        return 0;
+    }
+    if (state->cork_len + buffer_size > state->cork_size) {
+        size_t size = state->cork_size ? state->cork_size : MAX_RECORD;
+        while (size < state->cork_len + buffer_size) {
+            if (size > (size_t)-1 / 2) {
+                return 0;
+            }
+            size *= 2;
+        }
+        unsigned char *p = KRML_HOST_MALLOC(size);
+        if (state->cork_len) {
+            memcpy(p, state->cork_buf, state->cork_len);
+        }
+        KRML_HOST_FREE(state->cork_buf);
+        state->cork_buf = p;
+        state->cork_size = size;
+    }
+    memcpy(state->cork_buf + state->cork_len, buffer, buffer_size);
+    state->cork_len += buffer_size;
+    return 1;
+}
+
 // Called by the host app transmit a packet
 int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned char *buffer, size_t buffer_size)
 {
     int ret;
 
-    ENTER_HEAP_REGION(state->rgn);
+    if (state->offloaded & 2) {
+        return 0;
+    }
+
     LOCK_MUTEX(&lock);
-    ret = FFI_ffiSend(state->cxn, (FStar_Bytes_bytes){.data = (const char*)buffer, .length = buffer_size});
-    UNLOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
+    if (state->corked) {
+        ret = cork_append(state, buffer, buffer_size);
+    } else {
+        ret = send_records(state, buffer, buffer_size);
+    }
     LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
 
+    return ret;
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_record_size(/* in */ mitls_state *state, uint32_t small_record, uint32_t ramp_bytes, uint32_t idle_ms)
+{
+    if (small_record > MAX_RECORD) {
+        return 0;
+    }
+    state->small_record = small_record;
+    state->ramp_bytes = ramp_bytes;
+    state->idle_ms = idle_ms;
     return 1;
 }
 
+int MITLS_CALLCONV FFI_mitls_flush(/* in */ mitls_state *state)
+{
+    int ret = 1;
+
+    LOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
+    if (state->cork_len > 0) {
+        ret = send_records(state, state->cork_buf, state->cork_len);
+        state->cork_len = 0;
+    }
+    LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return ret;
+}
+
+int MITLS_CALLCONV FFI_mitls_set_cork(/* in */ mitls_state *state, int cork)
+{
+    state->corked = cork;
+    return cork ? 1 : FFI_mitls_flush(state);
+}
+
 // Called by the host app to receive a packet
 unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /* out */ size_t *packet_size)
 {
     unsigned char *p = NULL;
     FStar_Bytes_bytes ret = {.data=NULL,.length=0};
     *packet_size = 0;
+    if (state->offloaded & 1) {
+        return NULL;
+    }
 
     LOCK_MUTEX(&lock);
     ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
 
     ret = FFI_ffiRecv(state->cxn);
     if (ret.length) {
@@ -824,6 +1316,121 @@ unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /*
     return p;
 }
 
+int MITLS_CALLCONV FFI_mitls_receive_into(/* in */ mitls_state *state, /* out */ unsigned char *buffer, size_t capacity, /* out */ size_t *received, /* out */ int *more)
+{
+    FFI_read_result ret;
+    FStar_Pervasives_Native_option__uint32_t next;
+    size_t len = 0;
+    bool pending = false;
+    int end = TLS_receive_data;
+    *received = 0;
+    *more = 0;
+    if (capacity < MAX_RECORD || (state->offloaded & 1)) {
+        return TLS_receive_error;
+    }
+    if (state->recv_ended) {
+        return state->recv_end;
+    }
+
+    LOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
+    do {
+        ret = FFI_ffiReceive(state->cxn);
+        if (ret.tag == FFI_WouldBlock) {
+            end = TLS_receive_would_block;
+            break;
+        }
+        if (ret.tag == FFI_Errno) {
+            end = ret.val.case_Errno == 0 ? TLS_receive_closed : TLS_receive_error;
+            break;
+        }
+        memcpy(buffer + len, ret.val.case_Received.data, ret.val.case_Received.length);
+        len += ret.val.case_Received.length;
+        // Read on only while a full record still fits: after a post-handshake
+        // message (a ticket or KeyUpdate), FFI_ffiReceive goes on to the
+        // record that follows it, whatever its size.
+        next = FFI_ffiNextRecordLength(state->cxn);
+    } while (next.tag == FStar_Pervasives_Native_Some && capacity - len >= MAX_RECORD);
+    pending = FFI_ffiHasRecord(state->cxn);
+    LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+    if (HAD_OUT_OF_MEMORY) {
+        end = TLS_receive_error;
+    }
+    if (end != TLS_receive_data && end != TLS_receive_would_block) {
+        state->recv_ended = 1;
+        state->recv_end = end;
+    }
+    if (len == 0) {
+        return end;
+    }
+    // data first; a failure or the end of the stream is reported next time
+    *received = len;
+    *more = pending ? 1 : 0;
+    return TLS_receive_data;
+}
+
+int MITLS_CALLCONV FFI_mitls_pending(/* in */ mitls_state *state)
+{
+    bool ret = false;
+    if (state->offloaded & 1) {
+        return 0;
+    }
+
+    LOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    ret = FFI_ffiHasRecord(state->cxn);
+    LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return ret ? 1 : 0;
+}
+
+uint32_t MITLS_CALLCONV FFI_mitls_connection_id(/* in */ mitls_state *state)
+{
+    return state->id;
+}
+
+int MITLS_CALLCONV FFI_mitls_get_read_stats(/* in */ mitls_state *state, /* out */ mitls_read_stats *stats)
+{
+    Record_read_stats rs;
+
+    LOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    rs = FFI_ffiReadStats(state->cxn);
+    LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    stats->recv_calls = rs.rs_recv_calls;
+    stats->records = rs.rs_records;
+    stats->buffered = rs.rs_buffered;
+    return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_key_update(/* in */ mitls_state *state, int request)
+{
+    bool ret = false;
+    if (state->offloaded & 2) {
+        return 0;
+    }
+
+    LOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
+    ret = FFI_ffiKeyUpdate(state->cxn, request ? true : false);
+    LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return ret ? 1 : 0;
+}
+
 static int get_exporter(Connection_connection cxn, int early, /* out */ mitls_secret *secret)
 {
   FStar_Pervasives_Native_option__K___Spec_Hash_Definitions_hash_alg_EverCrypt_aead_alg_FStar_Bytes_bytes ret;
@@ -857,6 +1464,99 @@ int MITLS_CALLCONV FFI_mitls_get_exporter(/* in */ mitls_state *state, int early
   return ret;
 }
 
+int MITLS_CALLCONV FFI_mitls_export_traffic_key(/* in */ mitls_state *state, int reader, /* out */ mitls_traffic_key *key)
+{
+    int ret = 0;
+    memset(key, 0, sizeof(*key));
+
+    LOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    FStar_Pervasives_Native_option__FFI_traffic_key r = {.tag = FStar_Pervasives_Native_None};
+    // Bytes received ahead would be lost once the host owns the reader
+    if (reader && FFI_ffiReadStats(state->cxn).rs_buffered != 0) {
+        KRML_HOST_PRINTF("FFI_mitls_export_traffic_key: input is buffered, receive it first\n");
+    } else {
+        r = FFI_ffiGetTrafficKey(state->cxn, reader ? true : false);
+    }
+    if (r.tag == FStar_Pervasives_Native_Some &&
+        r.v.tk_key.length <= sizeof(key->key) && r.v.tk_iv.length <= sizeof(key->iv)) {
+        key->version = convert_pv(r.v.tk_pv);
+        key->alg = CONVERT_AEAD(r.v.tk_alg);
+        memcpy(key->key, r.v.tk_key.data, r.v.tk_key.length);
+        key->key_len = r.v.tk_key.length;
+        memcpy(key->iv, r.v.tk_iv.data, r.v.tk_iv.length);
+        key->iv_len = r.v.tk_iv.length;
+        key->seqn = r.v.tk_seqn;
+        // From now on, records in this direction are protected by the host
+        state->offloaded |= reader ? 1 : 2;
+        ret = 1;
+    }
+    LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return ret;
+}
+
+int MITLS_CALLCONV FFI_mitls_handback_handshake(/* in */ mitls_state *state, const unsigned char *input, size_t input_len, /* out */ size_t *consumed, /* out */ unsigned char *output, /* inout */ size_t *output_len, /* out */ int *flags)
+{
+    int ret = 0;
+    char z = 0;
+    size_t max_output = *output_len;
+    *consumed = 0;
+    *output_len = 0;
+    *flags = 0;
+
+    if (!(state->offloaded & 1)) {
+        KRML_HOST_PRINTF("FFI_mitls_handback_handshake: the reader is not exported\n");
+        return 0;
+    }
+    if (input_len > UINT32_MAX) {
+        return 0;
+    }
+    if (max_output > UINT32_MAX) {
+        max_output = UINT32_MAX;
+    }
+
+    LOCK_MUTEX(&lock);
+    ENTER_HEAP_REGION(state->rgn);
+    HandshakeEvents_set_connection(state->id);
+    FStar_Bytes_bytes in = {
+      .data = (char*)(input == NULL ? &z : (const char*)input),
+      .length = (uint32_t)input_len
+    };
+    FStar_Pervasives_Native_option__FFI_handback r = FFI_ffiHandback(state->cxn, in, (uint32_t)max_output);
+    if (r.tag == FStar_Pervasives_Native_Some && r.v.hb_output.length <= max_output) {
+        *consumed = r.v.hb_consumed;
+        *output_len = r.v.hb_output.length;
+        if (r.v.hb_output.length) {
+            memcpy(output, r.v.hb_output.data, r.v.hb_output.length);
+        }
+        if (r.v.hb_reader_rekeyed) {
+            *flags |= MITLS_HANDBACK_READER_REKEYED;
+        }
+        if (r.v.hb_writer_rekeyed) {
+            *flags |= MITLS_HANDBACK_WRITER_REKEYED;
+        }
+        if (r.v.hb_pending) {
+            *flags |= MITLS_HANDBACK_OUTPUT_PENDING;
+        }
+        ret = 1;
+    }
+    LEAVE_HEAP_REGION();
+    UNLOCK_MUTEX(&lock);
+    if (HAD_OUT_OF_MEMORY) {
+        return 0;
+    }
+    return ret;
+}
+
+int MITLS_CALLCONV FFI_mitls_get_memory_stats(/* in */ mitls_state *state, mitls_memory_phase phase, /* out */ mitls_memory_stats *stats)
+{
+    return get_memory_stats(state->rgn, state->mem_snapshot, state->mem_snapshot_taken, phase, stats);
+}
+
 void *MITLS_CALLCONV FFI_mitls_get_cert(/* in */ mitls_state *state, /* out */ size_t *cert_size)
 {
     FStar_Bytes_bytes ret = {.length = 0, .data = NULL};
@@ -879,10 +1579,14 @@ typedef struct quic_state {
    uint8_t is_server;
    uint8_t is_complete;
    uint8_t is_post_hs;
+   uint8_t mem_snapshot_taken; // bitmask of valid mem_snapshot entries
+   region_statistics mem_snapshot[TLS_memory_current]; // per-phase snapshots of rgn
+   wrapped_cert_cb *cert_cb; // chains to release in FFI_mitls_quic_free()
+   uint32_t id; // connection identifier in handshake events
    Old_Handshake_hs hs;
 } quic_state;
 
-static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_config *cfg)
+static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_config *cfg, wrapped_cert_cb **cert_cb)
 {
     TLSConstants_config c = c0;
 
@@ -931,17 +1635,28 @@ static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_co
         UNLOCK_MUTEX(&lock);
     }
 
+    unsigned char *cache_key = NULL;
+    size_t cache_key_len = 0;
+    if (!cfg->is_server && cfg->host_name != NULL && SessionCache_enabled()) {
+      cache_key_len = make_cache_key(cfg->host_name, cfg->alpn, cfg->alpn_count, &cache_key);
+    }
+
     if(cfg->server_ticket && cfg->server_ticket->ticket_len > 0) {
       FStar_Bytes_bytes tid, si;
       MakeFStar_Bytes_bytes(&tid, cfg->server_ticket->ticket, cfg->server_ticket->ticket_len);
       MakeFStar_Bytes_bytes(&si, cfg->server_ticket->session, cfg->server_ticket->session_len);
       c = FFI_ffiSetTicket(c, tid, si);
+    } else if (cache_key != NULL) {
+      int offered;
+      c = offer_cached_ticket(c, cache_key, cache_key_len, &offered);
     }
 
-    if (cfg->ticket_callback) {
+    if (cfg->ticket_callback || cache_key != NULL) {
       wrapped_ticket_cb *cbs = KRML_HOST_MALLOC(sizeof(wrapped_ticket_cb));
       cbs->cb_state = cfg->callback_state;
       cbs->cb = cfg->ticket_callback;
+      cbs->cache_key = cache_key;
+      cbs->cache_key_len = cache_key_len;
       c = FFI_ffiSetTicketCallback(c, (void*)cbs, ticket_cb_proxy);
     }
 
@@ -960,6 +1675,9 @@ static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_co
       cbs->format = cfg->cert_callbacks->format;
       cbs->sign = cfg->cert_callbacks->sign;
       cbs->verify = cfg->cert_callbacks->verify;
+      cbs->release = NULL; // see FFI_mitls_quic_configure_cert_release()
+      cbs->selected_count = 0;
+      *cert_cb = cbs;
 
       TLSConstants_cert_cb cb = {
         .app_context = (void*)cbs,
@@ -985,20 +1703,28 @@ int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *
     *state = NULL;
     HEAP_REGION rgn;
 
+    if (cfg->is_server) {
+        rotate_ticket_key_if_due();
+    }
+
     CREATE_HEAP_REGION(&rgn);
     if (!VALID_HEAP_REGION(rgn)) {
         return 0; // out of memory
     }
-    
-    st = KRML_HOST_MALLOC(sizeof(quic_state));
-    memset(st, 0, sizeof(*st));
-    st->is_server = cfg->is_server;
 
-    Prims_string host_name = CopyPrimsString(cfg->host_name != NULL ? cfg->host_name : "");
-    TLSConstants_config config = QUIC_ffiConfig((FStar_Bytes_bytes){.data=host_name,.length=strlen(host_name)});
-    
-    config = quic_set_config(config, cfg);
-    st->hs = QUIC_create_hs(st->is_server, config);
+    // Over the handshake budget, fail before copying the configuration
+    if (HeapRegionAdmitHandshake(rgn)) {
+      st = KRML_HOST_MALLOC(sizeof(quic_state));
+      memset(st, 0, sizeof(*st));
+      st->is_server = cfg->is_server;
+      st->id = HandshakeEvents_new_connection();
+
+      Prims_string host_name = CopyPrimsString(cfg->host_name != NULL ? cfg->host_name : "");
+      TLSConstants_config config = QUIC_ffiConfig((FStar_Bytes_bytes){.data=host_name,.length=strlen(host_name)});
+
+      config = quic_set_config(config, cfg, &st->cert_cb);
+      st->hs = QUIC_create_hs(st->is_server, config);
+    }
 
     LEAVE_HEAP_REGION();
     if (HAD_OUT_OF_MEMORY || st == NULL) {
@@ -1025,9 +1751,24 @@ static VOID quic_process_callout(PVOID Parameter)
 }
 #endif
 
+int MITLS_CALLCONV FFI_mitls_quic_configure_cert_release(/* in */ quic_state *state, pfn_FFI_cert_release_cb release)
+{
+  if (state->cert_cb == NULL) {
+    return 0;
+  }
+  state->cert_cb->release = release;
+  return 1;
+}
+
+uint32_t MITLS_CALLCONV FFI_mitls_quic_connection_id(/* in */ quic_state *state)
+{
+  return state->id;
+}
+
 int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
 {
   int r = 0;
+  HandshakeEvents_set_connection(st->id);
   ENTER_HEAP_REGION(st->rgn);
   unsigned char z = 0;
   
@@ -1062,7 +1803,12 @@ int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
     if(ctx->output != NULL && ctx->output_len)
       memcpy(ctx->output, out.output.data, ctx->output_len);
     
-    if(out.is_complete) st->is_complete = 1;
+    take_memory_snapshot(st->rgn, st->mem_snapshot, &st->mem_snapshot_taken, TLS_memory_hello);
+    if(out.is_complete) {
+      st->is_complete = 1;
+      take_memory_snapshot(st->rgn, st->mem_snapshot, &st->mem_snapshot_taken, TLS_memory_handshake);
+      HeapRegionEndHandshake(st->rgn);
+    }
     if(out.is_writable) ctx->flags |= QFLAG_APPLICATION_KEY;
     if(out.is_early_rejected) ctx->flags |= QFLAG_REJECTED_0RTT;
     if(out.is_post_handshake) st->is_post_hs = 1;
@@ -1143,9 +1889,15 @@ int MITLS_CALLCONV FFI_mitls_quic_send_ticket(quic_state *st, const unsigned cha
   return r;
 }
 
+int MITLS_CALLCONV FFI_mitls_quic_get_memory_stats(/* in */ quic_state *state, mitls_memory_phase phase, /* out */ mitls_memory_stats *stats)
+{
+  return get_memory_stats(state->rgn, state->mem_snapshot, state->mem_snapshot_taken, phase, stats);
+}
+
 void MITLS_CALLCONV FFI_mitls_quic_free(quic_state *state)
 {
     HEAP_REGION rgn = state->rgn;
+    release_selected_chains(state->cert_cb);
     ENTER_HEAP_REGION(state->rgn);
     KRML_HOST_FREE(state);
     LEAVE_HEAP_REGION();
@@ -1268,3 +2020,37 @@ extern void MITLS_CALLCONV FFI_mitls_global_free(void* pv)
   KRML_HOST_FREE(pv);
   LEAVE_GLOBAL_HEAP_REGION();
 }
+
+int MITLS_CALLCONV FFI_mitls_get_global_memory_stats(/* out */ mitls_memory_stats *stats)
+{
+  return get_memory_stats(NULL, NULL, 0, TLS_memory_current, stats);
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_memory_limits(size_t region_quota, uint32_t max_handshakes)
+{
+  HeapRegionSetLimits(region_quota, max_handshakes);
+  return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_memory_quota(/* in */ mitls_state *state, size_t quota)
+{
+  HeapRegionSetQuota(state->rgn, quota);
+  return 1;
+}
+
+mitls_resource_error MITLS_CALLCONV FFI_mitls_get_resource_error(void)
+{
+  return (mitls_resource_error)HeapRegionLastError();
+}
+
+int MITLS_CALLCONV FFI_mitls_get_memory_limit_stats(/* out */ mitls_memory_limit_stats *stats)
+{
+  region_limits limits;
+  GetHeapRegionLimits(&limits);
+  stats->region_quota = limits.region_quota;
+  stats->max_handshakes = (uint32_t)limits.max_handshakes;
+  stats->handshakes = (uint32_t)limits.handshakes;
+  stats->quota_failures = limits.quota_failures;
+  stats->busy_failures = limits.busy_failures;
+  return 1;
+}
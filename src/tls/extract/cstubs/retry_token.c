@@ -0,0 +1,299 @@
+#include <memory.h>
+#include <stdint.h>
+#include <stdlib.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+    #include <time.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <time.h>
+#endif
+
+#include "Mitls_Kremlib.h"
+#include "EverCrypt.h"
+#include "mitlsffi.h"
+
+// Stateless retry tokens, see mitlsffi.h.
+//
+// A token is
+//
+//   timestamp (4 bytes) | data length (1 byte) | data | tag (16 bytes)
+//
+// where the tag is a truncated HMAC-SHA256 of the timestamp, the data, the
+// client address and the SNI and ALPN of the hello, under the key of the
+// timestamp's epoch.  Epochs last 'lifetime' seconds and their keys are
+// derived from the master key, so servers sharing a master key accept each
+// other's tokens and nothing has to be distributed when keys rotate.
+//
+// The keys of the last two epochs are cached.  A slot is replaced by a
+// single thread while readers copy it optimistically and check its epoch
+// before and after; a reader that loses the race derives the key itself.
+// The kernel-mode build has no clock and rejects every token.
+
+#define RT_TAG_LEN 16
+#define RT_KEY_LEN 32 // derived epoch keys
+#define RT_MAX_MASTER 64
+#define RT_DEFAULT_LIFETIME 30 // seconds
+#define RT_STACK_INPUT 512
+
+#if defined(_MSC_VER)
+  #define ATOMIC_ADD64(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+  #define ATOMIC_LOAD64(p) ((uint64_t)InterlockedOr64((volatile LONG64*)(p), 0))
+  #define ATOMIC_STORE64(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+  #define ATOMIC_CAS_PTR(p, o, n) (InterlockedCompareExchangePointer((PVOID volatile*)(p), (n), (o)) == (o))
+  #define ATOMIC_TRY_LOCK(p) (InterlockedExchange((volatile LONG*)(p), 1) == 0)
+  #define ATOMIC_UNLOCK(p) InterlockedExchange((volatile LONG*)(p), 0)
+  #define ATOMIC_FENCE() MemoryBarrier()
+#else
+  #define ATOMIC_ADD64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+  #define ATOMIC_LOAD64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define ATOMIC_STORE64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+  #define ATOMIC_CAS_PTR(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+  #define ATOMIC_TRY_LOCK(p) (__sync_lock_test_and_set((p), 1) == 0)
+  #define ATOMIC_UNLOCK(p) __sync_lock_release(p)
+  #define ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+typedef struct {
+  uint64_t epoch; // epoch + 1, 0 while the key is being replaced
+  uint8_t key[RT_KEY_LEN];
+} epoch_key;
+
+typedef struct {
+  uint32_t lifetime;
+  uint32_t master_len;
+  uint8_t master[RT_MAX_MASTER];
+  epoch_key slot[2];
+  volatile long updating;
+} token_keys;
+
+static token_keys *volatile g_keys;
+static uint64_t g_minted, g_accepted, g_rejected;
+
+static token_keys *create_keys(const unsigned char *key, size_t key_len, uint32_t lifetime)
+{
+  token_keys *k = calloc(1, sizeof(token_keys));
+  if (k == NULL) {
+    return NULL;
+  }
+  k->lifetime = lifetime ? lifetime : RT_DEFAULT_LIFETIME;
+  if (key != NULL) {
+    memcpy(k->master, key, key_len);
+    k->master_len = (uint32_t)key_len;
+  } else {
+    EverCrypt_random_sample(RT_KEY_LEN, k->master);
+    k->master_len = RT_KEY_LEN;
+  }
+  return k;
+}
+
+static token_keys *get_keys(void)
+{
+  token_keys *k = g_keys;
+  if (k == NULL) {
+    k = create_keys(NULL, 0, 0);
+    if (k == NULL) {
+      return NULL;
+    }
+    if (!ATOMIC_CAS_PTR(&g_keys, NULL, k)) {
+      free(k);
+      k = g_keys;
+    }
+  }
+  return k;
+}
+
+#ifndef _KERNEL_MODE
+static uint64_t now_seconds(void)
+{
+  return (uint64_t)time(NULL);
+}
+
+static void derive_key(const token_keys *k, uint64_t epoch, uint8_t key[RT_KEY_LEN])
+{
+  uint8_t label[25] = "mitls retry token";
+  for (int i = 0; i < 8; i++) {
+    label[17 + i] = (uint8_t)(epoch >> (56 - 8 * i));
+  }
+  EverCrypt_HMAC_compute(Spec_Hash_Definitions_SHA2_256, key,
+    (uint8_t*)k->master, k->master_len, label, sizeof(label));
+}
+
+static void epoch_key_get(token_keys *k, uint64_t epoch, uint8_t key[RT_KEY_LEN])
+{
+  epoch_key *s = &k->slot[epoch & 1];
+  if (ATOMIC_LOAD64(&s->epoch) == epoch + 1) {
+    memcpy(key, s->key, RT_KEY_LEN);
+    ATOMIC_FENCE();
+    if (ATOMIC_LOAD64(&s->epoch) == epoch + 1) {
+      return;
+    }
+  }
+  derive_key(k, epoch, key);
+  if (ATOMIC_TRY_LOCK(&k->updating)) {
+    ATOMIC_STORE64(&s->epoch, 0);
+    ATOMIC_FENCE();
+    memcpy(s->key, key, RT_KEY_LEN);
+    ATOMIC_STORE64(&s->epoch, epoch + 1);
+    ATOMIC_UNLOCK(&k->updating);
+  }
+}
+
+static size_t put_field(uint8_t *p, const unsigned char *b, size_t len)
+{
+  p[0] = (uint8_t)(len >> 8);
+  p[1] = (uint8_t)len;
+  if (len > 0) {
+    memcpy(p + 2, b, len);
+  }
+  return 2 + len;
+}
+
+// Tag of the token prefix (timestamp, data length, data) in its context
+static int compute_tag(token_keys *k, const unsigned char *prefix, size_t prefix_len,
+  const mitls_hello_summary *ch, const unsigned char *addr, size_t addr_len,
+  uint8_t tag[RT_TAG_LEN])
+{
+  uint8_t stack[RT_STACK_INPUT], key[RT_KEY_LEN], mac[32];
+  uint8_t *in = stack;
+  size_t len = prefix_len + 6 + addr_len + ch->sni_len + ch->alpn_len, n = 0;
+  uint64_t t = 0;
+
+  if (addr_len > 0xffff || ch->sni_len > 0xffff || ch->alpn_len > 0xffff) {
+    return 0;
+  }
+  if (len > sizeof(stack) && (in = malloc(len)) == NULL) {
+    return 0;
+  }
+  memcpy(in, prefix, prefix_len);
+  n = prefix_len;
+  n += put_field(in + n, addr, addr_len);
+  n += put_field(in + n, ch->sni, ch->sni_len);
+  n += put_field(in + n, ch->alpn, ch->alpn_len);
+
+  for (int i = 0; i < 4; i++) {
+    t = (t << 8) | prefix[i];
+  }
+  epoch_key_get(k, t / k->lifetime, key);
+  EverCrypt_HMAC_compute(Spec_Hash_Definitions_SHA2_256, mac, key, RT_KEY_LEN, in, (uint32_t)n);
+  memcpy(tag, mac, RT_TAG_LEN);
+
+  if (in != stack) {
+    free(in);
+  }
+  return 1;
+}
+#endif
+
+int MITLS_CALLCONV FFI_mitls_configure_retry_tokens(const unsigned char *key, size_t key_len, uint32_t lifetime)
+{
+  if (key != NULL && (key_len < 16 || key_len > RT_MAX_MASTER)) {
+    return 0;
+  }
+  token_keys *k = create_keys(key, key_len, lifetime);
+  if (k == NULL) {
+    return 0;
+  }
+  // As for the anti-replay filter, a replaced key set is never freed since
+  // a concurrent call may still be using it
+  g_keys = k;
+  return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_mint_retry_token(const mitls_hello_summary *ch,
+  const unsigned char *addr, size_t addr_len,
+  const unsigned char *data, size_t data_len,
+  unsigned char *token, size_t *token_len)
+{
+#ifdef _KERNEL_MODE
+  return 0;
+#else
+  token_keys *k = get_keys();
+  size_t len = MITLS_RETRY_TOKEN_OVERHEAD + data_len;
+  uint64_t now = now_seconds();
+
+  if (k == NULL || data_len > MITLS_RETRY_TOKEN_MAX_DATA || *token_len < len) {
+    return 0;
+  }
+  for (int i = 0; i < 4; i++) {
+    token[i] = (unsigned char)(now >> (24 - 8 * i));
+  }
+  token[4] = (unsigned char)data_len;
+  if (data_len > 0) {
+    memcpy(token + 5, data, data_len);
+  }
+  if (!compute_tag(k, token, 5 + data_len, ch, addr, addr_len, token + 5 + data_len)) {
+    return 0;
+  }
+  *token_len = len;
+  ATOMIC_ADD64(&g_minted, 1);
+  return 1;
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_verify_retry_token(const mitls_hello_summary *ch,
+  const unsigned char *addr, size_t addr_len,
+  const unsigned char *token, size_t token_len,
+  const unsigned char **data, size_t *data_len)
+{
+#ifdef _KERNEL_MODE
+  return 0;
+#else
+  token_keys *k = get_keys();
+  uint8_t tag[RT_TAG_LEN], diff = 0;
+  uint64_t t = 0, now = now_seconds();
+  size_t n;
+
+  *data = NULL;
+  *data_len = 0;
+  if (k == NULL) {
+    return 0;
+  }
+  if (token_len < MITLS_RETRY_TOKEN_OVERHEAD
+      || token_len != MITLS_RETRY_TOKEN_OVERHEAD + (size_t)token[4]) {
+    goto reject;
+  }
+  for (int i = 0; i < 4; i++) {
+    t = (t << 8) | token[i];
+  }
+  // Expired, or minted by a server whose clock is ahead of ours
+  if (t > now || now - t > k->lifetime) {
+    goto reject;
+  }
+  n = 5 + token[4];
+  if (!compute_tag(k, token, n, ch, addr, addr_len, tag)) {
+    goto reject;
+  }
+  for (int i = 0; i < RT_TAG_LEN; i++) {
+    diff |= tag[i] ^ token[n + i];
+  }
+  if (diff != 0) {
+    goto reject;
+  }
+  *data = token[4] > 0 ? token + 5 : NULL;
+  *data_len = token[4];
+  ATOMIC_ADD64(&g_accepted, 1);
+  return 1;
+
+ reject:
+  ATOMIC_ADD64(&g_rejected, 1);
+  return 0;
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_get_retry_token_stats(/* out */ mitls_retry_token_stats *stats)
+{
+  token_keys *k = g_keys;
+  memset(stats, 0, sizeof(*stats));
+  stats->lifetime = k != NULL ? k->lifetime : RT_DEFAULT_LIFETIME;
+  stats->minted = ATOMIC_LOAD64(&g_minted);
+  stats->accepted = ATOMIC_LOAD64(&g_accepted);
+  stats->rejected = ATOMIC_LOAD64(&g_rejected);
+  return 1;
+}
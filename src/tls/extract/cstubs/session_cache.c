@@ -0,0 +1,490 @@
+#include <memory.h>
+#include <stdint.h>
+#include <stdlib.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+    #include <time.h>
+  #endif
+#else
+#define IS_WINDOWS 0
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "mitlsffi.h"
+#include "session_cache.h"
+
+// Built-in client session cache, see FFI_mitls_configure_session_cache.
+//
+// Entries are keyed by the SNI and the offered ALPN list, so a ticket is
+// only offered to the service that issued it.  Each entry keeps the
+// SC_TICKETS_PER_ENTRY most recent tickets and a lookup returns the newest
+// one that has not expired.  Tickets that allow early data are single-use:
+// a lookup removes them, so the same ticket never carries 0-RTT data twice.
+//
+// The cache is split in SC_SHARDS shards, each with its own lock, hash
+// table and LRU list, so connections to different servers rarely contend.
+// When a shard is full, its least recently used entry is evicted.  Ticket
+// and session bytes hold resumption secrets and are wiped when freed.  The
+// kernel-mode build has no cache.
+
+#define SC_SHARDS 16
+#define SC_TICKETS_PER_ENTRY 4
+#define SC_DEFAULT_LIFETIME 3600 // seconds, for tickets that do not announce one
+#define SC_MAX_LIFETIME 604800 // seven days (RFC 8446, 4.6.1)
+
+#if defined(_MSC_VER)
+  #define ATOMIC_ADD64(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+  #define ATOMIC_LOAD64(p) ((uint64_t)InterlockedOr64((volatile LONG64*)(p), 0))
+#else
+  #define ATOMIC_ADD64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+  #define ATOMIC_LOAD64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
+#ifndef _KERNEL_MODE
+#if IS_WINDOWS
+  typedef CRITICAL_SECTION sc_lock;
+  #define SC_LOCK_INIT(x) InitializeCriticalSection(x)
+  #define SC_LOCK_FREE(x) DeleteCriticalSection(x)
+  #define SC_LOCK(x) EnterCriticalSection(x)
+  #define SC_UNLOCK(x) LeaveCriticalSection(x)
+#else
+  typedef pthread_mutex_t sc_lock;
+  #define SC_LOCK_INIT(x) pthread_mutex_init(x, NULL)
+  #define SC_LOCK_FREE(x) pthread_mutex_destroy(x)
+  #define SC_LOCK(x) pthread_mutex_lock(x)
+  #define SC_UNLOCK(x) pthread_mutex_unlock(x)
+#endif
+
+typedef struct {
+  unsigned char *ticket;
+  size_t ticket_len;
+  unsigned char *session;
+  size_t session_len;
+  uint64_t expires; // seconds
+  int early;
+} sc_ticket;
+
+typedef struct sc_entry {
+  struct sc_entry *next; // in its hash bucket
+  struct sc_entry *lru_prev, *lru_next; // most recently used first
+  uint64_t hash;
+  unsigned char *key;
+  size_t key_len;
+  uint32_t count;
+  sc_ticket tickets[SC_TICKETS_PER_ENTRY]; // oldest first
+} sc_entry;
+
+typedef struct {
+  sc_lock lock;
+  sc_entry **buckets;
+  uint32_t nbuckets; // a power of two
+  uint32_t count;
+  uint32_t capacity;
+  sc_entry lru; // sentinel
+} sc_shard;
+
+typedef struct {
+  uint32_t capacity;
+  uint32_t max_lifetime;
+  sc_shard shards[SC_SHARDS];
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t expired;
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t resumed;
+  uint64_t full;
+} session_cache;
+
+static session_cache *volatile g_cache;
+
+static uint64_t now_seconds(void)
+{
+  return (uint64_t)time(NULL);
+}
+
+static uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t hash_key(const unsigned char *key, size_t len)
+{
+  uint64_t h = len;
+  while (len > 0) {
+    uint64_t w = 0;
+    size_t n = len < 8 ? len : 8;
+    memcpy(&w, key, n);
+    h = mix(h ^ w);
+    key += n;
+    len -= n;
+  }
+  return h;
+}
+
+static unsigned char *copy_bytes(const unsigned char *b, size_t len)
+{
+  unsigned char *c = malloc(len ? len : 1);
+  if (c != NULL) {
+    memcpy(c, b, len);
+  }
+  return c;
+}
+
+static void wipe_bytes(unsigned char *b, size_t len)
+{
+  if (b != NULL) {
+    volatile unsigned char *p = b;
+    while (len-- > 0) {
+      *p++ = 0;
+    }
+    free(b);
+  }
+}
+
+static void free_ticket(sc_ticket *t)
+{
+  wipe_bytes(t->ticket, t->ticket_len);
+  wipe_bytes(t->session, t->session_len);
+  memset(t, 0, sizeof(*t));
+}
+
+static void remove_ticket(sc_entry *e, uint32_t i)
+{
+  free_ticket(&e->tickets[i]);
+  memmove(&e->tickets[i], &e->tickets[i + 1], (e->count - i - 1) * sizeof(sc_ticket));
+  e->count--;
+  memset(&e->tickets[e->count], 0, sizeof(sc_ticket));
+}
+
+static void lru_unlink(sc_entry *e)
+{
+  e->lru_prev->lru_next = e->lru_next;
+  e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(sc_shard *s, sc_entry *e)
+{
+  e->lru_prev = &s->lru;
+  e->lru_next = s->lru.lru_next;
+  s->lru.lru_next->lru_prev = e;
+  s->lru.lru_next = e;
+}
+
+static sc_entry **find(sc_shard *s, uint64_t h, const unsigned char *key, size_t len)
+{
+  sc_entry **p = &s->buckets[(h >> 8) & (s->nbuckets - 1)];
+  while (*p != NULL &&
+         ((*p)->hash != h || (*p)->key_len != len || memcmp((*p)->key, key, len))) {
+    p = &(*p)->next;
+  }
+  return p;
+}
+
+// Unlinks and frees the entry at *p
+static void remove_entry(sc_shard *s, sc_entry **p)
+{
+  sc_entry *e = *p;
+  *p = e->next;
+  lru_unlink(e);
+  while (e->count > 0) {
+    remove_ticket(e, e->count - 1);
+  }
+  free(e->key);
+  free(e);
+  s->count--;
+}
+
+static void evict_lru(session_cache *c, sc_shard *s)
+{
+  sc_entry *e = s->lru.lru_prev;
+  remove_entry(s, find(s, e->hash, e->key, e->key_len));
+  ATOMIC_ADD64(&c->evictions, 1);
+}
+
+static void flush_shard(sc_shard *s)
+{
+  SC_LOCK(&s->lock);
+  while (s->count > 0) {
+    sc_entry *e = s->lru.lru_prev;
+    remove_entry(s, find(s, e->hash, e->key, e->key_len));
+  }
+  SC_UNLOCK(&s->lock);
+}
+
+static session_cache *create_cache(uint32_t capacity, uint32_t max_lifetime)
+{
+  session_cache *c = calloc(1, sizeof(session_cache));
+  if (c == NULL) {
+    return NULL;
+  }
+  c->capacity = capacity;
+  c->max_lifetime = max_lifetime && max_lifetime < SC_MAX_LIFETIME ? max_lifetime : SC_MAX_LIFETIME;
+  for (int i = 0; i < SC_SHARDS; i++) {
+    sc_shard *s = &c->shards[i];
+    s->capacity = (capacity + SC_SHARDS - 1) / SC_SHARDS;
+    s->nbuckets = 4;
+    while (s->nbuckets < s->capacity) {
+      s->nbuckets <<= 1;
+    }
+    s->buckets = calloc(s->nbuckets, sizeof(sc_entry*));
+    if (s->buckets == NULL) {
+      while (i-- > 0) {
+        SC_LOCK_FREE(&c->shards[i].lock);
+        free(c->shards[i].buckets);
+      }
+      free(c);
+      return NULL;
+    }
+    s->lru.lru_prev = s->lru.lru_next = &s->lru;
+    SC_LOCK_INIT(&s->lock);
+  }
+  return c;
+}
+
+static sc_shard *shard_of(session_cache *c, uint64_t h)
+{
+  return &c->shards[h % SC_SHARDS];
+}
+#endif
+
+int SessionCache_enabled(void)
+{
+#ifdef _KERNEL_MODE
+  return 0;
+#else
+  return g_cache != NULL;
+#endif
+}
+
+int SessionCache_lookup(const unsigned char *key, size_t key_len, mitls_ticket *t)
+{
+#ifdef _KERNEL_MODE
+  return 0;
+#else
+  session_cache *c = g_cache;
+  int hit = 0;
+  memset(t, 0, sizeof(*t));
+  if (c == NULL) {
+    return 0;
+  }
+  uint64_t h = hash_key(key, key_len), now = now_seconds();
+  sc_shard *s = shard_of(c, h);
+  ATOMIC_ADD64(&c->lookups, 1);
+
+  SC_LOCK(&s->lock);
+  sc_entry **p = find(s, h, key, key_len);
+  sc_entry *e = *p;
+  if (e != NULL) {
+    // Expired tickets are dropped on the way
+    for (uint32_t i = 0; i < e->count; ) {
+      if (e->tickets[i].expires <= now) {
+        remove_ticket(e, i);
+        ATOMIC_ADD64(&c->expired, 1);
+      } else {
+        i++;
+      }
+    }
+    if (e->count > 0) {
+      sc_ticket *n = &e->tickets[e->count - 1];
+      if (n->early) {
+        // Hand over the buffers, the ticket leaves the cache
+        t->ticket = n->ticket; t->ticket_len = n->ticket_len;
+        t->session = n->session; t->session_len = n->session_len;
+        n->ticket = n->session = NULL;
+        remove_ticket(e, e->count - 1);
+        hit = 1;
+      } else {
+        t->ticket = copy_bytes(n->ticket, n->ticket_len);
+        t->session = copy_bytes(n->session, n->session_len);
+        t->ticket_len = n->ticket_len;
+        t->session_len = n->session_len;
+        hit = t->ticket != NULL && t->session != NULL;
+      }
+    }
+    if (e->count == 0) {
+      remove_entry(s, p);
+    } else {
+      lru_unlink(e);
+      lru_push(s, e);
+    }
+  }
+  SC_UNLOCK(&s->lock);
+
+  if (!hit) {
+    SessionCache_release(t);
+    return 0;
+  }
+  ATOMIC_ADD64(&c->hits, 1);
+  return 1;
+#endif
+}
+
+void SessionCache_release(mitls_ticket *t)
+{
+#ifndef _KERNEL_MODE
+  wipe_bytes((unsigned char*)t->ticket, t->ticket_len);
+  wipe_bytes((unsigned char*)t->session, t->session_len);
+#endif
+  memset(t, 0, sizeof(*t));
+}
+
+void SessionCache_store(const unsigned char *key, size_t key_len, const mitls_ticket *t, uint32_t lifetime, int early)
+{
+#ifndef _KERNEL_MODE
+  session_cache *c = g_cache;
+  if (c == NULL || t->ticket_len == 0) {
+    return;
+  }
+  if (lifetime == 0) {
+    lifetime = SC_DEFAULT_LIFETIME;
+  }
+  if (lifetime > c->max_lifetime) {
+    lifetime = c->max_lifetime;
+  }
+
+  sc_ticket n;
+  n.ticket = copy_bytes(t->ticket, t->ticket_len);
+  n.ticket_len = t->ticket_len;
+  n.session = copy_bytes(t->session, t->session_len);
+  n.session_len = t->session_len;
+  n.expires = now_seconds() + lifetime;
+  n.early = early;
+  if (n.ticket == NULL || n.session == NULL) {
+    free_ticket(&n);
+    return;
+  }
+
+  uint64_t h = hash_key(key, key_len);
+  sc_shard *s = shard_of(c, h);
+
+  SC_LOCK(&s->lock);
+  sc_entry **p = find(s, h, key, key_len);
+  sc_entry *e = *p;
+  if (e == NULL) {
+    if (s->count >= s->capacity) {
+      evict_lru(c, s);
+      p = find(s, h, key, key_len);
+    }
+    e = calloc(1, sizeof(sc_entry));
+    if (e == NULL || (e->key = copy_bytes(key, key_len)) == NULL) {
+      free(e);
+      SC_UNLOCK(&s->lock);
+      free_ticket(&n);
+      return;
+    }
+    e->hash = h;
+    e->key_len = key_len;
+    *p = e;
+    s->count++;
+  } else {
+    lru_unlink(e);
+    if (e->count == SC_TICKETS_PER_ENTRY) {
+      remove_ticket(e, 0);
+    }
+  }
+  e->tickets[e->count++] = n;
+  lru_push(s, e);
+  SC_UNLOCK(&s->lock);
+
+  ATOMIC_ADD64(&c->stores, 1);
+#endif
+}
+
+void SessionCache_record(int resumed)
+{
+#ifndef _KERNEL_MODE
+  session_cache *c = g_cache;
+  if (c != NULL) {
+    ATOMIC_ADD64(resumed ? &c->resumed : &c->full, 1);
+  }
+#endif
+}
+
+void SessionCache_cleanup(void)
+{
+#ifndef _KERNEL_MODE
+  session_cache *c = g_cache;
+  g_cache = NULL;
+  if (c != NULL) {
+    for (int i = 0; i < SC_SHARDS; i++) {
+      flush_shard(&c->shards[i]);
+      SC_LOCK_FREE(&c->shards[i].lock);
+      free(c->shards[i].buckets);
+    }
+    free(c);
+  }
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_session_cache(uint32_t capacity, uint32_t max_lifetime)
+{
+#ifdef _KERNEL_MODE
+  return 0;
+#else
+  session_cache *c = NULL, *old = g_cache;
+  if (capacity > 0) {
+    c = create_cache(capacity, max_lifetime);
+    if (c == NULL) {
+      return 0;
+    }
+  }
+  g_cache = c;
+  // A concurrent connection may still be using the old cache, which is
+  // emptied but never freed
+  if (old != NULL) {
+    for (int i = 0; i < SC_SHARDS; i++) {
+      flush_shard(&old->shards[i]);
+    }
+  }
+  return 1;
+#endif
+}
+
+void MITLS_CALLCONV FFI_mitls_flush_session_cache(void)
+{
+#ifndef _KERNEL_MODE
+  session_cache *c = g_cache;
+  if (c != NULL) {
+    for (int i = 0; i < SC_SHARDS; i++) {
+      flush_shard(&c->shards[i]);
+    }
+  }
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_get_session_cache_stats(/* out */ mitls_session_cache_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+#ifndef _KERNEL_MODE
+  session_cache *c = g_cache;
+  if (c == NULL) {
+    return 1;
+  }
+  stats->capacity = c->capacity;
+  for (int i = 0; i < SC_SHARDS; i++) {
+    SC_LOCK(&c->shards[i].lock);
+    stats->entries += c->shards[i].count;
+    SC_UNLOCK(&c->shards[i].lock);
+  }
+  stats->lookups = ATOMIC_LOAD64(&c->lookups);
+  stats->hits = ATOMIC_LOAD64(&c->hits);
+  stats->expired = ATOMIC_LOAD64(&c->expired);
+  stats->stores = ATOMIC_LOAD64(&c->stores);
+  stats->evictions = ATOMIC_LOAD64(&c->evictions);
+  stats->resumed = ATOMIC_LOAD64(&c->resumed);
+  stats->full_handshakes = ATOMIC_LOAD64(&c->full);
+#endif
+  return 1;
+}
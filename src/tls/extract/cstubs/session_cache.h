@@ -0,0 +1,26 @@
+#ifndef HEADER_SESSION_CACHE_H
+#define HEADER_SESSION_CACHE_H
+#include <stddef.h>
+#include <stdint.h>
+#include "mitlsffi.h"
+
+// Client session cache used by mitlsffi.c, see session_cache.c.  Keys are
+// opaque byte strings (the SNI and the offered ALPN list).
+
+int SessionCache_enabled(void);
+
+// Copy the most recent live ticket for key into *t, with buffers to be
+// released by SessionCache_release.  Tickets that allow early data are
+// removed from the cache.  Returns 0 on a miss.
+int SessionCache_lookup(const unsigned char *key, size_t key_len, mitls_ticket *t);
+void SessionCache_release(mitls_ticket *t);
+
+// lifetime is the one announced by the server, 0 if unknown
+void SessionCache_store(const unsigned char *key, size_t key_len, const mitls_ticket *t, uint32_t lifetime, int early);
+
+// Outcome of a completed handshake that offered a cached ticket
+void SessionCache_record(int resumed);
+
+void SessionCache_cleanup(void);
+
+#endif // HEADER_SESSION_CACHE_H
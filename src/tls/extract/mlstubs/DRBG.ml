@@ -0,0 +1,9 @@
+(* The OCaml build has no buffered generator: samples come straight
+   from CoreCrypto *)
+
+let init () : unit = ()
+
+let cleanup () : unit = ()
+
+let sample (len:FStar_UInt32.t) : FStar_Bytes.bytes =
+  CoreCrypto.random (FStar_UInt32.v len)
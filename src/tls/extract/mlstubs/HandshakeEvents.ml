@@ -0,0 +1,16 @@
+(* Handshake events are only recorded by the native (KreMLin) build *)
+
+type event = FStar_UInt8.t
+
+let ev_client_hello_sent = FStar_UInt8.uint_to_t (Prims.parse_int "1")
+let ev_client_hello_parsed = FStar_UInt8.uint_to_t (Prims.parse_int "2")
+let ev_server_hello_parsed = FStar_UInt8.uint_to_t (Prims.parse_int "3")
+let ev_key_share_done = FStar_UInt8.uint_to_t (Prims.parse_int "4")
+let ev_finished_verified = FStar_UInt8.uint_to_t (Prims.parse_int "8")
+let ev_ks_early_keys = FStar_UInt8.uint_to_t (Prims.parse_int "9")
+let ev_ks_handshake_keys = FStar_UInt8.uint_to_t (Prims.parse_int "10")
+let ev_ks_application_keys = FStar_UInt8.uint_to_t (Prims.parse_int "11")
+let ev_ks_resumption_secret = FStar_UInt8.uint_to_t (Prims.parse_int "12")
+let ev_handshake_complete = FStar_UInt8.uint_to_t (Prims.parse_int "13")
+
+let record : event -> unit = fun _ -> ()
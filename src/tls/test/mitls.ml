@@ -135,6 +135,7 @@ let load_psk is_ticket x =
   let pskInfo = {
     ticket_nonce = if is_ticket then Some (CoreCrypto.random (Z.of_int 8)) else None;
     time_created = Prims.parse_int "0";
+    ticket_lifetime = Prims.parse_int "0";
     allow_early_data = true;
     allow_dhe_resumption = true;
     allow_psk_resumption = true;
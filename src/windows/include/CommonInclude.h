@@ -21,6 +21,7 @@
 __declspec(noreturn) extern void KremlExit(int n);
 
 #define USE_HEAP_REGIONS 1
+#define REGION_STATISTICS 1
 #include "RegionAllocator.h"
 
 #define KRML_HOST_PRINTF DbgPrint
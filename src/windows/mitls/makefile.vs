@@ -6,17 +6,22 @@ all: libmitls.dll
 SOURCES = \
   AEADProvider.c \
   Alert.c \
+  anti_replay.c \
   buffer_bytes.c \
   Cert.c \
+  cert_compression.c \
   CipherSuite.c \
   CommonDH.c \
   Connection.c \
   Content.c \
   Crypto_Plain.c \
+  dh_fixed_base.c \
+  drbg.c \
   Extensions.c \
   FFI.c \
   Flags.c \
   Format.c \
+  handshake_events.c \
   HandshakeLog.c \
   HandshakeMessages.c \
   Hashing.c \
@@ -35,6 +40,8 @@ SOURCES = \
   Random.c \
   Range.c \
   Record.c \
+  retry_token.c \
+  session_cache.c \
   StatefulLHAE.c \
   StreamAE.c \
   Ticket.c \
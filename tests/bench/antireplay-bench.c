@@ -0,0 +1,106 @@
+/* -------------------------------------------------------------------- */
+/* Throughput and false-positive rate of the 0-RTT anti-replay filter   */
+/*                                                                      */
+/* usage: antireplay-bench [hellos-per-minute] [window] [threads]       */
+/*                                                                      */
+/* Sizes the filter for the given load, checks one window's worth of    */
+/* distinct hellos from each thread, then replays a sample of them.     */
+/* Every rejection of a distinct hello is a false positive.             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mitlsffi.h"
+
+/* -------------------------------------------------------------------- */
+typedef struct {
+  uint32_t id;
+  uint64_t count;
+  uint64_t rejected;
+} worker_t;
+
+/* A key looks like a ticket identity followed by a client random */
+static void make_key(unsigned char key[64], uint32_t thread, uint64_t i)
+{
+  memset(key, 0xa5, 64);
+  memcpy(key + 32, &thread, sizeof(thread));
+  memcpy(key + 40, &i, sizeof(i));
+}
+
+static void *worker(void *arg)
+{
+  worker_t *w = arg;
+  unsigned char key[64];
+
+  for (uint64_t i = 0; i < w->count; ++i) {
+    make_key(key, w->id, i);
+    if (!FFI_mitls_anti_replay_check(key, sizeof(key)))
+      w->rejected++;
+  }
+  return NULL;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+  uint64_t per_minute = argc > 1 ? strtoull(argv[1], NULL, 10) : 6000000;
+  uint32_t window = argc > 2 ? (uint32_t) atoi(argv[2]) : 10;
+  uint32_t nthreads = argc > 3 ? (uint32_t) atoi(argv[3]) : 4;
+  uint64_t capacity = per_minute * window / 60;
+  pthread_t threads[nthreads];
+  worker_t workers[nthreads];
+  uint64_t rejected = 0, replayed = 0, sample;
+  unsigned char key[64];
+  mitls_anti_replay_stats stats;
+  double t0, t1;
+
+  if (!FFI_mitls_init() ||
+      !FFI_mitls_configure_anti_replay(window, (uint32_t) capacity)) {
+    fprintf(stderr, "cannot initialize the anti-replay filter\n");
+    return 1;
+  }
+
+  t0 = now();
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    workers[i] = (worker_t) { i, capacity / nthreads, 0 };
+    pthread_create(&threads[i], NULL, worker, &workers[i]);
+  }
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+    rejected += workers[i].rejected;
+  }
+  t1 = now();
+
+  sample = capacity / nthreads < 100000 ? capacity / nthreads : 100000;
+  for (uint64_t i = 0; i < sample; ++i) {
+    make_key(key, 0, i);
+    if (!FFI_mitls_anti_replay_check(key, sizeof(key)))
+      replayed++;
+  }
+
+  FFI_mitls_get_anti_replay_stats(&stats);
+
+  printf("hellos/window    : %llu (%llu/min, %us window)\n",
+         (unsigned long long) capacity, (unsigned long long) per_minute, window);
+  printf("filter memory    : %llu KiB\n", (unsigned long long) stats.memory / 1024);
+  printf("threads          : %u\n", nthreads);
+  printf("checks/sec       : %.0f\n", (nthreads * (capacity / nthreads)) / (t1 - t0));
+  printf("false positives  : %llu (%.5f%%)\n", (unsigned long long) rejected,
+         100.0 * rejected / (nthreads * (capacity / nthreads)));
+  printf("replays detected : %llu / %llu\n",
+         (unsigned long long) replayed, (unsigned long long) sample);
+
+  FFI_mitls_cleanup();
+  return 0;
+}
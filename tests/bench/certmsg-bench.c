@@ -0,0 +1,173 @@
+/* -------------------------------------------------------------------- */
+/* Allocations and time to format a Certificate message                 */
+/*                                                                      */
+/* usage: certmsg-bench [chain-length] [certificate-size] [iterations]  */
+/*                                                                      */
+/* Formats a chain as HandshakeMessages.certificateBytes13 did before   */
+/* and after BufferBytes.concat, with the allocations KreMLin extracts  */
+/* for each: bytes_of_int and FStar_Bytes_append allocate their result  */
+/* and copy their arguments, and each list cell is allocated. This      */
+/* reproduces that C code stand-alone, so it does not need libmitls.    */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* -------------------------------------------------------------------- */
+typedef struct { uint32_t length; const char *data; } bytes;
+typedef struct cell { bytes hd; struct cell *tl; } cell;
+
+static uint64_t allocs, copied;
+
+/* Intermediate results are not freed by the extracted code; they are
+   kept here and freed in bulk, as a handshake region would be */
+static void *pool[1 << 12];
+static size_t pooled;
+
+static void *counted_malloc(size_t len)
+{
+  void *p = malloc(len ? len : 1);
+  if (p == NULL || pooled == sizeof(pool) / sizeof(pool[0])) exit(255);
+  pool[pooled++] = p;
+  allocs++;
+  return p;
+}
+
+static void release(void)
+{
+  while (pooled > 0) free(pool[--pooled]);
+}
+
+static bytes append(bytes a, bytes b)
+{
+  char *data = counted_malloc(a.length + b.length);
+  memcpy(data, a.data, a.length);
+  memcpy(data + a.length, b.data, b.length);
+  copied += a.length + b.length;
+  return (bytes){a.length + b.length, data};
+}
+
+static bytes bytes_of_int(uint32_t n, uint32_t v)
+{
+  char *data = counted_malloc(n);
+  for (uint32_t i = 0; i < n; i++)
+    data[n - 1 - i] = (char)(v >> (8 * i));
+  return (bytes){n, data};
+}
+
+static bytes vlbytes(uint32_t n, bytes b)
+{
+  return append(bytes_of_int(n, b.length), b);
+}
+
+static cell *cons(bytes hd, cell *tl)
+{
+  cell *c = counted_malloc(sizeof(cell));
+  c->hd = hd; c->tl = tl;
+  return c;
+}
+
+static bytes concat(cell *l)
+{
+  uint32_t len = 0;
+  for (cell *c = l; c != NULL; c = c->tl) len += c->hd.length;
+  char *data = counted_malloc(len), *p = data;
+  for (cell *c = l; c != NULL; c = c->tl) {
+    memcpy(p, c->hd.data, c->hd.length);
+    p += c->hd.length;
+  }
+  copied += len;
+  return (bytes){len, data};
+}
+
+/* -------------------------------------------------------------------- */
+/* Before: certificateListBytes13, vlbytes 3 and messageBytes */
+static bytes list13_before(bytes *chain, int n, bytes exts)
+{
+  if (n == 0) return (bytes){0, NULL};
+  bytes rest = list13_before(chain + 1, n - 1, exts);
+  return append(vlbytes(3, chain[0]), append(exts, rest));
+}
+
+static bytes message13_before(bytes *chain, int n, bytes exts)
+{
+  bytes cb = list13_before(chain, n, exts);
+  bytes body = append(vlbytes(1, (bytes){0, NULL}), vlbytes(3, cb));
+  return append(bytes_of_int(1, 11), vlbytes(3, body));
+}
+
+/* After: certificateListPieces13 and one BufferBytes.concat */
+static cell *pieces13(bytes *chain, int n, bytes exts, uint32_t *len)
+{
+  if (n == 0) return NULL;
+  cell *rest = pieces13(chain + 1, n - 1, exts, len);
+  *len += 3 + chain[0].length + exts.length;
+  return cons(bytes_of_int(3, chain[0].length), cons(chain[0], cons(exts, rest)));
+}
+
+static bytes message13_after(bytes *chain, int n, bytes exts)
+{
+  uint32_t len = 0;
+  cell *l = pieces13(chain, n, exts, &len);
+  l = cons(bytes_of_int(1, 11), cons(bytes_of_int(3, len + 4),
+        cons(bytes_of_int(1, 0), cons(bytes_of_int(3, len), l))));
+  return concat(l);
+}
+
+/* -------------------------------------------------------------------- */
+static double run(bytes (*f)(bytes*, int, bytes), bytes *chain, int n,
+                  bytes exts, int iterations)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < iterations; i++) {
+    f(chain, n, exts);
+    release();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+  int n = argc > 1 ? atoi(argv[1]) : 3;
+  int size = argc > 2 ? atoi(argv[2]) : 1200;
+  int iterations = argc > 3 ? atoi(argv[3]) : 20000;
+  bytes chain[64], exts = {2, "\0\0"}, a, b;
+
+  if (n < 1 || n > 64 || size < 1 || iterations < 1) {
+    fprintf(stderr, "usage: %s [chain-length <= 64] [certificate-size] [iterations]\n", argv[0]);
+    return 2;
+  }
+  for (int i = 0; i < n; i++) {
+    char *c = malloc(size);
+    memset(c, 0x30 + i, size);
+    chain[i] = (bytes){size, c};
+  }
+
+  /* Count once, checking that both produce the same message */
+  allocs = copied = 0;
+  a = message13_before(chain, n, exts);
+  uint64_t allocs_before = allocs, copied_before = copied;
+  allocs = copied = 0;
+  b = message13_after(chain, n, exts);
+  uint64_t allocs_after = allocs, copied_after = copied;
+  int differ = a.length != b.length || memcmp(a.data, b.data, a.length);
+  release();
+  if (differ) {
+    fprintf(stderr, "the two formats differ\n");
+    return 1;
+  }
+
+  double ns_before = run(message13_before, chain, n, exts, iterations);
+  double ns_after = run(message13_after, chain, n, exts, iterations);
+
+  printf("chain: %d x %d bytes, message: %u bytes\n", n, size, b.length);
+  printf("before: %4llu allocations, %8llu bytes copied, %8.0f ns\n",
+    (unsigned long long)allocs_before, (unsigned long long)copied_before, ns_before);
+  printf("after:  %4llu allocations, %8llu bytes copied, %8.0f ns\n",
+    (unsigned long long)allocs_after, (unsigned long long)copied_after, ns_after);
+  return 0;
+}
@@ -0,0 +1,110 @@
+/* -------------------------------------------------------------------- */
+/* Throughput of Random.sample: EverCrypt alone vs the buffered DRBG    */
+/*                                                                      */
+/* usage: drbg-bench [seconds-per-point] [max-threads]                  */
+/*                                                                      */
+/* For 1, 2, 4, ... max-threads threads, each thread draws 32-byte      */
+/* samples, then the sequence of samples one TLS 1.3 handshake takes    */
+/* (hello random, key share, ticket salt and key, age_add, PSK id).     */
+/* The second figure is an upper bound on handshakes/sec set by the     */
+/* generator alone.                                                     */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mitlsffi.h"
+
+/* Not part of the FFI: the native entry points of DRBG and EverCrypt */
+extern void DRBG_fill(uint8_t *out, uint32_t len);
+extern void EverCrypt_random_sample(uint32_t len, uint8_t *out);
+
+typedef void (*sampler_t)(uint8_t *out, uint32_t len);
+
+static const uint32_t handshake_samples[] = { 32, 32, 32, 12, 32, 4, 8, 32 };
+#define HANDSHAKE_SAMPLES (sizeof(handshake_samples) / sizeof(handshake_samples[0]))
+
+/* -------------------------------------------------------------------- */
+typedef struct {
+  sampler_t sample;
+  int handshakes;
+  double seconds;
+  uint64_t count;
+} worker_t;
+
+static void evercrypt_sample(uint8_t *out, uint32_t len)
+{
+  EverCrypt_random_sample(len, out);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg)
+{
+  worker_t *w = arg;
+  uint8_t out[64];
+  double end = now() + w->seconds;
+
+  while (now() < end) {
+    for (int i = 0; i < 1000; ++i) {
+      if (w->handshakes) {
+        for (size_t j = 0; j < HANDSHAKE_SAMPLES; ++j)
+          w->sample(out, handshake_samples[j]);
+      } else {
+        w->sample(out, 32);
+      }
+    }
+    w->count += 1000;
+  }
+  return NULL;
+}
+
+static double run(sampler_t sample, int handshakes, uint32_t nthreads, double seconds)
+{
+  pthread_t threads[nthreads];
+  worker_t workers[nthreads];
+  uint64_t total = 0;
+
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    workers[i] = (worker_t) { sample, handshakes, seconds, 0 };
+    pthread_create(&threads[i], NULL, worker, &workers[i]);
+  }
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+    total += workers[i].count;
+  }
+  return total / seconds;
+}
+
+/* -------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+  double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+  uint32_t max_threads = argc > 2 ? (uint32_t) atoi(argv[2]) : 64;
+
+  if (!FFI_mitls_init()) {
+    fprintf(stderr, "cannot initialize miTLS\n");
+    return 1;
+  }
+
+  printf("%-8s %16s %16s %16s %16s\n", "threads",
+         "evercrypt/s", "drbg/s", "evercrypt hs/s", "drbg hs/s");
+  for (uint32_t n = 1; n <= max_threads; n *= 2) {
+    printf("%-8u %16.0f %16.0f %16.0f %16.0f\n", n,
+           run(evercrypt_sample, 0, n, seconds),
+           run(DRBG_fill, 0, n, seconds),
+           run(evercrypt_sample, 1, n, seconds),
+           run(DRBG_fill, 1, n, seconds));
+  }
+
+  FFI_mitls_cleanup();
+  return 0;
+}
@@ -0,0 +1,109 @@
+#! /usr/bin/env python
+
+# --------------------------------------------------------------------
+# Per-phase handshake latency from the milestone events printed by
+# apps/quicMinusNet (lines of the form "[C] EVENT <ns> <event> <connection>";
+# older logs have no connection, and then one handshake at a time per role).
+#
+# Usage: ./quic.exe -events [mode] | hsevents.py
+#        hsevents.py log1 log2 ...
+
+from __future__ import print_function
+import sys, re
+
+# --------------------------------------------------------------------
+# Must match mitls_event_type in libs/ffi/mitlsffi.h
+EVENTS = {
+     1 : 'client_hello_sent',
+     2 : 'client_hello_parsed',
+     3 : 'server_hello_parsed',
+     4 : 'key_share_done',
+     5 : 'cert_selected',
+     6 : 'signature_done',
+     7 : 'signature_verified',
+     8 : 'finished_verified',
+     9 : 'ks_early_keys',
+    10 : 'ks_handshake_keys',
+    11 : 'ks_application_keys',
+    12 : 'ks_resumption_secret',
+    13 : 'handshake_complete',
+}
+
+# A handshake starts on the first of these events seen by each role
+START = (4, 2)
+
+ROLES = {'C': 'client', 'S': 'server'}
+
+LINE = re.compile(r'^\[([CS])\] EVENT (\d+) (\d+)(?: (\d+))?\s*$')
+
+# --------------------------------------------------------------------
+def bucket(us):
+    b = 0
+    while (1 << b) <= us:
+        b += 1
+    return b
+
+def label(b):
+    return '<%dus' % (1 << b,)
+
+# --------------------------------------------------------------------
+def collect(stream, phases, totals, last, first):
+    for line in stream:
+        m = LINE.match(line)
+        if m is None:
+            continue
+        role, ts, ev = ROLES[m.group(1)], int(m.group(2)), int(m.group(3))
+        # handshakes are told apart by their connection, when logged
+        conn = (role, m.group(4))
+
+        if ev in START and (conn not in last or last[conn][1] == 13):
+            last.pop(conn, None)
+            first[conn] = ts
+
+        if conn in last:
+            pev, pts = last[conn][1], last[conn][0]
+            key = (role, EVENTS.get(pev, str(pev)), EVENTS.get(ev, str(ev)))
+            phases.setdefault(key, []).append((ts - pts) // 1000)
+
+        if ev == 13 and conn in first:
+            totals.setdefault(role, []).append((ts - first.pop(conn)) // 1000)
+
+        last[conn] = (ts, ev)
+
+# --------------------------------------------------------------------
+def report(key, samples):
+    samples = sorted(samples)
+    n = len(samples)
+    hist = {}
+    for s in samples:
+        b = bucket(s)
+        hist[b] = hist.get(b, 0) + 1
+    print('%-8s %-22s -> %-22s n=%-5d min=%-7d p50=%-7d p99=%-7d max=%d' % \
+          (key + (n, samples[0], samples[n // 2],
+                  samples[min(n - 1, (n * 99) // 100)], samples[-1])))
+    for b in sorted(hist):
+        print('    %10s %6d %s' % (label(b), hist[b], '#' * min(60, hist[b])))
+
+# --------------------------------------------------------------------
+def _main():
+    phases, totals, last, first = {}, {}, {}, {}
+
+    if len(sys.argv) > 1:
+        for name in sys.argv[1:]:
+            with open(name) as stream:
+                collect(stream, phases, totals, last, first)
+    else:
+        collect(sys.stdin, phases, totals, last, first)
+
+    if not phases:
+        print('No handshake events found', file=sys.stderr)
+        exit(1)
+
+    for key in sorted(phases):
+        report(key, phases[key])
+    for role in sorted(totals):
+        report((role, 'start', 'handshake_complete'), totals[role])
+
+# --------------------------------------------------------------------
+if __name__ == '__main__':
+    _main()
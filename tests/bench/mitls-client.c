@@ -0,0 +1,454 @@
+/* -------------------------------------------------------------------- */
+/* miTLS twin of openssl-client.c: same environment, same measurement   */
+/* loop and same output, so that tabulate.py can put both side by side  */
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mitlsffi.h"
+#include "mipki.h"
+
+#define ECHO_NO_EVENT_LIB 1
+
+#include "echo-memory.h"
+#include "echo-log.h"
+#include "echo-net.h"
+
+#ifndef WIN32
+# define closesocket    close
+# define GET_SOCKET_ERROR() (errno)
+#else
+# define GET_SOCKET_ERROR() (WSAGetLastError())
+#endif
+
+/* -------------------------------------------------------------------- */
+#define TOSEND (128 * 1024u * 1024u)
+
+/* -------------------------------------------------------------------- */
+typedef struct sockaddr sockaddr_t;
+typedef struct sockaddr_in in4_t;
+
+/* -------------------------------------------------------------------- */
+static void e_error(const char *message)
+    __attribute__((noreturn));
+
+static void e_error(const char *message) {
+    elog(LOG_FATAL, "%s: %s", message, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static void sock_error(const char *message)
+    __attribute__((noreturn));
+
+static void sock_error(const char *message) {
+    elog(LOG_FATAL, "%s: %s", message, strerror(GET_SOCKET_ERROR()));
+    exit(EXIT_FAILURE);
+}
+
+static void i_error(const char *message)
+    __attribute__((noreturn));
+
+static void i_error(const char *message) {
+    elog(LOG_FATAL, "%s", message);
+    exit(EXIT_FAILURE);
+}
+
+/* -------------------------------------------------------------------- */
+static uint8_t udata[1024 * 1024];
+
+static void udata_initialize(void) {
+    int    fd = -1;
+    size_t position = 0;
+
+#ifdef WIN32
+#define URANDOM "urandom"
+#else
+#define URANDOM "/dev/urandom"
+#endif
+
+    if ((fd = open(URANDOM, O_RDONLY)) < 0)
+        e_error("open(" URANDOM ")");
+    while (position < sizeof(udata)) {
+#ifdef WIN32
+        (void) lseek(fd, 0, SEEK_SET);
+#endif
+
+        errno = 0;
+
+        ssize_t rr = read(fd, &udata[position], sizeof(udata) - position);
+
+        if (rr <= 0)
+            e_error("reading from /dev/urandom");
+        position += rr;
+    }
+
+    (void) close(fd);
+}
+
+/* -------------------------------------------------------------------- */
+/* Only the suites miTLS implements: the RSA key-transport, CBC and RC4 */
+/* suites of openssl-client.c have no counterpart here.                 */
+typedef struct ciphername {
+    char *fullname;
+    char *mitlsname;
+} ciphername_t;
+
+static const ciphername_t ciphernames[] = {
+  { "TLS_AES_128_GCM_SHA256"                       , "TLS_AES_128_GCM_SHA256"               },
+  { "TLS_AES_256_GCM_SHA384"                       , "TLS_AES_256_GCM_SHA384"               },
+  { "TLS_CHACHA20_POLY1305_SHA256"                 , "TLS_CHACHA20_POLY1305_SHA256"         },
+  { "TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256"        , "ECDHE-RSA-AES128-GCM-SHA256"          },
+  { "TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384"        , "ECDHE-RSA-AES256-GCM-SHA384"          },
+  { "TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256"  , "ECDHE-RSA-CHACHA20-POLY1305-SHA256"   },
+  { "TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256"      , "ECDHE-ECDSA-AES128-GCM-SHA256"        },
+  { "TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384"      , "ECDHE-ECDSA-AES256-GCM-SHA384"        },
+  { "TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256", "ECDHE-ECDSA-CHACHA20-POLY1305-SHA256" },
+  { "TLS_DHE_RSA_WITH_AES_128_GCM_SHA256"          , "DHE-RSA-AES128-GCM-SHA256"            },
+  { "TLS_DHE_RSA_WITH_AES_256_GCM_SHA384"          , "DHE-RSA-AES256-GCM-SHA384"            },
+  { "TLS_DHE_RSA_WITH_CHACHA20_POLY1305_SHA256"    , "DHE-RSA-CHACHA20-POLY1305-SHA256"     },
+
+  { NULL, NULL},
+};
+
+static const char* get_mitls_cs(const char *csname) {
+    const ciphername_t *p;
+
+    for (p = &ciphernames[0]; p->fullname != NULL; ++p) {
+        if (strcmp(csname, p->fullname) == 0)
+            return p->mitlsname;
+    }
+
+    return NULL;
+}
+
+static const char* get_cs_fullname(const char *csname) {
+    const ciphername_t *p;
+
+    for (p = &ciphernames[0]; p->fullname != NULL; ++p) {
+        if (strcmp(csname, p->mitlsname) == 0)
+            return p->fullname;
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------- */
+typedef struct options {
+    char        *ciphers;
+    char        *sname;
+    char        *pki;
+    char        *tlsver;
+    mipki_state *mipki;
+    int          ocsp;   /* require a good stapled OCSP response */
+} options_t;
+
+/* -------------------------------------------------------------------- */
+static void* MITLS_CALLCONV
+_cert_select(void *cbs, mitls_version ver,
+             const unsigned char *sni, size_t sni_len,
+             const unsigned char *alpn, size_t alpn_len,
+             const mitls_signature_scheme *sigalgs, size_t sigalgs_len,
+             mitls_signature_scheme *selected)
+{
+    /* No client authentication */
+    (void) cbs; (void) ver; (void) sni; (void) sni_len; (void) alpn;
+    (void) alpn_len; (void) sigalgs; (void) sigalgs_len; (void) selected;
+    return NULL;
+}
+
+static size_t MITLS_CALLCONV
+_cert_format(void *cbs, const void *cert, unsigned char *buffer)
+{
+    (void) cbs; (void) cert; (void) buffer;
+    return 0;
+}
+
+static size_t MITLS_CALLCONV
+_cert_sign(void *cbs, const void *cert, const mitls_signature_scheme sigalg,
+           const unsigned char *tbs, size_t tbs_len, unsigned char *sig)
+{
+    (void) cbs; (void) cert; (void) sigalg; (void) tbs; (void) tbs_len; (void) sig;
+    return 0;
+}
+
+static int MITLS_CALLCONV
+_cert_verify(void *cbs, const unsigned char *chain_bytes, size_t chain_len,
+             const mitls_signature_scheme sigalg,
+             const unsigned char *tbs, size_t tbs_len,
+             const unsigned char *sig, size_t sig_len)
+{
+    options_t  *options = (options_t*) cbs;
+    mipki_chain chain   = NULL;
+    size_t      len     = sig_len;
+    int         rr      = 0;
+
+    chain = mipki_parse_chain(options->mipki, (const char*) chain_bytes, chain_len);
+    if (chain == NULL)
+        return 0;
+
+    if (mipki_validate_chain(options->mipki, chain, options->sname))
+        rr = mipki_sign_verify(options->mipki, chain, sigalg, (const char*) tbs, tbs_len,
+                               (char*) sig, &len, MIPKI_VERIFY);
+
+    mipki_free_chain(options->mipki, chain);
+    return rr;
+}
+
+static mitls_cert_cb cert_callbacks = {
+    .select = _cert_select,
+    .format = _cert_format,
+    .sign   = _cert_sign,
+    .verify = _cert_verify,
+};
+
+/* Called once the chain is validated by _cert_verify */
+static int MITLS_CALLCONV
+_cert_check_status(void *cbs, const unsigned char *chain_bytes, size_t chain_len,
+                   const unsigned char *ocsp, size_t ocsp_len)
+{
+    options_t  *options = (options_t*) cbs;
+    mipki_chain chain   = NULL;
+    int         rr      = 0;
+
+    if (ocsp_len == 0) {
+        elog(LOG_ERROR, "the server stapled no OCSP response");
+        return 0;
+    }
+
+    chain = mipki_parse_chain(options->mipki, (const char*) chain_bytes, chain_len);
+    if (chain == NULL)
+        return 0;
+
+    rr = mipki_check_ocsp_response(options->mipki, chain, (const char*) ocsp, ocsp_len);
+
+    mipki_free_chain(options->mipki, chain);
+    return rr;
+}
+
+static mitls_cert_status_cb status_callbacks = {
+    .staple = NULL,
+    .check  = _cert_check_status,
+};
+
+/* -------------------------------------------------------------------- */
+static int MITLS_CALLCONV _net_send(void *ctxt, const unsigned char *buffer, size_t len) {
+    int    fd   = *(int*) ctxt;
+    size_t sent = 0;
+
+    while (sent < len) {
+        int rr = send(fd, (const char*) &buffer[sent], len - sent, 0);
+
+        if (rr < 0 && GET_SOCKET_ERROR() == EINTR)
+            continue ;
+        if (rr <= 0)
+            return -1;
+        sent += rr;
+    }
+
+    return (int) len;
+}
+
+static int MITLS_CALLCONV _net_recv(void *ctxt, unsigned char *buffer, size_t len) {
+    int fd = *(int*) ctxt;
+
+    while (1) {
+        int rr = recv(fd, (char*) buffer, len, 0);
+
+        if (rr < 0 && GET_SOCKET_ERROR() == EINTR)
+            continue ;
+        return rr > 0 ? rr : -1;
+    }
+}
+
+/* -------------------------------------------------------------------- */
+static mitls_state* configure(options_t *options) {
+    mitls_state *state = NULL;
+
+    if (!FFI_mitls_configure(&state, options->tlsver, options->sname))
+        i_error("cannot configure miTLS");
+    if (!FFI_mitls_configure_cipher_suites(state, options->ciphers))
+        i_error("cannot configure miTLS cipher suite");
+    if (!FFI_mitls_configure_cert_callbacks(state, options, &cert_callbacks))
+        i_error("cannot configure miTLS certificate callbacks");
+    if (options->ocsp && !FFI_mitls_configure_cert_status_callbacks(state, options, &status_callbacks))
+        i_error("cannot configure miTLS OCSP stapling");
+
+    return state;
+}
+
+/* -------------------------------------------------------------------- */
+void client(options_t *options) {
+#define BLKSZ (256 * 1024u)
+    int   i;
+    int   fd;
+    in4_t peername;
+
+    mitls_state *state = NULL;
+
+    size_t sent = 0;
+    size_t upos = 0;
+
+    struct timeval tv1;
+    struct timeval tv2;
+
+    unsigned hsdone  = 0;
+    double   hsticks = 0;
+
+    memset(&peername, 0, sizeof(in4_t));
+    peername.sin_family = AF_INET;
+    peername.sin_addr   = (struct in_addr) { .s_addr = htonl(INADDR_LOOPBACK) };
+    peername.sin_port   = htons(5000);
+
+    for (i = 0; i < 250; ++i) {
+        uint8_t byte[1] = { 0x00 };
+
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            sock_error("socket(AF_INET, SOCK_STREAM)");
+        if (connect(fd, (sockaddr_t*) &peername, sizeof(in4_t)) < 0)
+            sock_error("connecting to server (HS)");
+
+        (void) gettimeofday(&tv1, NULL);
+
+        /* Configuration is part of the per-connection cost, as
+           SSL_new() is in openssl-client.c */
+        state = configure(options);
+        if (!FFI_mitls_connect(&fd, _net_send, _net_recv, state))
+            i_error("miTLS connect failed");
+
+        if (!FFI_mitls_send(state, byte, 1))
+            i_error("miTLS send (HS) failed");
+
+        (void) gettimeofday(&tv2, NULL);
+
+        (void) shutdown(fd, SHUT_WR);
+        FFI_mitls_close(state); state = NULL;
+        (void) closesocket(fd); fd = -1;
+
+        double tv1_d = (double)tv1.tv_sec + ((double)tv1.tv_usec) / 1000000;
+        double tv2_d = (double)tv2.tv_sec + ((double)tv2.tv_usec) / 1000000;
+
+        if (i != 0) {
+            hsdone  += 1;
+            hsticks += (tv2_d - tv1_d);
+        }
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        sock_error("socket(AF_INET, SOCK_STREAM)");
+
+    if (connect(fd, (sockaddr_t*) &peername, sizeof(in4_t)) < 0)
+        sock_error("connecting to server");
+
+    {   int ival = 128 * 1024;
+        int oval = 128 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*) &ival, sizeof(ival));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*) &oval, sizeof(oval));
+    }
+
+    state = configure(options);
+    /* Full-size records from the first byte, as OpenSSL sends them */
+    if (!FFI_mitls_configure_record_size(state, 0, 0, 0))
+        i_error("cannot configure miTLS record size");
+    if (!FFI_mitls_connect(&fd, _net_send, _net_recv, state))
+        i_error("miTLS connect failed");
+
+    (void) gettimeofday(&tv1, NULL);
+
+    while (sent < TOSEND) {
+        if (sizeof(udata) - upos < BLKSZ)
+            upos = 0;
+        if (!FFI_mitls_send(state, &udata[upos], BLKSZ))
+            i_error("client-side write failed");
+        sent += BLKSZ;
+        upos += BLKSZ;
+    }
+
+    (void) gettimeofday(&tv2, NULL);
+
+    /* No close_notify API: half-close, the server sees the end of stream */
+    if (shutdown(fd, SHUT_WR) < 0)
+        sock_error("client-side shutdown failed");
+
+    FFI_mitls_close(state);
+
+    double tv1_d = (double)tv1.tv_sec + ((double)tv1.tv_usec) / 1000000;
+    double tv2_d = (double)tv2.tv_sec + ((double)tv2.tv_usec) / 1000000;
+
+    printf("%s: %.2f HS/s\n",
+           get_cs_fullname(options->ciphers),
+           (hsdone / hsticks));
+    printf("%s: %.2f MiB/s\n",
+           get_cs_fullname(options->ciphers),
+           (sent / ((double) (1024 * 1024))) / (tv2_d - tv1_d));
+
+    (void) closesocket(fd);
+}
+
+/* -------------------------------------------------------------------- */
+int main(void) {
+    options_t options;
+    char *CApath = NULL;
+    int   erridx = 0;
+
+#ifdef WIN32
+    WSADATA WSAData;
+#endif
+
+    initialize_log4c();
+
+#ifdef WIN32
+    if (WSAStartup(MAKEWORD(2, 2), &WSAData) != 0) {
+        elog(LOG_FATAL, "cannot initialize winsocks");
+        return EXIT_FAILURE;
+    }
+#endif
+
+    options.ciphers = getenv("CIPHERSUITE");
+    options.sname   = getenv("CERTNAME");
+    options.pki     = getenv("PKI");
+    options.tlsver  = getenv("TLSVERSION");
+    options.ocsp    = getenv("OCSP") != NULL;
+
+    if (options.ciphers == NULL)
+        i_error("no cipher suite given");
+    options.ciphers = (char*) get_mitls_cs(options.ciphers);
+    if (options.ciphers == NULL)
+        i_error("unknown cipher name");
+    options.ciphers = xstrdup(options.ciphers);
+    if (options.pki == NULL)
+        i_error("no PKI directory given");
+    options.pki = xstrdup(options.pki);
+    if (options.sname == NULL)
+        i_error("no cert-name given");
+    options.sname = xstrdup(options.sname);
+    options.tlsver = xstrdup(options.tlsver ? options.tlsver : "1.2");
+
+    if (!FFI_mitls_init())
+        i_error("cannot initialize miTLS");
+    udata_initialize();
+
+    if ((options.mipki = mipki_init(NULL, 0, NULL, &erridx)) == NULL)
+        i_error("cannot initialize mipki");
+    CApath = xjoin(options.pki, "/db/ca.db.certs", NULL);
+    if (!mipki_add_root_file_or_path(options.mipki, CApath))
+        i_error("cannot load trusted CA path");
+    free(CApath);
+
+    client(&options);
+
+    mipki_free(options.mipki);
+    FFI_mitls_cleanup();
+
+#ifdef WIN32
+    (void) WSACleanup();
+#endif
+
+    return EXIT_SUCCESS;
+}
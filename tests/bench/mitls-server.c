@@ -0,0 +1,393 @@
+/* -------------------------------------------------------------------- */
+/* miTLS twin of openssl-server.c: same environment, same loop          */
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "mitlsffi.h"
+#include "mipki.h"
+
+#define ECHO_NO_EVENT_LIB 1
+
+#include "echo-memory.h"
+#include "echo-log.h"
+#include "echo-net.h"
+
+#ifndef WIN32
+# define closesocket    close
+# define GET_SOCKET_ERROR() (errno)
+#else
+# define GET_SOCKET_ERROR() (WSAGetLastError())
+#endif
+
+/* -------------------------------------------------------------------- */
+typedef struct sockaddr sockaddr_t;
+typedef struct sockaddr_in in4_t;
+
+/* -------------------------------------------------------------------- */
+static void e_error(const char *message)
+    __attribute__((noreturn));
+
+static void e_error(const char *message) { /* Should move to WSAError under winsocks... */
+    elog(LOG_FATAL, "%s: %s", message, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static void i_error(const char *message)
+    __attribute__((noreturn));
+
+static void i_error(const char *message) {
+    elog(LOG_FATAL, "%s", message);
+    exit(EXIT_FAILURE);
+}
+
+/* -------------------------------------------------------------------- */
+typedef struct options {
+    char               *pki;
+    char               *sname;
+    char               *tlsver;
+    mipki_state        *mipki;
+    mipki_config_entry  entry;
+    char               *ocsp;   /* DER OCSP response to staple, if any */
+} options_t;
+
+/* Stapled responses are refreshed between connections when they are
+ * valid for less than this many seconds */
+#define OCSP_REFRESH_MARGIN 300
+
+/* SIGHUP reloads the certificate and key, e.g. after a renewal */
+static volatile sig_atomic_t reload = 0;
+
+static void on_sighup(int sig) {
+    (void) sig;
+    reload = 1;
+}
+
+/* -------------------------------------------------------------------- */
+static void* MITLS_CALLCONV
+_cert_select(void *cbs, mitls_version ver,
+             const unsigned char *sni, size_t sni_len,
+             const unsigned char *alpn, size_t alpn_len,
+             const mitls_signature_scheme *sigalgs, size_t sigalgs_len,
+             mitls_signature_scheme *selected)
+{
+    options_t *options = (options_t*) cbs;
+
+    (void) ver; (void) alpn; (void) alpn_len;
+
+    /* Released by _cert_release when the connection is closed; there may
+     * be two selections per connection, e.g. after a HelloRetryRequest */
+    return (void*) mipki_select_certificate
+        (options->mipki, (const char*) sni, sni_len, sigalgs, sigalgs_len, selected);
+}
+
+static size_t MITLS_CALLCONV
+_cert_format(void *cbs, const void *cert, unsigned char *buffer)
+{
+    options_t *options = (options_t*) cbs;
+
+    return mipki_format_chain(options->mipki, cert, (char*) buffer, MAX_CHAIN_LEN);
+}
+
+static size_t MITLS_CALLCONV
+_cert_sign(void *cbs, const void *cert, const mitls_signature_scheme sigalg,
+           const unsigned char *tbs, size_t tbs_len, unsigned char *sig)
+{
+    options_t *options = (options_t*) cbs;
+    size_t     len     = MAX_SIGNATURE_LEN;
+
+    if (!mipki_sign_verify(options->mipki, cert, sigalg, (const char*) tbs, tbs_len,
+                           (char*) sig, &len, MIPKI_SIGN))
+        return 0;
+    return len;
+}
+
+static int MITLS_CALLCONV
+_cert_verify(void *cbs, const unsigned char *chain_bytes, size_t chain_len,
+             const mitls_signature_scheme sigalg,
+             const unsigned char *tbs, size_t tbs_len,
+             const unsigned char *sig, size_t sig_len)
+{
+    /* No client authentication */
+    (void) cbs; (void) chain_bytes; (void) chain_len; (void) sigalg;
+    (void) tbs; (void) tbs_len; (void) sig; (void) sig_len;
+    return 0;
+}
+
+static void MITLS_CALLCONV
+_cert_release(void *cbs, const void *cert)
+{
+    options_t *options = (options_t*) cbs;
+
+    mipki_free_chain(options->mipki, cert);
+}
+
+static mitls_cert_cb cert_callbacks = {
+    .select = _cert_select,
+    .format = _cert_format,
+    .sign   = _cert_sign,
+    .verify = _cert_verify,
+};
+
+/* -------------------------------------------------------------------- */
+/* Stands in for the OCSP responder: the response is read from $OCSP,
+ * e.g. as written by `openssl ocsp -respout`, whatever the request */
+static size_t MITLS_CALLCONV
+_ocsp_source(void *ctx, size_t entry, const char *url,
+             const char *req, size_t req_len, char *resp, size_t resp_max)
+{
+    options_t *options = (options_t*) ctx;
+    FILE      *input   = NULL;
+    size_t     len     = 0;
+
+    (void) entry; (void) url; (void) req; (void) req_len;
+
+    if ((input = fopen(options->ocsp, "rb")) == NULL) {
+        elog(LOG_ERROR, "cannot open OCSP response `%s'", options->ocsp);
+        return 0;
+    }
+    len = fread(resp, 1, resp_max, input);
+    if (!feof(input))
+        len = 0;
+    fclose(input);
+    return len;
+}
+
+static size_t MITLS_CALLCONV
+_cert_staple(void *cbs, const void *cert, unsigned char *buffer)
+{
+    options_t *options = (options_t*) cbs;
+
+    return mipki_get_ocsp_response(options->mipki, cert, (char*) buffer, MAX_OCSP_RESPONSE_LEN);
+}
+
+static mitls_cert_status_cb status_callbacks = {
+    .staple = _cert_staple,
+    .check  = NULL,
+};
+
+/* -------------------------------------------------------------------- */
+static int MITLS_CALLCONV _net_send(void *ctxt, const unsigned char *buffer, size_t len) {
+    int    fd   = *(int*) ctxt;
+    size_t sent = 0;
+
+    while (sent < len) {
+        int rr = send(fd, (const char*) &buffer[sent], len - sent, 0);
+
+        if (rr < 0 && GET_SOCKET_ERROR() == EINTR)
+            continue ;
+        if (rr <= 0)
+            return -1;
+        sent += rr;
+    }
+
+    return (int) len;
+}
+
+static int MITLS_CALLCONV _net_recv(void *ctxt, unsigned char *buffer, size_t len) {
+    int fd = *(int*) ctxt;
+
+    while (1) {
+        int rr = recv(fd, (char*) buffer, len, 0);
+
+        if (rr < 0 && GET_SOCKET_ERROR() == EINTR)
+            continue ;
+        return rr > 0 ? rr : -1;
+    }
+}
+
+/* -------------------------------------------------------------------- */
+static const int zero = 0;
+static const int one  = 1;
+
+int listener(void) {
+    int   servfd = -1;
+    in4_t sockname;
+
+    if ((servfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        e_error("socket(AF_INET, SOCK_STREAM)");
+
+    memset(&sockname, 0, sizeof(in4_t));
+    sockname.sin_family = AF_INET;
+    sockname.sin_addr   = (struct in_addr) { .s_addr = INADDR_ANY };
+    sockname.sin_port   = htons(5000);
+
+    setsockopt(servfd, SOL_SOCKET, SO_REUSEADDR, (void*) &one, sizeof(one));
+
+    if (bind(servfd, (sockaddr_t*) &sockname, sizeof(in4_t)) < 0)
+        e_error("cannot bind socket");
+    if (listen(servfd, 5) < 0)
+        e_error("cannot set socket in listening mode");
+
+    return servfd;
+}
+
+/* -------------------------------------------------------------------- */
+void server(int servfd, options_t *options) {
+    socklen_t peerlen = sizeof(in4_t);
+    in4_t     peername;
+    int       client;
+
+    mitls_state *state = NULL;
+
+    while (1) {
+        memset(&peername, 0, sizeof(peername));
+        if ((client = accept(servfd, (sockaddr_t*) &peername, &peerlen)) < 0)
+            e_error("accepting client");
+
+        if (reload) {
+            int erridx = 0;
+
+            reload = 0;
+            if (mipki_reload(options->mipki, &options->entry, 1, NULL, &erridx))
+                elog(LOG_INFO, "reloaded server certificate");
+            else
+                elog(LOG_ERROR, "cannot reload server certificate, keeping the current one");
+        }
+
+        /* A no-op while the stapled response is fresh */
+        if (options->ocsp != NULL && !mipki_refresh_ocsp(options->mipki, OCSP_REFRESH_MARGIN))
+            elog(LOG_ERROR, "no valid OCSP response to staple");
+
+        {   int ival = 128 * 1024;
+            int oval = 128 * 1024;
+            setsockopt(client, SOL_SOCKET, SO_RCVBUF, (void*) &ival, sizeof(ival));
+            setsockopt(client, SOL_SOCKET, SO_SNDBUF, (void*) &oval, sizeof(oval));
+        }
+
+        /* Every suite miTLS implements is enabled, as with "ALL:NULL" */
+        if (!FFI_mitls_configure(&state, options->tlsver, ""))
+            i_error("cannot configure miTLS");
+        if (!FFI_mitls_configure_cert_callbacks(state, options, &cert_callbacks)
+            || !FFI_mitls_configure_cert_release(state, _cert_release))
+            i_error("cannot configure miTLS certificate callbacks");
+        if (!FFI_mitls_configure_cert_status_callbacks(state, options, &status_callbacks))
+            i_error("cannot configure miTLS OCSP stapling");
+        if (!FFI_mitls_configure_read_ahead(state, 64 * 1024))
+            i_error("cannot configure miTLS read-ahead");
+
+        if (!FFI_mitls_accept_connected(&client, _net_send, _net_recv, state))
+            i_error("miTLS accept failed");
+
+        /* miTLS has no close_notify API: the client half-closes and
+           FFI_mitls_receive() fails on the TCP end of stream. */
+        while (1) {
+            size_t         len   = 0;
+            unsigned char *plain = FFI_mitls_receive(state, &len);
+
+            if (plain == NULL)
+                break ;
+            FFI_mitls_free(state, plain);
+        }
+
+        {   mitls_read_stats stats;
+
+            if (FFI_mitls_get_read_stats(state, &stats) && stats.records > 0)
+                elog(LOG_INFO, "%.2f recv calls per record",
+                     (double) stats.recv_calls / (double) stats.records);
+        }
+
+        FFI_mitls_close(state); state = NULL;
+        closesocket(client);
+    }
+}
+
+/* -------------------------------------------------------------------- */
+int main(void) {
+    options_t options;
+    int fd;
+
+    char *crtfile = NULL;
+    char *keyfile = NULL;
+    char *CApath  = NULL;
+    int   erridx  = 0;
+
+#ifdef WIN32
+    WSADATA WSAData;
+#endif
+
+    initialize_log4c();
+
+#ifdef WIN32
+    if (WSAStartup(MAKEWORD(2, 2), &WSAData) != 0) {
+        elog(LOG_FATAL, "cannot initialize winsocks");
+        return EXIT_FAILURE;
+    }
+#endif
+
+    memset(&options, 0, sizeof(options));
+    options.sname  = getenv("CERTNAME");
+    options.pki    = getenv("PKI");
+    options.tlsver = getenv("TLSVERSION");
+
+    if (options.pki == NULL)
+        i_error("no PKI directory given");
+    options.pki = xstrdup(options.pki);
+
+    if (options.sname == NULL)
+        i_error("no cert-name given");
+    options.sname = xstrdup(options.sname);
+
+    options.tlsver = xstrdup(options.tlsver ? options.tlsver : "1.2");
+
+    if ((options.ocsp = getenv("OCSP")) != NULL)
+        options.ocsp = xstrdup(options.ocsp);
+
+    if (!FFI_mitls_init())
+        i_error("cannot initialize miTLS");
+
+    crtfile = xjoin(options.pki, "/certificates/", options.sname, ".crt", NULL);
+    keyfile = xjoin(options.pki, "/certificates/", options.sname, ".key", NULL);
+
+    options.entry.cert_file    = crtfile;
+    options.entry.key_file     = keyfile;
+    options.entry.is_universal = 1;
+
+    if ((options.mipki = mipki_init(&options.entry, 1, NULL, &erridx)) == NULL)
+        i_error("cannot load server certificate");
+
+    /* OCSP responses are checked against the certificate issuer */
+    if (options.ocsp != NULL) {
+        CApath = xjoin(options.pki, "/db/ca.db.certs", NULL);
+        if (!mipki_add_root_file_or_path(options.mipki, CApath))
+            i_error("cannot load trusted CA path");
+        (void) mipki_set_ocsp_source(options.mipki, _ocsp_source, &options);
+        if (!mipki_refresh_ocsp(options.mipki, OCSP_REFRESH_MARGIN))
+            elog(LOG_ERROR, "cannot load OCSP response `%s'", options.ocsp);
+    }
+
+#ifndef WIN32
+    {   struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_sighup;
+        sa.sa_flags   = SA_RESTART;  /* accept() waits on */
+        (void) sigaction(SIGHUP, &sa, NULL);
+    }
+#endif
+
+    fd = listener();
+
+    server(fd, &options);
+
+    (void) closesocket(fd);
+
+    mipki_free(options.mipki);
+    free(crtfile);
+    free(keyfile);
+    free(CApath);
+    free(options.ocsp);
+    FFI_mitls_cleanup();
+
+#ifdef WIN32
+    (void) WSACleanup();
+#endif
+
+    return EXIT_SUCCESS;
+}
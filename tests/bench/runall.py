@@ -5,6 +5,7 @@ import sys, os, subprocess as sp
 
 # --------------------------------------------------------------------
 # BIN = './openssl-client.exe'
+# BIN = './mitls-client'
 # BIN = 'java -classpath "3rdparty/bcprov-ext-jdk15on-148.jar;jsse-client" JSSEClient'
 BIN = '../../BenchClient/bin/Release/BenchClient.exe'
 # BIN = 'bc/BCClient/bin/Release/BCClient.exe'
@@ -22,6 +23,16 @@ CONFIGS = [
     ('dsa', 'dsa.cert-01.mitls.org', 'TLS_DHE_DSS_WITH_AES_128_CBC_SHA256'),
     ('dsa', 'dsa.cert-01.mitls.org', 'TLS_DHE_DSS_WITH_AES_256_CBC_SHA'   ),
     ('dsa', 'dsa.cert-01.mitls.org', 'TLS_DHE_DSS_WITH_AES_256_CBC_SHA256'),
+    ('rsa', 'rsa.cert-01.mitls.org', 'TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256'      ),
+    ('rsa', 'rsa.cert-01.mitls.org', 'TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384'      ),
+    ('rsa', 'rsa.cert-01.mitls.org', 'TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256'),
+    ('rsa', 'rsa.cert-01.mitls.org', 'TLS_AES_128_GCM_SHA256'      , '1.3'),
+    ('rsa', 'rsa.cert-01.mitls.org', 'TLS_AES_256_GCM_SHA384'      , '1.3'),
+    ('rsa', 'rsa.cert-01.mitls.org', 'TLS_CHACHA20_POLY1305_SHA256', '1.3'),
+    ('ecdsa'  , 'ecdsa.cert-01.mitls.org'  , 'TLS_AES_128_GCM_SHA256', '1.3'),
+    ('ed25519', 'ed25519.cert-01.mitls.org', 'TLS_AES_128_GCM_SHA256', '1.3'),
+    ('ed448'  , 'ed448.cert-01.mitls.org'  , 'TLS_AES_128_GCM_SHA256', '1.3'),
+    ('ed25519', 'ed25519.cert-01.mitls.org', 'TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256'),
 ]
 
 # --------------------------------------------------------------------
@@ -42,6 +53,7 @@ def _main():
         environ['PKI']         = '../pki/%s' % (config[0],)
         environ['CERTNAME']    = config[1]
         environ['CIPHERSUITE'] = config[2]
+        environ['TLSVERSION']  = config[3] if len(config) > 3 else '1.2'
 
         sp.check_call(BIN, env = environ, shell = True)
 
@@ -0,0 +1,135 @@
+/* -------------------------------------------------------------------- */
+/* Server signing cost per signature scheme                             */
+/*                                                                      */
+/* usage: sigalg-bench [seconds] [mode...]                              */
+/*                                                                      */
+/* Loads $PKI/<mode>/certificates/<mode>.cert-01.mitls.org from the     */
+/* test PKI (tests/pki, make MODE=<mode> cert!<mode>.cert-01.mitls.org) */
+/* and signs a CertificateVerify-sized message through mipki for the    */
+/* given time. A full handshake signs once on the server, so the rate   */
+/* bounds the handshakes per second of one core; run mitls-server with  */
+/* the same certificate for the end-to-end figure.                      */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "mipki.h"
+
+#define MAX_SIGNATURE_LEN 8192
+
+/* -------------------------------------------------------------------- */
+typedef struct {
+  const char *mode;
+  const char *name;
+  mipki_signature scheme;
+} config_t;
+
+static const config_t configs[] = {
+  { "rsa"    , "rsa_pss_rsae_sha256"   , 0x0804 },
+  { "ecdsa"  , "ecdsa_secp256r1_sha256", 0x0403 },
+  { "ed25519", "ed25519"               , 0x0807 },
+  { "ed448"  , "ed448"                 , 0x0808 },
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -------------------------------------------------------------------- */
+static int bench(const char *pki, const config_t *c, double seconds)
+{
+  char crt[1024], key[1024], tbs[130], sig[MAX_SIGNATURE_LEN];
+  mipki_config_entry entry;
+  mipki_state *st = NULL;
+  mipki_chain chain;
+  mipki_signature selected = 0;
+  size_t len = 0;
+  uint64_t signs = 0, verifies = 0;
+  double start, sign_time, verify_time;
+  int erridx = 0, rc = 0;
+
+  snprintf(crt, sizeof(crt), "%s/%s/certificates/%s.cert-01.mitls.org.crt", pki, c->mode, c->mode);
+  snprintf(key, sizeof(key), "%s/%s/certificates/%s.cert-01.mitls.org.key", pki, c->mode, c->mode);
+
+  memset(&entry, 0, sizeof(entry));
+  entry.cert_file    = crt;
+  entry.key_file     = key;
+  entry.is_universal = 1;
+
+  if ((st = mipki_init(&entry, 1, NULL, &erridx)) == NULL) {
+    fprintf(stderr, "%-24s cannot load %s\n", c->name, crt);
+    return 0;
+  }
+
+  /* The server offers only this scheme, as a client preferring it would */
+  chain = mipki_select_certificate(st, "", 0, &c->scheme, 1, &selected);
+  if (chain == NULL || selected != c->scheme) {
+    fprintf(stderr, "%-24s not selected for %s\n", c->name, crt);
+    goto done;
+  }
+
+  /* 64 spaces, the context string, a separator and a SHA-256 transcript */
+  memset(tbs, 0x20, 64);
+  memcpy(tbs + 64, "TLS 1.3, server CertificateVerify", 33);
+  tbs[97] = 0;
+  memset(tbs + 98, 0x5a, 32);
+
+  start = now();
+  do {
+    len = sizeof(sig);
+    if (!mipki_sign_verify(st, chain, c->scheme, tbs, sizeof(tbs), sig, &len, MIPKI_SIGN)) {
+      fprintf(stderr, "%-24s signing failed\n", c->name);
+      goto done;
+    }
+    signs++;
+  } while ((sign_time = now() - start) < seconds);
+
+  start = now();
+  do {
+    size_t sig_len = len;
+    if (!mipki_sign_verify(st, chain, c->scheme, tbs, sizeof(tbs), sig, &sig_len, MIPKI_VERIFY)) {
+      fprintf(stderr, "%-24s verification failed\n", c->name);
+      goto done;
+    }
+    verifies++;
+  } while ((verify_time = now() - start) < seconds);
+
+  printf("%-24s %10.0f %12.0f %10zu\n", c->name,
+         signs / sign_time, verifies / verify_time, len);
+  rc = 1;
+
+ done:
+  mipki_free(st);
+  return rc;
+}
+
+/* -------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+  const char *pki = getenv("PKI");
+  double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+  int rc = EXIT_SUCCESS;
+
+  if (pki == NULL)
+    pki = "../pki";
+
+  printf("%-24s %10s %12s %10s\n", "scheme", "signs/s", "verifies/s", "sig bytes");
+
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    int selected = argc <= 2;
+
+    for (int j = 2; j < argc; ++j)
+      if (strcmp(argv[j], configs[i].mode) == 0)
+        selected = 1;
+    if (selected && !bench(pki, &configs[i], seconds))
+      rc = EXIT_FAILURE;
+  }
+
+  return rc;
+}
@@ -17,9 +17,15 @@ CIPHERS = [
     ('TLS_DHE_DSS_WITH_AES_128_CBC_SHA256', ('DHE', 'AES128', 'SHA256')),
     ('TLS_DHE_DSS_WITH_AES_256_CBC_SHA'   , ('DHE', 'AES256', 'SHA')),
     ('TLS_DHE_DSS_WITH_AES_256_CBC_SHA256', ('DHE', 'AES256', 'SHA256')),
+    ('TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256'      , ('ECDHE', 'AES128-GCM', 'SHA256')),
+    ('TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384'      , ('ECDHE', 'AES256-GCM', 'SHA384')),
+    ('TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256', ('ECDHE', 'CHACHA20'  , 'SHA256')),
+    ('TLS_AES_128_GCM_SHA256'                     , ('1.3'  , 'AES128-GCM', 'SHA256')),
+    ('TLS_AES_256_GCM_SHA384'                     , ('1.3'  , 'AES256-GCM', 'SHA384')),
+    ('TLS_CHACHA20_POLY1305_SHA256'               , ('1.3'  , 'CHACHA20'  , 'SHA256')),
 ]
 
-NAMES = ('mitls-bc', 'mitls-ossl', 'openssl', 'oracle-jsse-1.7')
+NAMES = ('mitls-bc', 'mitls-ossl', 'mitls', 'openssl', 'oracle-jsse-1.7')
 
 # --------------------------------------------------------------------
 def _main():
@@ -41,6 +47,7 @@ def _main():
         del clfilter
 
     contents = [os.path.join('results', server, x + '.txt') for x in clients]
+    contents = [x for x in contents if os.path.exists(x)]
     contents = [(x, open(x, 'rb').read().splitlines()) for x in contents]
 
     result = dict()
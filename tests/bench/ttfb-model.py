@@ -0,0 +1,82 @@
+#! /usr/bin/env python
+
+# --------------------------------------------------------------------
+# MODEL, not a measurement: nothing here runs miTLS or sends packets.
+#
+# Time to first decryptable byte with full-size and dynamically sized
+# TLS records, computed for an idealised link (in the spirit of netem):
+# a fixed RTT and bottleneck bandwidth, TCP slow start from an initial
+# window, no loss, no delayed acks, no Nagle and no scheduling delays.
+# A record can only be decrypted once its last segment has arrived.
+# Compare policies with it; measure real timings with a real stack.
+#
+# Usage: ttfb-model.py [rtt-ms] [bandwidth-mbps] [response-kb] [initcwnd]
+#
+# The dynamic policy mirrors FFI_mitls_configure_record_size: small
+# records until ramp bytes have been sent, then full-size ones.
+
+from __future__ import print_function
+import sys
+
+MSS = 1460
+OVERHEAD = 22          # TLS 1.3 record header, content type and AEAD tag
+MAX_RECORD = 16384
+
+# --------------------------------------------------------------------
+def records(total, small, ramp):
+    sent, out = 0, []
+    while sent < total:
+        size = small if small and sent < ramp else MAX_RECORD
+        size = min(size, total - sent)
+        out.append(size)
+        sent += size
+    return out
+
+def arrivals(nbytes, rtt, bw, initcwnd):
+    # arrival time (ms) of each MSS segment of the stream
+    times, cwnd, start, seg = [], initcwnd, 0.0, 0
+    nsegs = (nbytes + MSS - 1) // MSS
+    while seg < nsegs:
+        burst = min(cwnd, nsegs - seg)
+        for i in range(burst):
+            times.append(start + rtt / 2.0 + (i + 1) * MSS * 8 / (bw * 1000.0))
+        seg += burst
+        # the next window is clocked by the acks of this one
+        start = max(start + rtt, times[-1] + rtt / 2.0)
+        cwnd *= 2
+    return times
+
+def decryptable(recs, rtt, bw, initcwnd):
+    wire = sum(r + OVERHEAD for r in recs)
+    times = arrivals(wire, rtt, bw, initcwnd)
+    end, out, plain = 0, [], 0
+    for r in recs:
+        end += r + OVERHEAD
+        plain += r
+        out.append((times[(end - 1) // MSS], plain))
+    return out
+
+def report(name, recs, rtt, bw, initcwnd):
+    points = decryptable(recs, rtt, bw, initcwnd)
+    first = points[0][0]
+    half = next(t for t, p in points if p * 2 >= points[-1][1])
+    print('%-22s records=%-5d first=%8.1fms  half=%8.1fms  all=%8.1fms' %
+          (name, len(recs), first, half, points[-1][0]))
+
+# --------------------------------------------------------------------
+def _main():
+    rtt = float(sys.argv[1]) if len(sys.argv) > 1 else 100.0
+    bw = float(sys.argv[2]) if len(sys.argv) > 2 else 5.0
+    total = int(sys.argv[3]) * 1024 if len(sys.argv) > 3 else 256 * 1024
+    initcwnd = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+
+    print('modelled link: rtt=%gms bandwidth=%gMbps response=%dKB initcwnd=%d' %
+          (rtt, bw, total // 1024, initcwnd))
+    report('full (16384)', records(total, 0, 0), rtt, bw, initcwnd)
+    for small in (1400, 4096):
+        report('dynamic (%d, 1MB)' % small, records(total, small, 1024 * 1024),
+               rtt, bw, initcwnd)
+
+# --------------------------------------------------------------------
+if __name__ == '__main__':
+    _main()
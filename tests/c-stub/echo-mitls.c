@@ -0,0 +1,387 @@
+/* -------------------------------------------------------------------- */
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+
+#ifndef WIN32
+# include <poll.h>
+#else
+# define poll WSAPoll
+#endif
+
+#include "mitlsffi.h"
+#include "mipki.h"
+
+#include "echo-log.h"
+#include "echo-memory.h"
+#include "echo-net.h"
+#include "echo-mitls.h"
+
+/* -------------------------------------------------------------------- */
+#define PLAINBUF 16384
+#define READAHEAD 65536
+
+struct evmitls_s {
+    mipki_state *pki;
+    char        *version;
+    char        *sname;
+    char        *ciphers;
+    int          server;
+};
+
+typedef struct engine {
+    evmitls_t       *context;
+    evutil_socket_t  netfd;
+    evutil_socket_t  plainfd;
+} engine_t;
+
+/* -------------------------------------------------------------------- */
+static void* MITLS_CALLCONV
+_cert_select(void *cbs, mitls_version ver,
+             const unsigned char *sni, size_t sni_len,
+             const unsigned char *alpn, size_t alpn_len,
+             const mitls_signature_scheme *sigalgs, size_t sigalgs_len,
+             mitls_signature_scheme *selected)
+{
+    evmitls_t *the = (evmitls_t*) cbs;
+
+    (void) ver; (void) alpn; (void) alpn_len;
+
+    return (void*) mipki_select_certificate
+        (the->pki, (const char*) sni, sni_len, sigalgs, sigalgs_len, selected);
+}
+
+static size_t MITLS_CALLCONV
+_cert_format(void *cbs, const void *cert, unsigned char *buffer)
+{
+    evmitls_t *the = (evmitls_t*) cbs;
+
+    return mipki_format_chain(the->pki, cert, (char*) buffer, MAX_CHAIN_LEN);
+}
+
+static size_t MITLS_CALLCONV
+_cert_sign(void *cbs, const void *cert, const mitls_signature_scheme sigalg,
+           const unsigned char *tbs, size_t tbs_len, unsigned char *sig)
+{
+    evmitls_t *the = (evmitls_t*) cbs;
+    size_t     len = MAX_SIGNATURE_LEN;
+
+    if (!mipki_sign_verify(the->pki, cert, sigalg, (const char*) tbs, tbs_len,
+                           (char*) sig, &len, MIPKI_SIGN))
+        return 0;
+    return len;
+}
+
+static int MITLS_CALLCONV
+_cert_verify(void *cbs, const unsigned char *chain_bytes, size_t chain_len,
+             const mitls_signature_scheme sigalg,
+             const unsigned char *tbs, size_t tbs_len,
+             const unsigned char *sig, size_t sig_len)
+{
+    evmitls_t  *the   = (evmitls_t*) cbs;
+    mipki_chain chain = NULL;
+    size_t      len   = sig_len;
+    int         rr    = 0;
+
+    chain = mipki_parse_chain(the->pki, (const char*) chain_bytes, chain_len);
+    if (chain == NULL)
+        return 0;
+
+    if (mipki_validate_chain(the->pki, chain, the->sname ? the->sname : ""))
+        rr = mipki_sign_verify(the->pki, chain, sigalg, (const char*) tbs, tbs_len,
+                               (char*) sig, &len, MIPKI_VERIFY);
+
+    mipki_free_chain(the->pki, chain);
+    return rr;
+}
+
+static void MITLS_CALLCONV
+_cert_release(void *cbs, const void *cert)
+{
+    evmitls_t *the = (evmitls_t*) cbs;
+
+    mipki_free_chain(the->pki, cert);
+}
+
+static mitls_cert_cb cert_callbacks = {
+    .select = _cert_select,
+    .format = _cert_format,
+    .sign   = _cert_sign,
+    .verify = _cert_verify,
+};
+
+/* -------------------------------------------------------------------- */
+static int sendall(evutil_socket_t fd, const unsigned char *buffer, size_t len) {
+    while (len > 0) {
+        int rr = send(fd, (const char*) buffer, len, 0);
+
+        if (rr < 0 && EVUTIL_SOCKET_ERROR() == ERR(EINTR))
+            continue ;
+        if (rr <= 0)
+            return -1;
+        buffer += rr;
+        len    -= rr;
+    }
+    return 0;
+}
+
+static int MITLS_CALLCONV _net_send(void *ctxt, const unsigned char *buffer, size_t len) {
+    engine_t *engine = (engine_t*) ctxt;
+
+    return sendall(engine->netfd, buffer, len) < 0 ? -1 : (int) len;
+}
+
+static int MITLS_CALLCONV _net_recv(void *ctxt, unsigned char *buffer, size_t len) {
+    engine_t *engine = (engine_t*) ctxt;
+
+    while (1) {
+        int rr = recv(engine->netfd, (char*) buffer, len, 0);
+
+        if (rr < 0 && EVUTIL_SOCKET_ERROR() == ERR(EINTR))
+            continue ;
+        return rr > 0 ? rr : -1;
+    }
+}
+
+/* -------------------------------------------------------------------- */
+static mitls_state* _configure(evmitls_t *the) {
+    mitls_state *state = NULL;
+
+    if (!FFI_mitls_configure(&state, the->version, the->server ? "" : the->sname))
+        return NULL;
+
+    if (!FFI_mitls_configure_cert_callbacks(state, the, &cert_callbacks)
+        || !FFI_mitls_configure_cert_release(state, _cert_release))
+        goto bailout;
+
+    /* _net_recv returns what the socket has */
+    if (!FFI_mitls_configure_read_ahead(state, READAHEAD))
+        goto bailout;
+
+    if (the->ciphers != NULL)
+        if (!FFI_mitls_configure_cipher_suites(state, the->ciphers))
+            goto bailout;
+
+    return state;
+
+ bailout:
+    FFI_mitls_close(state);
+    return NULL;
+}
+
+/* -------------------------------------------------------------------- */
+/* Shuttles between the TLS connection and the plaintext pair until both
+ * directions are closed. Each EOF is forwarded as a half-close. */
+static void* _engine(void *arg) {
+    engine_t     *engine = (engine_t*) arg;
+    evmitls_t    *the    = engine->context;
+    mitls_state  *state  = NULL;
+    unsigned char buffer[PLAINBUF];
+    unsigned char inbuf[READAHEAD];
+    int           netin  = 1, plainin = 1, more = 0;
+    int           rr;
+
+    if ((state = _configure(the)) == NULL) {
+        elog(LOG_ERROR, "cannot configure miTLS");
+        goto bailout;
+    }
+
+    if (the->server)
+        rr = FFI_mitls_accept_connected(engine, _net_send, _net_recv, state);
+    else
+        rr = FFI_mitls_connect(engine, _net_send, _net_recv, state);
+
+    if (!rr) {
+        elog(LOG_ERROR, "miTLS handshake failed");
+        goto bailout;
+    }
+
+    /* The peer's first records may have been read with its last flight */
+    more = FFI_mitls_pending(state);
+
+    while (netin || plainin) {
+        struct pollfd fds[2];
+        int pending = netin && more;
+
+        fds[0].fd = engine->netfd  ; fds[0].events = netin   ? POLLIN : 0;
+        fds[1].fd = engine->plainfd; fds[1].events = plainin ? POLLIN : 0;
+        fds[0].revents = fds[1].revents = 0;
+
+        /* Records already read ahead do not show on the socket */
+        if (poll(fds, 2, pending ? 0 : -1) < 0) {
+            if (EVUTIL_SOCKET_ERROR() == ERR(EINTR))
+                continue ;
+            break ;
+        }
+
+        if (pending)
+            fds[0].revents |= POLLIN;
+
+        if (fds[0].revents) {
+            /* Blocks until a whole record is in */
+            size_t len = 0;
+
+            rr = FFI_mitls_receive_into(state, inbuf, sizeof(inbuf), &len, &more);
+            if (rr == TLS_receive_data) {
+                if (sendall(engine->plainfd, inbuf, len) < 0)
+                    break ;
+            } else if (rr != TLS_receive_would_block) {
+                (void) shutdown(engine->plainfd, SHUT_WR);
+                netin = 0; more = 0;
+            }
+        }
+
+        if (fds[1].revents) {
+            rr = recv(engine->plainfd, (char*) buffer, sizeof(buffer), 0);
+
+            if (rr <= 0) {
+                (void) shutdown(engine->netfd, SHUT_WR);
+                plainin = 0;
+            } else if (!FFI_mitls_send(state, buffer, rr)) {
+                elog(LOG_ERROR, "miTLS send failed");
+                break ;
+            }
+        }
+    }
+
+ bailout:
+    if (state != NULL)
+        FFI_mitls_close(state);
+    (void) EVUTIL_CLOSESOCKET(engine->netfd);
+    (void) EVUTIL_CLOSESOCKET(engine->plainfd);
+    free(engine);
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------- */
+evmitls_t* evmitls_init(const char *pki, const char *sname,
+                        const char *ciphers, const char *version,
+                        int isserver)
+{
+    evmitls_t          *the     = NULL;
+    /*-*/ char         *crtfile = NULL;
+    /*-*/ char         *keyfile = NULL;
+    /*-*/ char         *CApath  = NULL;
+    mipki_config_entry  entry;
+    int                 erridx  = 0;
+
+    if (version == NULL || (strcmp(version, "1.2") && strcmp(version, "1.3"))) {
+        elog(LOG_FATAL, "the mitls backend supports TLS_1p2 and TLS_1p3 only");
+        return NULL;
+    }
+
+    if (isserver && sname == NULL) {
+        elog(LOG_FATAL, "the mitls backend needs a server name (--server-name)");
+        return NULL;
+    }
+
+    if (!FFI_mitls_init()) {
+        elog(LOG_FATAL, "cannot initialize miTLS");
+        return NULL;
+    }
+
+    /* See echo-mitls.h: results must be reported with these */
+    elog(LOG_WARN, "mitls backend: one thread and socket pair per connection, not a bufferevent filter");
+    elog(LOG_WARN, "mitls backend: the FFI lock is held across transport I/O, so concurrent connections serialize");
+
+    the = NEW(evmitls_t, 1);
+    the->server  = isserver;
+    the->version = xstrdup(version);
+    the->sname   = sname   ? xstrdup(sname)   : NULL;
+    the->ciphers = ciphers ? xstrdup(ciphers) : NULL;
+
+    memset(&entry, 0, sizeof(entry));
+
+    if (isserver) {
+        crtfile = xjoin(pki, "/certificates/", sname, ".crt", NULL);
+        keyfile = xjoin(pki, "/certificates/", sname, ".key", NULL);
+        entry.cert_file    = crtfile;
+        entry.key_file     = keyfile;
+        entry.is_universal = 1;
+    }
+
+    CApath = xjoin(pki, "/db/ca.db.certs", NULL);
+
+    if ((the->pki = mipki_init(&entry, isserver ? 1 : 0, NULL, &erridx)) == NULL) {
+        elog(LOG_FATAL, "cannot load certificate `%s' (entry %d)",
+             crtfile ? crtfile : "", erridx);
+        goto bailout;
+    }
+
+    if (!mipki_add_root_file_or_path(the->pki, CApath)) {
+        elog(LOG_FATAL, "cannot load trusted CA path");
+        goto bailout;
+    }
+
+    if (crtfile != NULL) free(crtfile);
+    if (keyfile != NULL) free(keyfile);
+    free(CApath);
+
+    return the;
+
+ bailout:
+    if (crtfile != NULL) free(crtfile);
+    if (keyfile != NULL) free(keyfile);
+    if (CApath  != NULL) free(CApath);
+
+    evmitls_free(the);
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------- */
+void evmitls_free(evmitls_t *the) {
+    if (the->pki != NULL)
+        mipki_free(the->pki);
+    if (the->version != NULL) free(the->version);
+    if (the->sname   != NULL) free(the->sname);
+    if (the->ciphers != NULL) free(the->ciphers);
+    free(the);
+}
+
+/* -------------------------------------------------------------------- */
+evutil_socket_t evmitls_start(evmitls_t *the, evutil_socket_t fd) {
+    evutil_socket_t  pair[2] = { -1, -1 };
+    engine_t        *engine  = NULL;
+    pthread_t        thread;
+    pthread_attr_t   attr;
+    int              family;
+
+#ifdef WIN32
+    family = AF_INET;
+#else
+    family = AF_UNIX;
+#endif
+
+    if (evutil_socketpair(family, SOCK_STREAM, 0, pair) < 0) {
+        elog(LOG_ERROR, "cannot create plaintext socket pair");
+        (void) EVUTIL_CLOSESOCKET(fd);
+        return -1;
+    }
+
+    engine = NEW(engine_t, 1);
+    engine->context = the;
+    engine->netfd   = fd;
+    engine->plainfd = pair[1];
+
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attr, &_engine, engine) != 0) {
+        elog(LOG_ERROR, "cannot create miTLS engine thread");
+        (void) pthread_attr_destroy(&attr);
+        (void) EVUTIL_CLOSESOCKET(fd);
+        (void) EVUTIL_CLOSESOCKET(pair[0]);
+        (void) EVUTIL_CLOSESOCKET(pair[1]);
+        free(engine);
+        return -1;
+    }
+
+    (void) pthread_attr_destroy(&attr);
+
+    return pair[0];
+}
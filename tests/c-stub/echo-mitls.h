@@ -0,0 +1,45 @@
+/* -------------------------------------------------------------------- */
+#ifndef ECHO_MITLS_H__
+# define ECHO_MITLS_H__
+
+/* -------------------------------------------------------------------- */
+#include "echo-net.h"
+
+/* -------------------------------------------------------------------- */
+/* miTLS backend.
+ *
+ * The miTLS FFI is blocking: FFI_mitls_accept_connected, _connect and
+ * _receive call back into the host until they are done. Each connection
+ * therefore gets an engine thread that owns the network socket and runs
+ * miTLS on it, and exchanges plaintext with the event loop over a local
+ * socket pair. The event loop sees a plain socket bufferevent on its
+ * end of the pair and runs the exact same echo logic as with OpenSSL.
+ *
+ * Caveats when comparing figures with the OpenSSL backend, which is a
+ * bufferevent filter driven by the event loop:
+ *  - each miTLS connection costs a thread, a socket pair and a copy of
+ *    its plaintext through that pair;
+ *  - the FFI holds its global lock while it waits in the transport
+ *    callbacks, so engine threads serialize: one blocked in recv, e.g.
+ *    waiting for the peer's next handshake flight or the rest of a
+ *    record, stalls every other connection. Under concurrent load the
+ *    miTLS figures measure this lock rather than the protocol code.
+ * evmitls_init logs these caveats.
+ *
+ * This header does not depend on echo-ssl.h, whose version names clash
+ * with those of mitlsffi.h. */
+
+typedef struct evmitls_s evmitls_t;
+
+/* [version] is "1.2" or "1.3"; [sname] is required for servers, and
+ * names the certificate and key under [pki]/certificates */
+evmitls_t* evmitls_init(const char *pki, const char *sname,
+                        const char *ciphers, const char *version,
+                        int server);
+void evmitls_free(evmitls_t *context);
+
+/* Takes ownership of the network socket [fd] and starts its engine.
+ * Returns the event loop end of the plaintext pair, or -1. */
+evutil_socket_t evmitls_start(evmitls_t *context, evutil_socket_t fd);
+
+#endif /* !ECHO_MITLS_H__ */
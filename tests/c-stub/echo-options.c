@@ -22,6 +22,7 @@ enum {
     OPT_PKI     = 0x07,
     OPT_CLIENT  = 0x08,
     OPT_DHDIR   = 0x09,
+    OPT_BACKEND = 0x0a,
 };
 
 
@@ -36,6 +37,7 @@ static const struct option long_options[] = {
     {"pki"          , required_argument, 0, OPT_PKI    },
     {"client"       , no_argument      , 0, OPT_CLIENT },
     {"dhDB-dir"     , required_argument, 0, OPT_DHDIR  },
+    {"backend"      , required_argument, 0, OPT_BACKEND},
     {NULL           , 0                , 0, 0          },
 };
 
@@ -50,6 +52,7 @@ int _options(int argc, char *argv[], options_t *options) {
     const char     *dhdir   = "dhDB";
     const char     *pki     = "pki";
     /*-*/ tlsver_t  tlsver  = TLS_1p0;
+    /*-*/ backend_t backend = BACKEND_OPENSSL;
     /*-*/ int       client  = 0;
 
     while (1) {
@@ -80,6 +83,14 @@ int _options(int argc, char *argv[], options_t *options) {
             }
             break ;
 
+        case OPT_BACKEND:
+            backend = backend_of_name(optarg);
+            if ((int) backend == -1) {
+                elog(LOG_FATAL, "invalid TLS backend: %s", optarg);
+                return -1;
+            }
+            break ;
+
         default:
             abort();
         }
@@ -103,6 +114,7 @@ int _options(int argc, char *argv[], options_t *options) {
 
     options->client = client;
     options->tlsver = tlsver;
+    options->backend = backend;
     options->dbdir  = xstrdup(dbdir);
     options->pki    = xstrdup(pki);
 
@@ -12,6 +12,7 @@ typedef struct options {
     int       client  ;
     in4_t     echoname;
     tlsver_t  tlsver  ;
+    backend_t backend ;
     char     *sname   ;
     char     *cname   ;
     char     *ciphers ;
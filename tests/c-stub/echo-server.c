@@ -12,6 +12,7 @@
 #include "echo-memory.h"
 #include "echo-options.h"
 #include "echo-ssl.h"
+#include "echo-mitls.h"
 #include "echo-net.h"
 #include "echo-server.h"
 
@@ -104,7 +105,9 @@ static void _server_onread(bufferevent_t *be, void *arg) {
         if (line == NULL)
             break ;
 
-        if (strcmp(line, "<renegotiate>") == 0) {
+        if (strcmp(line, "<renegotiate>") == 0 && stream->sslcontext == NULL) {
+            stelog(stream, LOG_INFO, "renegotiation not supported, ignored");
+        } else if (strcmp(line, "<renegotiate>") == 0) {
             stelog(stream, LOG_INFO, "starting renegotiation");
 
             if (bufferevent_ssl_renegotiate(be) < 0) {
@@ -198,6 +201,7 @@ static void _server_onerror(bufferevent_t *be, short what, void *arg) {
 /* -------------------------------------------------------------------- */
 typedef struct bindctxt {
     /*-*/ SSL_CTX   *sslcontext;
+    /*-*/ evmitls_t *mitls;
     const options_t *options;
 } bindctxt_t;
 
@@ -221,10 +225,29 @@ static void _server_onaccept(struct evconnlistener  *listener,
     stream->adsrc   = inet4_ntop_x((in4_t*) address);
     stream->addst   = inet4_ntop_x(&context->options->echoname);
 
-    evutil_make_socket_nonblocking(stream->fd);
-
     stelog(stream, LOG_INFO, "new client");
 
+    if (context->mitls != NULL) {
+        /* The engine thread owns the network socket from here on, and
+         * the stream works on the plaintext end of its pair */
+        if ((stream->fd = evmitls_start(context->mitls, fd)) < 0) {
+            elog(LOG_ERROR, "cannot start miTLS engine");
+            goto bailout;
+        }
+
+        evutil_make_socket_nonblocking(stream->fd);
+
+        stream->bevent =
+            bufferevent_socket_new(evconnlistener_get_base(listener),
+                                   stream->fd, BEV_OPT_DEFER_CALLBACKS);
+        bufferevent_setcb(stream->bevent, _server_onread, NULL, _server_onerror, stream);
+        bufferevent_enable(stream->bevent, EV_READ|EV_WRITE);
+
+        return ;
+    }
+
+    evutil_make_socket_nonblocking(stream->fd);
+
     if ((stream->sslcontext = SSL_new(context->sslcontext)) == NULL) {
         elog(LOG_ERROR, "cannot create SSL context");
         goto bailout;
@@ -262,6 +285,7 @@ int echo_server_setup(event_base_t *evb, const options_t *options) {
     echossl_t         echossl;
     bindctxt_t       *context    = NULL;
     SSL_CTX          *sslcontext = NULL;
+    evmitls_t        *mitls      = NULL;
     evconnlistener_t *acceptln   = NULL;
 
     memset(&echossl, 0, sizeof(echossl));
@@ -270,8 +294,16 @@ int echo_server_setup(event_base_t *evb, const options_t *options) {
     echossl.cname   = options->cname;
     echossl.pki     = options->pki;
     echossl.tlsver  = options->tlsver;
+    echossl.backend = options->backend;
 
-    if ((sslcontext = evssl_init(&echossl, 1)) == NULL) {
+    if (echossl.backend == BACKEND_MITLS) {
+        mitls = evmitls_init(echossl.pki, echossl.sname, echossl.ciphers,
+                             tlsversions[echossl.tlsver].dotted, 1);
+        if (mitls == NULL) {
+            elog(LOG_FATAL, "cannot create miTLS context");
+            goto bailout;
+        }
+    } else if ((sslcontext = evssl_init(&echossl, 1)) == NULL) {
         elog(LOG_FATAL, "cannot create SSL context");
         goto bailout;
     }
@@ -279,6 +311,7 @@ int echo_server_setup(event_base_t *evb, const options_t *options) {
     context = NEW(bindctxt_t, 1);
     context->options    = options;
     context->sslcontext = sslcontext;
+    context->mitls      = mitls;
 
     acceptln = evconnlistener_new_bind
         (evb, _server_onaccept, context,
@@ -299,6 +332,7 @@ int echo_server_setup(event_base_t *evb, const options_t *options) {
     if (acceptln   != NULL) evconnlistener_free(acceptln);
     if (context    != NULL) free(context);
     if (sslcontext != NULL) SSL_CTX_free(sslcontext);
+    if (mitls      != NULL) evmitls_free(mitls);
 
     return -1;
 }
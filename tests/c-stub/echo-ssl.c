@@ -12,10 +12,16 @@
 
 /* -------------------------------------------------------------------- */
 const struct tlsversion_s tlsversions[] = {
-    [SSL_3p0] = { SSL_3p0, "SSL_3p0"},
-    [TLS_1p0] = { TLS_1p0, "TLS_1p0"},
-    [TLS_1p1] = { TLS_1p1, "TLS_1p1"},
-    [TLS_1p2] = { TLS_1p2, "TLS_1p2"},
+    [SSL_3p0] = { SSL_3p0, "SSL_3p0", NULL },
+    [TLS_1p0] = { TLS_1p0, "TLS_1p0", "1.0"},
+    [TLS_1p1] = { TLS_1p1, "TLS_1p1", "1.1"},
+    [TLS_1p2] = { TLS_1p2, "TLS_1p2", "1.2"},
+    [TLS_1p3] = { TLS_1p3, "TLS_1p3", "1.3"},
+};
+
+const struct backend_s backends[] = {
+    [BACKEND_OPENSSL] = { BACKEND_OPENSSL, "openssl"},
+    [BACKEND_MITLS  ] = { BACKEND_MITLS  , "mitls"  },
 };
 
 /* -------------------------------------------------------------------- */
@@ -56,6 +62,19 @@ tlsver_t tlsver_of_name(const char *name) {
     return (tlsver_t) -1;
 }
 
+/* -------------------------------------------------------------------- */
+backend_t backend_of_name(const char *name) {
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(backends); ++i) {
+        const struct backend_s *p = &backends[i];
+        if (p->name != NULL && strcmp(p->name, name) == 0)
+            return p->backend;
+    }
+
+    return (backend_t) -1;
+}
+
 /* -------------------------------------------------------------------- */
 SSL_CTX* evssl_init(const echossl_t *options, int isserver) {
     /*-*/ SSL_CTX    *context = NULL;
@@ -87,7 +106,11 @@ SSL_CTX* evssl_init(const echossl_t *options, int isserver) {
         case TLS_1p0: method = TLSv1_server_method  (); break ;
         case TLS_1p1: method = TLSv1_1_server_method(); break ;
         case TLS_1p2: method = TLSv1_2_server_method(); break ;
-    
+
+        case TLS_1p3:
+            elog(LOG_FATAL, "TLS_1p3 requires the mitls backend");
+            goto bailout;
+
         default:
             abort();
         }
@@ -97,7 +120,11 @@ SSL_CTX* evssl_init(const echossl_t *options, int isserver) {
         case TLS_1p0: method = TLSv1_client_method  (); break ;
         case TLS_1p1: method = TLSv1_1_client_method(); break ;
         case TLS_1p2: method = TLSv1_2_client_method(); break ;
-    
+
+        case TLS_1p3:
+            elog(LOG_FATAL, "TLS_1p3 requires the mitls backend");
+            goto bailout;
+
         default:
             abort();
         }
@@ -11,17 +11,34 @@ typedef enum tlsversion_e {
     TLS_1p0 = 0x01,
     TLS_1p1 = 0x02,
     TLS_1p2 = 0x03,
+    TLS_1p3 = 0x04,             /* miTLS backend only */
 } tlsver_t;
 
 struct tlsversion_s {
     /*-*/ enum  tlsversion_e  version;
     const /*-*/ char         *name;
+    const /*-*/ char         *dotted;   /* as in FFI_mitls_configure */
 };
 
 extern const struct tlsversion_s tlsversions[];
 
 tlsver_t tlsver_of_name(const char *name);
 
+/* -------------------------------------------------------------------- */
+typedef enum backend_e {
+    BACKEND_OPENSSL = 0x00,
+    BACKEND_MITLS   = 0x01,
+} backend_t;
+
+struct backend_s {
+    /*-*/ enum  backend_e  backend;
+    const /*-*/ char      *name;
+};
+
+extern const struct backend_s backends[];
+
+backend_t backend_of_name(const char *name);
+
 /* -------------------------------------------------------------------- */
 typedef struct echossl_s {
     char     *ciphers;
@@ -29,6 +46,7 @@ typedef struct echossl_s {
     char     *cname  ;
     char     *pki    ;
     tlsver_t  tlsver ;
+    backend_t backend;
 } echossl_t;
 
 /* -------------------------------------------------------------------- */